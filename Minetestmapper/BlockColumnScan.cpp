@@ -0,0 +1,270 @@
+#include "BlockColumnScan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define COLUMNSCAN_X86
+#define COLUMNSCAN_SSSE3_TARGET __attribute__((target("ssse3")))
+#define COLUMNSCAN_AVX2_TARGET __attribute__((target("avx2")))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && defined(_M_X64)
+#define COLUMNSCAN_X86
+#define COLUMNSCAN_SSSE3_TARGET
+#define COLUMNSCAN_AVX2_TARGET
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+#if defined(COLUMNSCAN_X86) && !defined(__SSE2__) && !defined(_M_X64)
+// 32-bit build without SSE2: only the scalar version is available
+#undef COLUMNSCAN_X86
+#endif
+
+namespace BlockColumnScan {
+
+static inline const unsigned char *row(const unsigned char *mapData, int y, int z)
+{
+	return mapData + (((y << 4) + (z << 8)) << 1);
+}
+
+// Record y in the columns in found
+static inline void setTop(int8_t top[16], unsigned found, int y)
+{
+	for (int x = 0; found; x++, found >>= 1)
+		if (found & 1)
+			top[x] = static_cast<int8_t>(y);
+}
+
+// Record the visible and opaque nodes of row y in the columns that are still
+// pending. Returns false when all columns have an opaque node.
+static inline bool addRow(int8_t top[16], int8_t opaque[16], unsigned &pendingTop, unsigned &pendingOpaque,
+	unsigned visibleNodes, unsigned opaqueNodes, int y)
+{
+	setTop(top, visibleNodes & pendingTop, y);
+	pendingTop &= ~visibleNodes;
+	setTop(opaque, opaqueNodes & pendingOpaque, y);
+	pendingOpaque &= ~opaqueNodes;
+	return pendingOpaque != 0;
+}
+
+static inline void startColumns(int8_t top[16], int8_t opaque[16], unsigned done, unsigned &pendingTop, unsigned &pendingOpaque)
+{
+	for (int x = 0; x < 16; x++) {
+		top[x] = -1;
+		opaque[x] = -1;
+	}
+	pendingTop = ~done & 0xffffu;
+	pendingOpaque = pendingTop;
+}
+
+// One column at a time: without SIMD, classifying a whole row of nodes at
+// once does not pay off.
+static void findTopNodesScalar(const unsigned char *mapData, int minY, int maxY, const NodeMask &mask,
+	const std::array<uint16_t, 16> &done, int8_t top[16][16], int8_t opaque[16][16])
+{
+	for (int z = 0; z < 16; z++) {
+		for (int x = 0; x < 16; x++) {
+			top[z][x] = -1;
+			opaque[z][x] = -1;
+			if (done[z] & (1 << x))
+				continue;
+			for (int y = maxY; y >= minY; y--) {
+				const unsigned char *data = row(mapData, y, z) + (x << 1);
+				unsigned content = (data[0] << 8) | data[1];
+				if (content >= NodeMask::MaxIds) {
+					if (top[z][x] < 0)
+						top[z][x] = static_cast<int8_t>(y);
+					continue;
+				}
+				if (!((mask.visible[content >> 3] >> (content & 7)) & 1))
+					continue;
+				if (top[z][x] < 0)
+					top[z][x] = static_cast<int8_t>(y);
+				if ((mask.opaque[content >> 3] >> (content & 7)) & 1) {
+					opaque[z][x] = static_cast<int8_t>(y);
+					break;
+				}
+			}
+		}
+	}
+}
+
+#ifdef COLUMNSCAN_X86
+
+// The bits of a 32-byte bitmask for the bytes of ids (ids < 256): all ones
+// if the bit is set. The bitmask is in two vectors of 16 bytes.
+COLUMNSCAN_SSSE3_TARGET
+static inline __m128i lookupSSSE3(__m128i ids, __m128i bitmask0, __m128i bitmask1)
+{
+	const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+	__m128i index = _mm_and_si128(_mm_srli_epi16(ids, 3), _mm_set1_epi8(0x1f));
+	__m128i second = _mm_cmpeq_epi8(_mm_and_si128(index, _mm_set1_epi8(0x10)), _mm_set1_epi8(0x10));
+	__m128i bytes = _mm_or_si128(_mm_andnot_si128(second, _mm_shuffle_epi8(bitmask0, index)), _mm_and_si128(second, _mm_shuffle_epi8(bitmask1, index)));
+	__m128i bit = _mm_shuffle_epi8(bits, _mm_and_si128(ids, _mm_set1_epi8(7)));
+	return _mm_xor_si128(_mm_cmpeq_epi8(_mm_and_si128(bytes, bit), _mm_setzero_si128()), _mm_set1_epi8(-1));
+}
+
+// The visible and opaque nodes of a row of 16 nodes
+COLUMNSCAN_SSSE3_TARGET
+static inline void classifyRowSSSE3(const unsigned char *data, const __m128i table[4], unsigned &visibleNodes, unsigned &opaqueNodes)
+{
+	// Gather the low (second) and high (first) bytes of the big-endian ids
+	const __m128i lowBytes = _mm_setr_epi8(1, 3, 5, 7, 9, 11, 13, 15, -1, -1, -1, -1, -1, -1, -1, -1);
+	const __m128i highBytes = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, -1, -1, -1, -1, -1, -1, -1, -1);
+	__m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+	__m128i second = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 16));
+	__m128i ids = _mm_unpacklo_epi64(_mm_shuffle_epi8(first, lowBytes), _mm_shuffle_epi8(second, lowBytes));
+	__m128i high = _mm_unpacklo_epi64(_mm_shuffle_epi8(first, highBytes), _mm_shuffle_epi8(second, highBytes));
+	__m128i wide = _mm_xor_si128(_mm_cmpeq_epi8(high, _mm_setzero_si128()), _mm_set1_epi8(-1));
+	visibleNodes = static_cast<unsigned>(_mm_movemask_epi8(_mm_or_si128(wide, lookupSSSE3(ids, table[0], table[1]))));
+	opaqueNodes = static_cast<unsigned>(_mm_movemask_epi8(_mm_andnot_si128(wide, lookupSSSE3(ids, table[2], table[3]))));
+}
+
+static inline void loadTables(const NodeMask &mask, __m128i table[4])
+{
+	table[0] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(mask.visible));
+	table[1] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(mask.visible + 16));
+	table[2] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(mask.opaque));
+	table[3] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(mask.opaque + 16));
+}
+
+COLUMNSCAN_SSSE3_TARGET
+static void findTopNodesSSSE3(const unsigned char *mapData, int minY, int maxY, const NodeMask &mask,
+	const std::array<uint16_t, 16> &done, int8_t top[16][16], int8_t opaque[16][16])
+{
+	__m128i table[4];
+	loadTables(mask, table);
+	for (int z = 0; z < 16; z++) {
+		unsigned pendingTop, pendingOpaque;
+		startColumns(top[z], opaque[z], done[z], pendingTop, pendingOpaque);
+		for (int y = maxY; y >= minY && pendingOpaque; y--) {
+			unsigned visibleNodes, opaqueNodes;
+			classifyRowSSSE3(row(mapData, y, z), table, visibleNodes, opaqueNodes);
+			addRow(top[z], opaque[z], pendingTop, pendingOpaque, visibleNodes, opaqueNodes, y);
+		}
+	}
+}
+
+COLUMNSCAN_AVX2_TARGET
+static inline __m256i lookupAVX2(__m256i ids, __m256i bitmask0, __m256i bitmask1)
+{
+	const __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+		1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+	__m256i index = _mm256_and_si256(_mm256_srli_epi16(ids, 3), _mm256_set1_epi8(0x1f));
+	__m256i second = _mm256_cmpeq_epi8(_mm256_and_si256(index, _mm256_set1_epi8(0x10)), _mm256_set1_epi8(0x10));
+	__m256i bytes = _mm256_blendv_epi8(_mm256_shuffle_epi8(bitmask0, index), _mm256_shuffle_epi8(bitmask1, index), second);
+	__m256i bit = _mm256_shuffle_epi8(bits, _mm256_and_si256(ids, _mm256_set1_epi8(7)));
+	return _mm256_xor_si256(_mm256_cmpeq_epi8(_mm256_and_si256(bytes, bit), _mm256_setzero_si256()), _mm256_set1_epi8(-1));
+}
+
+// Scans two rows (y and y-1) at a time
+COLUMNSCAN_AVX2_TARGET
+static void findTopNodesAVX2(const unsigned char *mapData, int minY, int maxY, const NodeMask &mask,
+	const std::array<uint16_t, 16> &done, int8_t top[16][16], int8_t opaque[16][16])
+{
+	__m128i table[4];
+	loadTables(mask, table);
+	__m256i table256[4];
+	for (int i = 0; i < 4; i++)
+		table256[i] = _mm256_broadcastsi128_si256(table[i]);
+	// Per 128-bit lane (8 nodes): the low bytes of the ids, then the high bytes
+	const __m256i split = _mm256_setr_epi8(1, 3, 5, 7, 9, 11, 13, 15, 0, 2, 4, 6, 8, 10, 12, 14,
+		1, 3, 5, 7, 9, 11, 13, 15, 0, 2, 4, 6, 8, 10, 12, 14);
+
+	for (int z = 0; z < 16; z++) {
+		unsigned pendingTop, pendingOpaque;
+		startColumns(top[z], opaque[z], done[z], pendingTop, pendingOpaque);
+		int y = maxY;
+		for (; y - 1 >= minY && pendingOpaque; y -= 2) {
+			__m256i upper = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(row(mapData, y, z))), split);
+			__m256i lower = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(row(mapData, y - 1, z))), split);
+			// Lane 0: nodes 0-7 of the upper and the lower row, lane 1: nodes 8-15
+			__m256i ids = _mm256_unpacklo_epi64(upper, lower);
+			__m256i high = _mm256_unpackhi_epi64(upper, lower);
+			__m256i wide = _mm256_xor_si256(_mm256_cmpeq_epi8(high, _mm256_setzero_si256()), _mm256_set1_epi8(-1));
+			unsigned visibleNodes = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_or_si256(wide, lookupAVX2(ids, table256[0], table256[1]))));
+			unsigned opaqueNodes = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_andnot_si256(wide, lookupAVX2(ids, table256[2], table256[3]))));
+			auto upperNodes = [](unsigned bits) { return (bits & 0xffu) | ((bits >> 8) & 0xff00u); };
+			auto lowerNodes = [](unsigned bits) { return ((bits >> 8) & 0xffu) | ((bits >> 16) & 0xff00u); };
+			if (addRow(top[z], opaque[z], pendingTop, pendingOpaque, upperNodes(visibleNodes), upperNodes(opaqueNodes), y))
+				addRow(top[z], opaque[z], pendingTop, pendingOpaque, lowerNodes(visibleNodes), lowerNodes(opaqueNodes), y - 1);
+		}
+		if (y == minY && pendingOpaque) {
+			unsigned visibleNodes, opaqueNodes;
+			classifyRowSSSE3(row(mapData, y, z), table, visibleNodes, opaqueNodes);
+			addRow(top[z], opaque[z], pendingTop, pendingOpaque, visibleNodes, opaqueNodes, y);
+		}
+	}
+}
+
+static bool haveSSSE3()
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 9)) != 0;
+#else
+	return __builtin_cpu_supports("ssse3");
+#endif
+}
+
+static bool haveAVX2()
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6)
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif // COLUMNSCAN_X86
+
+static Implementation selectImplementation()
+{
+#ifdef COLUMNSCAN_X86
+	if (haveAVX2())
+		return { findTopNodesAVX2, "avx2" };
+	if (haveSSSE3())
+		return { findTopNodesSSSE3, "ssse3" };
+#endif
+	return { findTopNodesScalar, "scalar" };
+}
+
+static const Implementation &selectedImplementation()
+{
+	static const Implementation implementation = selectImplementation();
+	return implementation;
+}
+
+void findTopNodes(const unsigned char *mapData, int minY, int maxY, const NodeMask &mask,
+	const std::array<uint16_t, 16> &done, int8_t top[16][16], int8_t opaque[16][16])
+{
+	selectedImplementation().function(mapData, minY, maxY, mask, done, top, opaque);
+}
+
+const char *implementation()
+{
+	return selectedImplementation().name;
+}
+
+std::vector<Implementation> implementations()
+{
+	std::vector<Implementation> all = { { findTopNodesScalar, "scalar" } };
+#ifdef COLUMNSCAN_X86
+	if (haveSSSE3())
+		all.push_back({ findTopNodesSSSE3, "ssse3" });
+	if (haveAVX2())
+		all.push_back({ findTopNodesAVX2, "avx2" });
+#endif
+	return all;
+}
+
+} // namespace BlockColumnScan
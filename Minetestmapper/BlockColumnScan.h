@@ -0,0 +1,67 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Find the topmost visible and the topmost opaque node in every column of a
+// map block.
+//
+// Scanning a column from the top, nodes that are not drawn at all (usually
+// air) are skipped, and the first opaque node ends the column. This finds
+// both nodes for all 256 columns of a block at once, using a bitmask of the
+// content ids of the block, and SIMD instructions if possible (AVX2 or SSSE3,
+// detected at runtime). Only the columns in which visible nodes must be
+// blended (i.e. the topmost visible node is not opaque) need to be rendered
+// node by node.
+namespace BlockColumnScan {
+
+	// The classification of the content ids 0 ... MaxIds - 1 of a block. Other
+	// ids (which are rare) are visible, and not opaque.
+	struct NodeMask {
+		static constexpr const int MaxIds = 256;
+		uint8_t visible[MaxIds / 8];	// Bit (id & 7) of byte id >> 3
+		uint8_t opaque[MaxIds / 8];	// Opaque nodes must be visible as well
+
+		// All ids visible, none opaque (e.g. the ids that are not in the mapping)
+		void reset()
+		{
+			memset(visible, 0xff, sizeof(visible));
+			memset(opaque, 0, sizeof(opaque));
+		}
+		void set(unsigned id, bool isVisible, bool isOpaque)
+		{
+			if (id >= MaxIds)
+				return;
+			uint8_t bit = static_cast<uint8_t>(1 << (id & 7));
+			visible[id >> 3] = isVisible ? visible[id >> 3] | bit : visible[id >> 3] & ~bit;
+			opaque[id >> 3] = isVisible && isOpaque ? opaque[id >> 3] | bit : opaque[id >> 3] & ~bit;
+		}
+	};
+
+	// mapData:	node contents of a block of version 24 or later (2 bytes per node, big-endian)
+	// minY, maxY:	range of y coordinates to scan
+	// mask:	the visible and opaque content ids
+	// done:	for every z, a bitmask of the x coordinates that need not be scanned
+	// top:		for every z and x, the y coordinate of the topmost visible node in
+	//		minY..maxY, or -1 if there is none.
+	// opaque:	for every z and x, the y coordinate of the topmost opaque node in
+	//		minY..maxY, or -1 if there is none.
+	void findTopNodes(const unsigned char *mapData, int minY, int maxY, const NodeMask &mask,
+		const std::array<uint16_t, 16> &done, int8_t top[16][16], int8_t opaque[16][16]);
+
+	// Name of the implementation used (e.g. "avx2")
+	const char *implementation();
+
+	typedef void (*FindTopNodes)(const unsigned char *mapData, int minY, int maxY, const NodeMask &mask,
+		const std::array<uint16_t, 16> &done, int8_t top[16][16], int8_t opaque[16][16]);
+	struct Implementation {
+		FindTopNodes function;
+		const char *name;
+	};
+	// All implementations that can be used on this computer (to compare
+	// them, e.g. in a benchmark), the scalar one first
+	std::vector<Implementation> implementations();
+
+} // namespace BlockColumnScan
@@ -218,7 +218,9 @@ void HeightMapColorsFileParser::parseLine(const std::string & line, std::string
 			color[1] = tmp;
 		}
 	}
-	iline >> std::ws;
+	// Skipping whitespace at the end of the line would fail
+	if (!iline.fail() && !iline.eof())
+		iline >> std::ws;
 	if (iline.fail() || !iline.eof()) {
 		std::cerr << filename << ":" << linenr << ": bad line in heightmap colors file (" << line << ")" << std::endl;
 		return;
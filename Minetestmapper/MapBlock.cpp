@@ -1,8 +1,11 @@
 #include "MapBlock.h"
 
+#include "NodeNameTable.h"
 #include "TileGenerator.h"
 #include "ZlibDecompressor.h"
 
+#include <string_view>
+
 using namespace std;
 
 static inline void checkDataLimit(const char *type, size_t offset, size_t length, size_t dataLength)
@@ -23,44 +26,45 @@ static inline uint16_t readU16(const unsigned char *data, size_t offset, size_t
 	return data[offset] << 8 | data[offset + 1];
 }
 
-static inline string readString(const unsigned char *data, size_t offset, size_t length, size_t dataLength)
+static inline std::string_view readString(const unsigned char *data, size_t offset, size_t length, size_t dataLength)
 {
 	checkDataLimit("string", offset, length, dataLength);
-	return string(reinterpret_cast<const char *>(data) + offset, length);
+	return std::string_view(reinterpret_cast<const char *>(data) + offset, length);
 }
 
-void MapBlock::setData(const std::vector<unsigned char>& data)
+// Every thread reuses its own decompressor for all blocks it decodes
+static ZlibDecompressor &threadDecompressor()
 {
-	empty = data.empty();
+	static thread_local ZlibDecompressor decompressor;
+	return decompressor;
+}
 
-	if (!empty) {
-		deserialize(data);
-	}
+void MapBlock::setData(const std::vector<unsigned char>& data)
+{
+	setData(data.data(), data.size(), threadDecompressor());
 }
 
 void MapBlock::setData(const unsigned char *data, size_t size)
+{
+	setData(data, size, threadDecompressor());
+}
+
+void MapBlock::setData(const unsigned char *data, size_t size, ZlibDecompressor &decompressor)
 {
 	empty = size == 0;
 
 	if (!empty) {
-		deserialize(data, size);
+		deserialize(data, size, decompressor);
 	}
 }
 
 int MapBlock::readBlockContent(int datapos) const
 {
-	//auto mapData = this->mapData.data(); // no noticeable speed improovement
 	if (version >= 24) {
-		size_t index = static_cast<size_t>(datapos) << 1;
-		return (mapData[index] << 8) | mapData[index + 1];
+		return readBlockContent<ContentWide>(datapos);
 	}
 	else if (version >= 20) {
-		if (mapData[datapos] <= 0x80) {
-			return mapData[datapos];
-		}
-		else {
-			return (int(mapData[datapos]) << 4) | (int(mapData[datapos + 0x2000]) >> 4);
-		}
+		return readBlockContent<ContentSplit>(datapos);
 	}
 	else {
 		std::ostringstream oss;
@@ -69,7 +73,7 @@ int MapBlock::readBlockContent(int datapos) const
 	}
 }
 
-inline void MapBlock::deserialize(const unsigned char *data, size_t length)
+inline void MapBlock::deserialize(const unsigned char *data, size_t length, ZlibDecompressor &decompressor)
 {
 	version = readU8(data, 0, length);
 	//uint8_t flags = readU8(data, 1, length);
@@ -87,9 +91,9 @@ inline void MapBlock::deserialize(const unsigned char *data, size_t length)
 
 	// Zlib header: 2; Deflate header: >=1
 	checkDataLimit("zlib", dataOffset, 3, length);
-	ZlibDecompressor decompressor(data, length);
+	decompressor.setData(data, length);
 	decompressor.setSeekPos(dataOffset);
-	mapData = decompressor.decompressNodes();
+	decompressor.decompressNodes(mapData.data(), mapData.size());
 	checkBlockNodeDataLimit();
 	decompressor.decompressVoid();
 	//auto mapMetadata = decompressor.decompress();
@@ -127,16 +131,15 @@ inline void MapBlock::deserialize(const unsigned char *data, size_t length)
 		dataOffset++; // mapping version
 		uint16_t numMappings = readU16(data, dataOffset, length);
 		dataOffset += 2;
+		NodeNameTable &nameTable = NodeNameTable::instance();
+		nodeMappings.reserve(numMappings);
 		for (int i = 0; i < numMappings; ++i) {
-			int nodeId = readU16(data, dataOffset, length);
+			uint16_t nodeId = readU16(data, dataOffset, length);
 			dataOffset += 2;
 			uint16_t nameLen = readU16(data, dataOffset, length);
 			dataOffset += 2;
-			string name = readString(data, dataOffset, nameLen, length);
-			//size_t end = name.find_first_of('\0');
-			//if (end != std::string::npos)
-			//	name.erase(end);
-			nodeId2NodeName.emplace(nodeId, name);
+			std::string_view name = readString(data, dataOffset, nameLen, length);
+			nodeMappings.push_back({ nodeId, nameTable.intern(name) });
 			dataOffset += nameLen;
 		}
 	}
@@ -150,11 +153,6 @@ inline void MapBlock::deserialize(const unsigned char *data, size_t length)
 	}
 }
 
-inline void MapBlock::deserialize(const std::vector<unsigned char>& vdata)
-{
-	deserialize(vdata.data(), vdata.size());
-}
-
 void MapBlock::checkBlockNodeDataLimit()
 {
 	size_t dataLength = mapData.size();
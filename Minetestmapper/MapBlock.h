@@ -1,15 +1,26 @@
 #pragma once
 
 #include "BlockPos.h"
+#include "NodeNameTable.h"
 #include "ZlibDecompressor.h"
 
-#include <string>
-#include <unordered_map>
+#include <cstdint>
 #include <vector>
 
 class MapBlock
 {
 public:
+	// Maps a block-local node id to a NodeNameTable id
+	struct NodeMapping {
+		uint16_t nodeId;
+		int nameId;
+	};
+	// Layout of the node content ids in the node data
+	enum ContentEncoding {
+		ContentWide = 0,	// Version 24+: 16 bit big-endian ids
+		ContentSplit = 1,	// Version 20-23: 8 bit ids, extended by 4 bits of param2
+	};
+
 	MapBlock() = default;
 	~MapBlock() = default;
 
@@ -27,14 +38,14 @@ public:
 	}
 
 	void reset() {
-		nodeId2NodeName.clear();
+		nodeMappings.clear();
 		//mapData.clear();
 		empty = true;
 		version = 0;
 	}
-	const std::unordered_map<int, std::string> &getMappings() const { return nodeId2NodeName; }
+	const std::vector<NodeMapping> &getMappings() const { return nodeMappings; }
 	const BlockPos &getPos() const { return pos; }
-	//const std::vector<unsigned char> &getMapData() const { return mapData; }
+	const unsigned char *getMapData() const { return mapData.data(); }
 	int getVersion() const { return version; }
 	bool isEmpty() const { return empty; }
 
@@ -44,27 +55,46 @@ public:
 	{
 		setData(static_cast<const unsigned char*>(data), size);
 	}
+	// Use the given decompressor instead of the calling thread's default one
+	void setData(const unsigned char * data, size_t size, ZlibDecompressor &decompressor);
 	void setPos(const BlockPos &p) { pos = p; }
 
+	int readBlockContent(int datapos) const;
+	// Version is checked when the block is deserialized: only valid for 20+
+	ContentEncoding getContentEncoding() const { return version >= 24 ? ContentWide : ContentSplit; }
+	template<ContentEncoding Encoding>
 	int readBlockContent(int datapos) const;
 
-	bool onlyAir() const { return nodeId2NodeName.size() == 1 && nodeId2NodeName.at(0) == "air"; }
+	bool onlyAir() const { return nodeMappings.size() == 1 && nodeMappings[0].nameId == NodeNameTable::Air; }
 
 	// not shure if this will be true a single time. Why should minetest generate a mapblock and fill it with ignore only?
-	bool onlyIgnore() const { return nodeId2NodeName.size() == 1 && nodeId2NodeName.at(0) == "ignore"; }
+	bool onlyIgnore() const { return nodeMappings.size() == 1 && nodeMappings[0].nameId == NodeNameTable::Ignore; }
 
 private:
-	std::unordered_map<int, std::string> nodeId2NodeName;
+	std::vector<NodeMapping> nodeMappings;
 	//std::vector<unsigned char> mapData;
 	std::array<unsigned char, ZlibDecompressor::nodesBlockSize> mapData;
 	BlockPos pos;
 	int version = 0;
 	bool empty = true;
 
-	void deserialize(const unsigned char * data, size_t length);
-	void deserialize(const std::vector<unsigned char> &vdata);
+	void deserialize(const unsigned char * data, size_t length, ZlibDecompressor &decompressor);
 
 	void checkBlockNodeDataLimit();
 
 };
 
+template<MapBlock::ContentEncoding Encoding>
+inline int MapBlock::readBlockContent(int datapos) const
+{
+	if constexpr (Encoding == ContentWide) {
+		size_t index = static_cast<size_t>(datapos) << 1;
+		return (mapData[index] << 8) | mapData[index + 1];
+	}
+	else {
+		if (mapData[datapos] <= 0x80)
+			return mapData[datapos];
+		else
+			return (int(mapData[datapos]) << 4) | (int(mapData[datapos + 0x2000]) >> 4);
+	}
+}
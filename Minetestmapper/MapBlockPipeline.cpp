@@ -0,0 +1,203 @@
+#include "MapBlockPipeline.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+#include "util.h"
+
+MapBlockPipeline::MapBlockPipeline(DB *db, const std::list<BlockPos> &positions, int workers, int queueDepth, CacheLookup isCached) :
+	m_db(db),
+	m_positions(positions),
+	m_isCached(std::move(isCached)),
+	m_slots(std::max(queueDepth, 1)),
+	m_blockCount(static_cast<long long>(positions.size())),
+	m_completeColumn(columnKey(BlockPos(INT32_MIN, 0, INT32_MIN)))
+{
+	m_fetcher = std::thread(&MapBlockPipeline::fetchBlocks, this);
+	for (int i = 0; i < std::max(workers, 1); i++)
+		m_workers.emplace_back(&MapBlockPipeline::decodeBlocks, this);
+}
+
+MapBlockPipeline::~MapBlockPipeline()
+{
+	stop();
+}
+
+void MapBlockPipeline::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_slotFreed.notify_all();
+	m_blockFetched.notify_all();
+	if (m_fetcher.joinable())
+		m_fetcher.join();
+	for (auto &worker : m_workers)
+		if (worker.joinable())
+			worker.join();
+}
+
+const MapBlock &MapBlockPipeline::next()
+{
+	Slot &s = advance();
+	m_haveCurrent = true;
+	if (s.error)
+		std::rethrow_exception(s.error);
+	if (s.skipped)
+		throw std::logic_error("Map block pipeline: block requested after its column was completed");
+	return s.block;
+}
+
+void MapBlockPipeline::skip()
+{
+	Slot &s = advance();
+	m_haveCurrent = true;
+	if (!s.skipped)
+		m_statistics.blocksDiscarded++;
+}
+
+void MapBlockPipeline::columnComplete(const BlockPos &pos)
+{
+	m_completeColumn = columnKey(pos);
+}
+
+MapBlockPipeline::Slot &MapBlockPipeline::advance()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (m_haveCurrent) {
+		Slot &current = slot(m_consumed);
+		current.state = SlotState::Free;
+		current.error = nullptr;
+		m_readyCount--;
+		m_consumed++;
+		m_haveCurrent = false;
+		m_slotFreed.notify_one();
+	}
+	if (m_consumed >= m_blockCount)
+		throw std::logic_error("Map block pipeline: no more blocks");
+
+	m_statistics.samples++;
+	m_statistics.fetchQueueDepthSum += m_fetchedCount;
+	m_statistics.readyQueueDepthSum += m_readyCount;
+	m_statistics.fetchQueueDepthMax = std::max(m_statistics.fetchQueueDepthMax, m_fetchedCount);
+	m_statistics.readyQueueDepthMax = std::max(m_statistics.readyQueueDepthMax, m_readyCount);
+
+	Slot &s = slot(m_consumed);
+	auto ready = [&] { return s.state == SlotState::Ready && s.sequence == m_consumed; };
+	if (!ready()) {
+		m_statistics.renderStalls++;
+		m_blockReady.wait(lock, ready);
+	}
+	return s;
+}
+
+void MapBlockPipeline::fetchBlocks()
+{
+	long long sequence = 0;
+	for (const BlockPos &pos : m_positions) {
+		Slot &s = slot(sequence);
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			auto free = [&] { return m_stop || s.state == SlotState::Free; };
+			if (!free()) {
+				m_statistics.fetchStalls++;
+				m_slotFreed.wait(lock, free);
+			}
+			if (m_stop)
+				return;
+			s.sequence = sequence;
+		}
+
+		// The slot is owned by the fetcher until it is handed to a worker
+		s.pos = pos;
+		s.skipped = columnKey(pos) == m_completeColumn;
+		s.data.clear();
+		if (!s.skipped) {
+			try {
+				m_db->getBlockDataOnPos(pos, s.data);
+			}
+			catch (...) {
+				s.error = std::current_exception();
+			}
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (s.skipped || s.error) {
+				if (s.skipped)
+					m_statistics.blocksSkipped++;
+				s.state = SlotState::Ready;
+				m_readyCount++;
+				m_blockReady.notify_one();
+			}
+			else {
+				m_statistics.blocksFetched++;
+				s.state = SlotState::Fetched;
+				m_fetchedCount++;
+				m_decodeQueue.push_back(sequence);
+				m_blockFetched.notify_one();
+			}
+		}
+		sequence++;
+	}
+}
+
+void MapBlockPipeline::decodeBlocks()
+{
+	ZlibDecompressor decompressor;
+	while (true) {
+		long long sequence;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			auto available = [&] { return m_stop || !m_decodeQueue.empty(); };
+			if (!available()) {
+				m_statistics.decodeStalls++;
+				m_blockFetched.wait(lock, available);
+			}
+			if (m_stop)
+				return;
+			sequence = m_decodeQueue.front();
+			m_decodeQueue.pop_front();
+		}
+
+		// The slot is owned by this worker until it is marked ready
+		Slot &s = slot(sequence);
+		s.skipped = columnKey(s.pos) == m_completeColumn;
+		s.cached = false;
+		if (!s.skipped && m_isCached && !s.data.empty()) {
+			s.dataHash = hashBytes(s.data.data(), s.data.size());
+			try {
+				s.cached = m_isCached(s.pos, s.dataHash);
+			}
+			catch (...) {
+				s.error = std::current_exception();
+			}
+		}
+		if (!s.skipped && !s.cached && !s.error) {
+			s.block.reset();
+			s.block.setPos(s.pos);
+			try {
+				s.block.setData(s.data.data(), s.data.size(), decompressor);
+			}
+			catch (...) {
+				s.error = std::current_exception();
+			}
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (s.skipped)
+				m_statistics.blocksSkipped++;
+			else if (s.cached)
+				m_statistics.blocksCached++;
+			else
+				m_statistics.blocksDecoded++;
+			s.state = SlotState::Ready;
+			m_fetchedCount--;
+			m_readyCount++;
+			m_blockReady.notify_one();
+		}
+	}
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "BlockPos.h"
+#include "MapBlock.h"
+#include "db.h"
+
+// Fetches and decodes map blocks ahead of the renderer.
+//
+// A single fetch thread reads the block data from the database, in the order
+// of the position list, and a pool of worker threads decodes the blocks. The
+// (single) consumer obtains the decoded blocks in exactly the same order as
+// the position list using next().
+//
+// The number of blocks that are fetched, but not yet consumed, is bounded by
+// the queue depth.
+//
+// Optionally, the workers hash the data of every block, and do not decode the
+// blocks for which isCached() returns true.
+class MapBlockPipeline
+{
+public:
+	struct Statistics {
+		long long blocksFetched{ 0 };		// Blocks read from the database
+		long long blocksDecoded{ 0 };		// Blocks decoded by the workers
+		long long blocksCached{ 0 };		// Blocks not decoded, because they are cached
+		long long blocksSkipped{ 0 };		// Blocks not fetched or not decoded, because their column was complete
+		long long blocksDiscarded{ 0 };		// Blocks fetched, but not needed by the consumer
+		long long fetchStalls{ 0 };		// Fetcher waited for a free slot
+		long long decodeStalls{ 0 };		// Worker waited for a fetched block
+		long long renderStalls{ 0 };		// Consumer waited for a decoded block
+		long long fetchQueueDepthSum{ 0 };	// Sum of the fetched-but-undecoded blocks, sampled by the consumer
+		long long readyQueueDepthSum{ 0 };	// Sum of the decoded-but-unconsumed blocks, sampled by the consumer
+		int fetchQueueDepthMax{ 0 };
+		int readyQueueDepthMax{ 0 };
+		long long samples{ 0 };
+	};
+
+	using CacheLookup = std::function<bool(const BlockPos &pos, uint64_t dataHash)>;
+
+	// isCached is called by the workers, concurrently
+	MapBlockPipeline(DB *db, const std::list<BlockPos> &positions, int workers, int queueDepth, CacheLookup isCached = nullptr);
+	~MapBlockPipeline();
+
+	// Return the next block. Rethrows any error that occurred while fetching
+	// or decoding it.
+	const MapBlock &next();
+	// The data of the block returned by next(), its hash, and whether it is
+	// cached (and not decoded). The hash is only computed if isCached was given.
+	uint64_t dataHash() const { return m_slots[m_consumed % m_slots.size()].dataHash; }
+	bool cached() const { return m_slots[m_consumed % m_slots.size()].cached; }
+	const std::vector<unsigned char> &data() const { return m_slots[m_consumed % m_slots.size()].data; }
+	// Consume the next block without using it.
+	void skip();
+	// Signal that no further blocks of the column containing pos are needed.
+	// Blocks of that column that have not been fetched or decoded yet, will not be.
+	void columnComplete(const BlockPos &pos);
+	// Stop and wait for the fetch and decode threads.
+	void stop();
+
+	int workers() const { return static_cast<int>(m_workers.size()); }
+	int queueDepth() const { return static_cast<int>(m_slots.size()); }
+	// Only consistent after stop()
+	const Statistics &statistics() const { return m_statistics; }
+
+private:
+	enum class SlotState {
+		Free,
+		Fetched,
+		Ready
+	};
+	struct Slot {
+		SlotState state{ SlotState::Free };
+		long long sequence{ -1 };
+		BlockPos pos;
+		bool skipped{ false };
+		bool cached{ false };
+		uint64_t dataHash{ 0 };
+		std::vector<unsigned char> data;
+		MapBlock block;
+		std::exception_ptr error;
+	};
+
+	DB *m_db;
+	const std::list<BlockPos> &m_positions;
+	CacheLookup m_isCached;
+	std::vector<Slot> m_slots;
+	long long m_blockCount;
+	long long m_consumed{ 0 };		// Sequence number of the next block to consume
+	bool m_haveCurrent{ false };		// A slot has been handed out by next()
+	bool m_stop{ false };
+	int m_fetchedCount{ 0 };		// Number of slots in state Fetched
+	int m_readyCount{ 0 };			// Number of slots in state Ready
+	std::deque<long long> m_decodeQueue;
+	std::atomic<int64_t> m_completeColumn;
+	Statistics m_statistics;
+
+	std::mutex m_mutex;
+	std::condition_variable m_slotFreed;
+	std::condition_variable m_blockFetched;
+	std::condition_variable m_blockReady;
+	std::thread m_fetcher;
+	std::vector<std::thread> m_workers;
+
+	Slot &slot(long long sequence) { return m_slots[sequence % m_slots.size()]; }
+	static int64_t columnKey(const BlockPos &pos) { return (int64_t(pos.x()) << 32) | uint32_t(pos.z()); }
+	Slot &advance();
+	void fetchBlocks();
+	void decodeBlocks();
+}; /* -----  end of class MapBlockPipeline  ----- */
@@ -17,9 +17,11 @@
 #include <cstring>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <utility>
 
 #include "CharEncodingConverter.h"
@@ -106,12 +108,22 @@ int Mapper::start(int argc, char *argv[]) {
 		{ "prescan-world", PARG_REQARG, nullptr, OPT_PRESCAN_WORLD },
 		{ "sqlite-cacheworldrow", PARG_NOARG, nullptr, OPT_SQLITE_CACHEWORLDROW },
 		{ "sqlite3-limit-prescan-query-size", PARG_OPTARG, nullptr, OPT_SQLITE_LIMIT_PRESCAN_QUERY },
+		{ "sqlite3-read-ahead", PARG_OPTARG, nullptr, OPT_SQLITE_READ_AHEAD },
+		{ "sqlite3-io-profile", PARG_REQARG, nullptr, OPT_SQLITE_IO_PROFILE },
 		{ "tiles", PARG_REQARG, nullptr, 't' },
 		{ "tileorigin", PARG_REQARG, nullptr, 'T' },
 		{ "tilecenter", PARG_REQARG, nullptr, 'T' },
 		{ "tilebordercolor", PARG_REQARG, nullptr, 'B' },
 		{ "scalefactor", PARG_REQARG, nullptr, OPT_SCALEFACTOR },
 		{ "chunksize", PARG_REQARG, nullptr, OPT_CHUNKSIZE },
+		{ "threads", PARG_REQARG, nullptr, OPT_THREADS },
+		{ "parallel-strips", PARG_NOARG, nullptr, OPT_PARALLEL_STRIPS },
+		{ "extra-output", PARG_REQARG, nullptr, OPT_EXTRA_OUTPUT },
+		{ "stream-output", PARG_NOARG, nullptr, OPT_STREAM_OUTPUT },
+		{ "tiled-output", PARG_OPTARG, nullptr, OPT_TILED_OUTPUT },
+		{ "png-compression", PARG_REQARG, nullptr, OPT_PNG_COMPRESSION },
+		{ "incremental", PARG_NOARG, nullptr, OPT_INCREMENTAL },
+		{ "surface-cache", PARG_REQARG, nullptr, OPT_SURFACE_CACHE },
 		{ "silence-suggestions", PARG_REQARG, nullptr, OPT_SILENCE_SUGGESTIONS },
 		{ "verbose", PARG_OPTARG, nullptr, 'v' },
 		{ "verbose-search-colors", PARG_OPTARG, nullptr, OPT_VERBOSE_SEARCH_COLORS },
@@ -126,7 +138,18 @@ int Mapper::start(int argc, char *argv[]) {
 
 		parg_init(&ps);
 
-		while ((c = parg_getopt_long(&ps, argc, argv, "hi:o:", long_options, &option_index)) != -1) {
+		std::vector<std::string> extraOutputSpecs;
+		std::vector<bool> extraOutputArgs(argc, false);	// The arguments of --extra-output options
+		bool incremental = false;
+		ostringstream incrementalSettings;	// The arguments of the options which affect the map
+		int optionStart;
+		while ((optionStart = ps.optind, c = parg_getopt_long(&ps, argc, argv, "hi:o:", long_options, &option_index)) != -1) {
+			if (c != 'v' && c != OPT_VERBOSE_SEARCH_COLORS && c != OPT_PROGRESS_INDICATOR && c != OPT_THREADS && c != OPT_PARALLEL_STRIPS
+				&& c != OPT_SQLITE_READ_AHEAD && c != OPT_SQLITE_IO_PROFILE) {
+				// Including a separate argument of the option
+				for (int i = optionStart; i < ps.optind; i++)
+					incrementalSettings << argv[i] << '\n';
+			}
 
 			switch (c) {
 			case '?':
@@ -240,6 +263,32 @@ int Mapper::start(int argc, char *argv[]) {
 #endif
 				}
 				break;
+			case OPT_SQLITE_READ_AHEAD:
+				if (!ps.optarg || !*ps.optarg) {
+#ifdef USE_SQLITE3
+					DBSQLite3::setReadAheadSize();
+#endif
+				}
+				else {
+					if (!isdigit(ps.optarg[0])) {
+						std::cerr << "Invalid parameter to '" << long_options[option_index].name << "': must be a positive number" << std::endl;
+						usage();
+						return EXIT_FAILURE;
+					}
+#ifdef USE_SQLITE3
+					DBSQLite3::setReadAheadSize(atoi(ps.optarg));
+#endif
+				}
+				break;
+			case OPT_SQLITE_IO_PROFILE:
+#ifdef USE_SQLITE3
+				if (!DBSQLite3::setIOProfile(strlower(ps.optarg))) {
+					std::cerr << "Invalid parameter to '" << long_options[option_index].name << "': '" << ps.optarg << "'" << std::endl;
+					usage();
+					return EXIT_FAILURE;
+				}
+#endif
+				break;
 			case OPT_HEIGHTMAP:
 				generator.setHeightMap(true);
 				heightMap = true;
@@ -431,17 +480,17 @@ int Mapper::start(int argc, char *argv[]) {
 				break;
 			case 'e': {
 				generator.setDrawAlpha(true);
-				const string optarg = strlower(ps.optarg);
+				const string optarg = strlower(ps.optarg ? ps.optarg : "");
 				if (optarg.empty())
-					PixelAttribute::setMixMode(PixelAttribute::AlphaMixAverage);
+					generator.setAlphaMixMode(PixelAttribute::AlphaMixAverage);
 				else if (optarg == "cumulative" || optarg == "nodarken")
 					// "nodarken" is supported for backwards compatibility
-					PixelAttribute::setMixMode(PixelAttribute::AlphaMixCumulative);
+					generator.setAlphaMixMode(PixelAttribute::AlphaMixCumulative);
 				else if (optarg == "darken" || optarg == "cumulative-darken")
 					// "darken" is supported for backwards compatibility
-					PixelAttribute::setMixMode(PixelAttribute::AlphaMixCumulativeDarken);
+					generator.setAlphaMixMode(PixelAttribute::AlphaMixCumulativeDarken);
 				else if (optarg == "average")
-					PixelAttribute::setMixMode(PixelAttribute::AlphaMixAverage);
+					generator.setAlphaMixMode(PixelAttribute::AlphaMixAverage);
 				else if (optarg == "none")
 					generator.setDrawAlpha(false);
 				else {
@@ -524,6 +573,92 @@ int Mapper::start(int argc, char *argv[]) {
 				generator.setChunkSize(size);
 			}
 								break;
+			case OPT_THREADS: {
+				int threads;
+				if (string(ps.optarg) == "auto") {
+					threads = static_cast<int>(std::thread::hardware_concurrency());
+					if (threads < 1)
+						threads = 1;
+				}
+				else {
+					istringstream iss;
+					iss.str(ps.optarg);
+					iss >> threads;
+					if (iss.fail() || threads < 1) {
+						std::cerr << "Invalid number of threads (" << ps.optarg << ")" << std::endl;
+						usage();
+						return EXIT_FAILURE;
+					}
+				}
+				generator.setThreads(threads);
+			}
+								break;
+			case OPT_PARALLEL_STRIPS:
+				generator.setParallelStrips(true);
+				break;
+			case OPT_EXTRA_OUTPUT:
+				extraOutputSpecs.push_back(ps.optarg);
+				for (int i = optionStart; i < ps.optind; i++)
+					extraOutputArgs[i] = true;
+				break;
+			case OPT_STREAM_OUTPUT:
+				generator.setStreamOutput(true);
+				break;
+			case OPT_TILED_OUTPUT: {
+				int size = 256;
+				int levels = 1;
+				if (ps.optarg && *ps.optarg) {
+					istringstream iss;
+					iss.str(ps.optarg);
+					iss >> size;
+					if (!iss.fail() && !iss.eof()) {
+						char comma;
+						iss >> comma >> levels;
+						if (comma != ',')
+							iss.setstate(std::ios::failbit);
+					}
+					if (iss.fail() || !iss.eof() || size < 1 || levels < 1 || levels > 24) {
+						std::cerr << "Invalid tiled output specification (" << ps.optarg << ")" << std::endl;
+						usage();
+						return EXIT_FAILURE;
+					}
+					if (levels > 1 && size % 2) {
+						std::cerr << "The tile size must be even when generating multiple zoom levels (" << ps.optarg << ")" << std::endl;
+						usage();
+						return EXIT_FAILURE;
+					}
+				}
+				generator.setTiledOutput(size, levels);
+			}
+								break;
+			case OPT_PNG_COMPRESSION: {
+				int level = -1;
+				PngEncoder::Filter filter = PngEncoder::Filter::Default;
+				string spec = ps.optarg;
+				size_t comma = spec.find(',');
+				string levelSpec = spec.substr(0, comma);
+				bool valid = true;
+				if (levelSpec != "default") {
+					istringstream iss(levelSpec);
+					iss >> level;
+					valid = !iss.fail() && iss.eof() && level >= 0 && level <= 9;
+				}
+				if (valid && comma != string::npos)
+					valid = PngEncoder::parseFilter(spec.substr(comma + 1), filter);
+				if (!valid) {
+					std::cerr << "Invalid PNG compression specification (" << ps.optarg << ")" << std::endl;
+					usage();
+					return EXIT_FAILURE;
+				}
+				generator.setPngCompression(level, filter);
+			}
+								break;
+			case OPT_INCREMENTAL:
+				incremental = true;
+				break;
+			case OPT_SURFACE_CACHE:
+				generator.setSurfaceCache(ps.optarg);
+				break;
 			case OPT_SCALEFACTOR: {
 				istringstream arg;
 				arg.str(ps.optarg);
@@ -855,11 +990,20 @@ int Mapper::start(int argc, char *argv[]) {
 			}
 		}
 
+		// Options which do not affect the map are not part of the settings
+		if (incremental)
+			generator.setIncremental(incrementalSettings.str());
+
 		if (input.empty() || output.empty()) {
 			std::cerr << "Input (world directory) or output (PNG filename) missing" << std::endl;
 			usage();
 			return 0;
 		}
+		for (const std::string &spec : extraOutputSpecs) {
+			int result = addExtraOutput(argc, argv, extraOutputArgs, spec);
+			if (result)
+				return result;
+		}
 	}
 	catch (std::runtime_error e) {
 		std::cout << "Command-line error: " << e.what() << std::endl;
@@ -875,6 +1019,10 @@ int Mapper::start(int argc, char *argv[]) {
 		else {
 			parseDataFile(generator, input, nodeColorsFile, nodeColorsDefaultFile, &TileGenerator::parseNodeColorsFile);
 		}
+		if (prepareOnly)
+			return 0;
+		for (const std::unique_ptr<Mapper> &extra : extraOutputs)
+			generator.addExtraOutput(&extra->generator, extra->output);
 		generator.generate(input, output);
 	}
 	catch (std::runtime_error e) {
@@ -882,6 +1030,7 @@ int Mapper::start(int argc, char *argv[]) {
 		return 1;
 	}
 	auto end = std::chrono::high_resolution_clock::now();
+	std::cout << "Writing image took:  " << generator.writeImageTime() << "ms" << std::endl;
 	std::cout << "Mapping took:  " << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() << "ms" << std::endl;
 	return 0;
 }
@@ -933,6 +1082,8 @@ void Mapper::usage()
 		"  --prescan-world=full|auto|disabled\n"
 #ifdef USE_SQLITE3
 		"  --sqlite3-limit-prescan-query-size[=n]\n"
+		"  --sqlite3-read-ahead[=<megabytes>]\n"
+		"  --sqlite3-io-profile default|mmap|snapshot[,readahead]\n"
 #endif
 		"  --geometry <geometry>\n"
 		"\t(Warning: has a compatibility mode - see README.rst)\n"
@@ -948,6 +1099,14 @@ void Mapper::usage()
 		"  --tilecenter <x>,<y>|world|map\n"
 		"  --scalefactor 1:<n>\n"
 		"  --chunksize <size>\n"
+		"  --threads <n>|auto\n"
+		"  --parallel-strips\n"
+		"  --extra-output '<output> [<option> ...]'\n"
+		"  --stream-output\n"
+		"  --tiled-output[=<size>[,<zoomlevels>]]\n"
+		"  --png-compression <level>|default[,none|sub|up|average|paeth|adaptive]\n"
+		"  --incremental\n"
+		"  --surface-cache <file>\n"
 		"  --silence-suggestions all,prefetch,sqlite3-lock\n"
 		"  --verbose[=n]\n"
 		"  --verbose-search-colors[=n]\n"
@@ -977,6 +1136,84 @@ void Mapper::usage()
 	std::cout << executableName << ' ' << options_text;
 }
 
+// An extra output is specified as '<output> [<option> ...]'. Its options
+// are those of the main map, followed by the given options, which may only
+// change how the map is drawn (not the area of the map). Words are separated
+// by whitespace, and may be quoted (using " or ') to include whitespace.
+int Mapper::addExtraOutput(int argc, char *argv[], const std::vector<bool> &skipArgs, const std::string &spec)
+{
+	// The allowed options, and whether they take a separate argument
+	static const std::map<std::string, bool> allowedOptions = {
+		{ "colors", true }, { "heightmap", false }, { "heightmap-nodes", true }, { "heightmap-colors", true },
+		{ "heightmap-yscale", true }, { "height-level-0", true }, { "scalefactor", true }, { "noshading", false },
+		{ "drawalpha", false }, { "bgcolor", true }, { "blockcolor", true }, { "drawscale", false },
+		{ "drawheightscale", false },
+	};
+	std::vector<std::string> words;
+	std::string word;
+	bool inWord = false;
+	char quote = 0;
+	for (char c : spec) {
+		if (quote) {
+			if (c == quote)
+				quote = 0;
+			else
+				word += c;
+		}
+		else if (c == '"' || c == '\'') {
+			quote = c;
+			inWord = true;
+		}
+		else if (isspace(static_cast<unsigned char>(c))) {
+			if (inWord)
+				words.push_back(word);
+			word.clear();
+			inWord = false;
+		}
+		else {
+			word += c;
+			inWord = true;
+		}
+	}
+	if (quote)
+		throw std::runtime_error("Unterminated quote in --extra-output '" + spec + "'");
+	if (inWord)
+		words.push_back(word);
+	if (words.empty())
+		throw std::runtime_error("Missing output file name for --extra-output");
+	for (size_t i = 1; i < words.size(); i++) {
+		if (words[i].empty() || words[i][0] != '-')
+			throw std::runtime_error("Unexpected argument '" + words[i] + "' in --extra-output '" + spec + "'");
+		size_t equals = words[i].find('=');
+		auto option = words[i].compare(0, 2, "--") ? allowedOptions.end() : allowedOptions.find(words[i].substr(2, equals - 2));
+		if (option == allowedOptions.end())
+			throw std::runtime_error("Option '" + words[i].substr(0, equals) + "' can not be used with --extra-output");
+		// Skip the argument (if it is missing, the option parser reports it)
+		if (option->second && equals == std::string::npos)
+			i++;
+	}
+
+	std::vector<std::string> args;
+	for (int i = 0; i < argc; i++) {
+		if (!skipArgs[i])
+			args.push_back(argv[i]);
+	}
+	args.push_back("--output");
+	args.insert(args.end(), words.begin(), words.end());
+	std::vector<char *> argPointers;
+	for (std::string &arg : args)
+		argPointers.push_back(&arg[0]);
+	argPointers.push_back(nullptr);
+
+	auto extra = std::make_unique<Mapper>(executablePath, executableName);
+	extra->prepareOnly = true;
+	int result = extra->start(static_cast<int>(args.size()), argPointers.data());
+	if (result)
+		return result;
+	extraOutputs.push_back(std::move(extra));
+	return 0;
+}
+
 void Mapper::parseDataFile(TileGenerator & generator, const string & input, string dataFile, const string& defaultFile, void(TileGenerator::* parseFile)(const std::string &fileName))
 {
 	if (!dataFile.empty()) {
@@ -2,7 +2,9 @@
 
 #include "TileGenerator.h"
 #include <istream>
+#include <memory>
 #include <string>
+#include <vector>
 
 #define OPT_SQLITE_CACHEWORLDROW	0x81
 #define OPT_PROGRESS_INDICATOR		0x82
@@ -25,6 +27,16 @@
 #define OPT_PRESCAN_WORLD		0x93
 #define OPT_DRAWNODES			0x94
 #define OPT_SQLITE_LIMIT_PRESCAN_QUERY	0x95
+#define OPT_THREADS			0x96
+#define OPT_STREAM_OUTPUT		0x97
+#define OPT_TILED_OUTPUT		0x98
+#define OPT_INCREMENTAL			0x99
+#define OPT_SURFACE_CACHE		0x9a
+#define OPT_PARALLEL_STRIPS		0x9b
+#define OPT_EXTRA_OUTPUT		0x9c
+#define OPT_PNG_COMPRESSION		0x9d
+#define OPT_SQLITE_READ_AHEAD		0x9e
+#define OPT_SQLITE_IO_PROFILE		0x9f
 
 #define DRAW_ARROW_LENGTH		10
 #define DRAW_ARROW_ANGLE		30
@@ -73,6 +85,8 @@ private:
 	std::string heightMapNodesFile;
 	bool foundGeometrySpec = false;
 	bool setFixedOrShrinkGeometry = false;
+	bool prepareOnly = false;		// Only parse the options and data files (of an extra output)
+	std::vector<std::unique_ptr<Mapper>> extraOutputs;
 
 	const std::string nodeColorsDefaultFile = "colors.txt";
 	const std::string heightMapNodesDefaultFile = "heightmap-nodes.txt";
@@ -98,6 +112,8 @@ private:
 		return is.eof() ? EOF : is.peek();
 	}
 
+	int addExtraOutput(int argc, char *argv[], const std::vector<bool> &skipArgs, const std::string &spec);
+
 	void parseDataFile(TileGenerator &generator, const std::string &input, std::string dataFile, const std::string& defaultFile,
 		void (TileGenerator::*parseFile)(const std::string &fileName));
 
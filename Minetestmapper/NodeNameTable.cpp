@@ -0,0 +1,45 @@
+#include "NodeNameTable.h"
+
+#include <mutex>
+
+NodeNameTable &NodeNameTable::instance()
+{
+	static NodeNameTable table;
+	return table;
+}
+
+NodeNameTable::NodeNameTable()
+{
+	intern("air");
+	intern("ignore");
+}
+
+int NodeNameTable::intern(std::string_view name)
+{
+	{
+		std::shared_lock<std::shared_mutex> lock(m_mutex);
+		auto it = m_ids.find(name);
+		if (it != m_ids.end())
+			return it->second;
+	}
+	std::unique_lock<std::shared_mutex> lock(m_mutex);
+	auto it = m_ids.find(name);
+	if (it != m_ids.end())
+		return it->second;
+	int id = static_cast<int>(m_names.size());
+	m_names.emplace_back(name);
+	m_ids.emplace(m_names.back(), id);
+	return id;
+}
+
+const std::string &NodeNameTable::name(int id) const
+{
+	std::shared_lock<std::shared_mutex> lock(m_mutex);
+	return m_names.at(id);
+}
+
+int NodeNameTable::size() const
+{
+	std::shared_lock<std::shared_mutex> lock(m_mutex);
+	return static_cast<int>(m_names.size());
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <deque>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// World-wide table of node names.
+//
+// Every node name is assigned a small, stable integer id the first time it
+// is seen. Map blocks store these ids instead of the names, so that names
+// need to be stored, hashed and compared only once.
+//
+// The table may be used by multiple threads concurrently.
+class NodeNameTable
+{
+public:
+	// These names always have these ids
+	static constexpr const int Air = 0;
+	static constexpr const int Ignore = 1;
+
+	static NodeNameTable &instance();
+
+	// Return the id of name, adding it to the table if necessary
+	int intern(std::string_view name);
+	// Return the name with the given id
+	const std::string &name(int id) const;
+	int size() const;
+
+private:
+	NodeNameTable();
+	NodeNameTable(const NodeNameTable &) = delete;
+	NodeNameTable &operator=(const NodeNameTable &) = delete;
+
+	mutable std::shared_mutex m_mutex;
+	std::deque<std::string> m_names;				// Element references are stable
+	std::unordered_map<std::string_view, int> m_ids;	// Keys refer to m_names
+}; /* -----  end of class NodeNameTable  ----- */
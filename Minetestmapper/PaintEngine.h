@@ -26,6 +26,24 @@ public:
 	virtual void drawArc(int x, int y, int w, int h, int start, int end, const Color &color) = 0;
 	virtual void drawFilledRect(int x1, int y1, int x2, int y2, const Color &color) = 0;
 	virtual void drawPixel(int x, int y, const Color &color) = 0;
+	/* Writes count pixels of row y, starting at column x. */
+	virtual void writeSpan(int x, int y, const Color *colors, int count)
+	{
+		for (int i = 0; i < count; i++)
+			drawPixel(x + i, y, colors[i]);
+	}
 	virtual bool save(const std::string &filename, const std::string &format, int quality) = 0;
 	virtual void clean() = 0;
+
+	/* Streaming engines write the image out while the map is rendered, and
+	   only keep a band of rows in memory. Drawing on rows that were written
+	   out has no effect, so everything that is drawn over the map must be
+	   drawn before the map rows are complete (see beginOverlay()). */
+	virtual bool isStreaming() const { return false; }
+	/* Subsequent drawing operations are drawn over the map pixels, even if
+	   the map pixels are written later. Before this call, drawing operations
+	   are the background of the map. */
+	virtual void beginOverlay() {}
+	/* No more map pixels will be written to the rows before row y. */
+	virtual void rowsComplete(int y) {}
 };
@@ -106,7 +106,15 @@ void PaintEngine_libgd::drawFilledRect(int x1, int y1, int x2, int y2, const Col
 
 void PaintEngine_libgd::drawPixel(int x, int y, const Color &color)
 {
-	image->tpixels[y][x] = color.to_libgd();
+	if (x >= 0 && x < image->sx && y >= 0 && y < image->sy)
+		image->tpixels[y][x] = color.to_libgd();
+}
+
+void PaintEngine_libgd::writeSpan(int x, int y, const Color *colors, int count)
+{
+	int *row = image->tpixels[y] + x;
+	for (int i = 0; i < count; i++)
+		row[i] = colors[i].to_libgd();
 }
 
 bool PaintEngine_libgd::save(const std::string & filename, const std::string & format, int quality)
@@ -118,15 +126,29 @@ bool PaintEngine_libgd::save(const std::string & filename, const std::string & f
 		oss << "Error opening '" << filename << "': " << porting::strerror(errno);
 		throw std::runtime_error(oss.str());
 	}
-	gdImagePng(image, out);
+	if (pngEncoder.threads() > 1 || pngEncoder.customized()) {
+		try {
+			pngEncoder.write(out, filename, image->tpixels, width, height);
+		}
+		catch (...) {
+			fclose(out);
+			throw;
+		}
+	}
+	else {
+		gdImagePng(image, out);
+	}
 	fclose(out);
 	gdImageDestroy(image);
+	image = nullptr;
 	return true;
 }
 
 void PaintEngine_libgd::clean()
 {
-	gdImageDestroy(image);
+	if (image)
+		gdImageDestroy(image);
+	image = nullptr;
 }
 
 gdFontPtr PaintEngine_libgd::getGdFont(Font font) const
@@ -1,6 +1,7 @@
 #pragma once
 #include "CharEncodingConverter.h"
 #include "PaintEngine.h"
+#include "PngEncoder.h"
 #include <gd.h>
 
 class PaintEngine_libgd :
@@ -20,13 +21,17 @@ public:
 	void drawArc(int x, int y, int w, int h, int start, int end, const Color &color) override;
 	void drawFilledRect(int x1, int y1, int x2, int y2, const Color &color) override;
 	void drawPixel(int x, int y, const Color &color) override;
+	void writeSpan(int x, int y, const Color *colors, int count) override;
 	bool save(const std::string &filename, const std::string &format, int quality) override;
 	void clean() override;
+	// PNG compression settings (the image is written by libgd if they are the defaults)
+	void setPngEncoder(const PngEncoder &encoder) { pngEncoder = encoder; }
 protected:
 	gdImagePtr image = nullptr;
 	int width = 0;
 	int height = 0;
 	gdFontPtr getGdFont(Font font) const;
 	CharEncodingConverter *gdStringConv = nullptr;
+	PngEncoder pngEncoder;
 };
 
@@ -0,0 +1,292 @@
+#include "PaintEngine_libgdStream.h"
+
+#include <algorithm>
+#include <climits>
+#include <cerrno>
+#include <csetjmp>
+#include <cstring>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+#include "porting.h"
+#include "util.h"
+
+namespace {
+
+// Hash of the type and the parameters of a drawing operation
+uint64_t operationHash(const char *type, std::initializer_list<long long> values, const std::string &text = std::string())
+{
+	uint64_t hash = hashBytes(type, strlen(type));
+	for (long long value : values)
+		hash = hashCombine(hash, static_cast<uint64_t>(value));
+	return hashCombine(hash, hashString(text));
+}
+
+} // namespace
+
+
+PaintEngine_libgdStream::PaintEngine_libgdStream(const std::string &filename)
+	: PaintEngine_libgdStream(filename, 16, 1)
+{
+}
+
+PaintEngine_libgdStream::PaintEngine_libgdStream(const std::string &filename, int bandRows, int bandAlign)
+	: m_filename(filename), m_bandRows(bandRows), m_bandAlign(bandAlign)
+{
+}
+
+PaintEngine_libgdStream::~PaintEngine_libgdStream()
+{
+	clean();
+}
+
+bool PaintEngine_libgdStream::checkImageSize(int w, int h, std::ostream &out)
+{
+	// Only a band of rows is allocated at a time, so the height is not limited
+	long long bandPixels = static_cast<long long>(w) * m_bandRows;
+	if (bandPixels > std::numeric_limits<int>::max()) {
+		out << "WARNING: Image will be " << w << " pixels wide; the PNG graphics library will refuse to handle bands of " << m_bandRows << " rows of more than approximately " << std::numeric_limits<int>::max() << " pixels" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool PaintEngine_libgdStream::create(int w, int h)
+{
+	width = w;
+	height = h;
+	image = gdImageCreateTrueColor((w + m_bandAlign - 1) / m_bandAlign * m_bandAlign, m_bandRows);
+	if (!image)
+		return false;
+	openOutput();
+	startBand(0);
+	return true;
+}
+
+void PaintEngine_libgdStream::fill(const Color &color)
+{
+	record(0, 0, INT_MAX, height - 1, operationHash("fill", { color.to_uint() }), [this, color]() {
+		gdImageFilledRectangle(image, 0, 0, image->sx - 1, m_bandRows - 1, color.to_libgd());
+	});
+}
+
+void PaintEngine_libgdStream::drawText(int x, int y, Font font, const std::string &text, const Color &color)
+{
+	int w = getGdFont(font)->w * static_cast<int>(text.size());
+	int h = std::max(getGdFont(font)->h, 1);
+	record(x, y, x + w - 1, y + h - 1, operationHash("text", { x, y, static_cast<int>(font), color.to_uint() }, text), [this, x, y, font, text, color]() {
+		PaintEngine_libgd::drawText(x, y - m_bandY, font, text, color);
+	});
+}
+
+void PaintEngine_libgdStream::drawChar(int x, int y, Font font, char ch, const Color &color)
+{
+	int w = getGdFont(font)->w;
+	int h = std::max(getGdFont(font)->h, 1);
+	record(x, y, x + w - 1, y + h - 1, operationHash("char", { x, y, static_cast<int>(font), ch, color.to_uint() }), [this, x, y, font, ch, color]() {
+		PaintEngine_libgd::drawChar(x, y - m_bandY, font, ch, color);
+	});
+}
+
+void PaintEngine_libgdStream::drawRect(int x1, int y1, int x2, int y2, const Color &color)
+{
+	record(std::min(x1, x2), std::min(y1, y2), std::max(x1, x2), std::max(y1, y2), operationHash("rect", { x1, y1, x2, y2, color.to_uint() }), [this, x1, y1, x2, y2, color]() {
+		PaintEngine_libgd::drawRect(x1, y1 - m_bandY, x2, y2 - m_bandY, color);
+	});
+}
+
+void PaintEngine_libgdStream::drawLine(int x1, int y1, int x2, int y2, const Color &color)
+{
+	record(std::min(x1, x2), std::min(y1, y2), std::max(x1, x2), std::max(y1, y2), operationHash("line", { x1, y1, x2, y2, color.to_uint() }), [this, x1, y1, x2, y2, color]() {
+		PaintEngine_libgd::drawLine(x1, y1 - m_bandY, x2, y2 - m_bandY, color);
+	});
+}
+
+void PaintEngine_libgdStream::drawCircle(int x, int y, int r, const Color &color)
+{
+	record(x - r, y - r, x + r, y + r, operationHash("circle", { x, y, r, color.to_uint() }), [this, x, y, r, color]() {
+		PaintEngine_libgd::drawCircle(x, y - m_bandY, r, color);
+	});
+}
+
+void PaintEngine_libgdStream::drawArc(int x, int y, int w, int h, int start, int end, const Color &color)
+{
+	record(x - w, y - h, x + w, y + h, operationHash("arc", { x, y, w, h, start, end, color.to_uint() }), [this, x, y, w, h, start, end, color]() {
+		PaintEngine_libgd::drawArc(x, y - m_bandY, w, h, start, end, color);
+	});
+}
+
+void PaintEngine_libgdStream::drawFilledRect(int x1, int y1, int x2, int y2, const Color &color)
+{
+	record(std::min(x1, x2), std::min(y1, y2), std::max(x1, x2), std::max(y1, y2), operationHash("filledrect", { x1, y1, x2, y2, color.to_uint() }), [this, x1, y1, x2, y2, color]() {
+		// Only the rows of the band
+		int top = std::max(std::min(y1, y2) - m_bandY, 0);
+		int bottom = std::min(std::max(y1, y2) - m_bandY, m_bandRows - 1);
+		PaintEngine_libgd::drawFilledRect(x1, top, x2, bottom, color);
+	});
+}
+
+// Map pixels are written using writeSpan(); a pixel is a drawing operation
+// (e.g. --drawpoint), which may be drawn after its band was written out.
+void PaintEngine_libgdStream::drawPixel(int x, int y, const Color &color)
+{
+	if (x < 0 || x >= width || y < 0 || y >= height)
+		return;
+	record(x, y, x, y, operationHash("pixel", { x, y, color.to_uint() }), [this, x, y, color]() {
+		image->tpixels[y - m_bandY][x] = color.to_libgd();
+	});
+}
+
+void PaintEngine_libgdStream::writeSpan(int x, int y, const Color *colors, int count)
+{
+	int *row = bandRow(y) + x;
+	for (int i = 0; i < count; i++)
+		row[i] = colors[i].to_libgd();
+}
+
+void PaintEngine_libgdStream::rowsComplete(int y)
+{
+	while (m_bandY + m_bandRows <= y && m_bandY + m_bandRows < height) {
+		writeBand();
+		startBand(m_bandY + m_bandRows);
+	}
+}
+
+bool PaintEngine_libgdStream::save(const std::string &filename, const std::string &format, int quality)
+{
+	while (m_bandY + m_bandRows < height) {
+		writeBand();
+		startBand(m_bandY + m_bandRows);
+	}
+	writeBand();
+	closeOutput();
+	gdImageDestroy(image);
+	image = nullptr;
+	return true;
+}
+
+void PaintEngine_libgdStream::clean()
+{
+	if (m_png)
+		png_destroy_write_struct(&m_png, &m_pngInfo);
+	if (m_file) {
+		fclose(m_file);
+		m_file = nullptr;
+	}
+	PaintEngine_libgd::clean();
+}
+
+// Background operations are drawn on the current band right away, overlay
+// operations when the band is complete.
+void PaintEngine_libgdStream::record(int x1, int y1, int x2, int y2, uint64_t hash, std::function<void()> draw)
+{
+	if (m_overlay) {
+		m_overlays.push_back({ x1, y1, x2, y2, hash, std::move(draw) });
+	}
+	else {
+		if (y2 >= m_bandY && y1 < m_bandY + m_bandRows)
+			draw();
+		m_background.push_back({ x1, y1, x2, y2, hash, std::move(draw) });
+	}
+}
+
+uint64_t PaintEngine_libgdStream::operationsHash(int x1, int y1, int x2, int y2) const
+{
+	uint64_t hash = 0;
+	for (const std::vector<Operation> *operations : { &m_background, &m_overlays })
+		for (const Operation &operation : *operations)
+			if (operation.x2 >= x1 && operation.x1 <= x2 && operation.y2 >= y1 && operation.y1 <= y2)
+				hash = hashCombine(hash, operation.hash);
+	return hash;
+}
+
+void PaintEngine_libgdStream::drawOperations(const std::vector<Operation> &operations)
+{
+	for (const Operation &operation : operations)
+		if (operation.y2 >= m_bandY && operation.y1 < m_bandY + m_bandRows)
+			operation.draw();
+}
+
+int *PaintEngine_libgdStream::bandRow(int y)
+{
+	if (y < m_bandY)
+		throw std::logic_error("Streaming image: pixel written to a row that was already written out");
+	while (y >= m_bandY + m_bandRows) {
+		writeBand();
+		startBand(m_bandY + m_bandRows);
+	}
+	return image->tpixels[y - m_bandY];
+}
+
+void PaintEngine_libgdStream::startBand(int y)
+{
+	m_bandY = y;
+	for (int row = 0; row < m_bandRows; row++)
+		std::fill_n(image->tpixels[row], image->sx, 0);
+	drawOperations(m_background);
+}
+
+void PaintEngine_libgdStream::writeBand()
+{
+	drawOperations(m_overlays);
+	writeRows(std::min(m_bandRows, height - m_bandY));
+}
+
+void PaintEngine_libgdStream::openOutput()
+{
+	m_file = porting::fopen(m_filename.c_str(), "wb");
+	if (!m_file) {
+		std::ostringstream oss;
+		oss << "Error opening '" << m_filename << "': " << porting::strerror(errno);
+		throw std::runtime_error(oss.str());
+	}
+	m_png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+	if (m_png)
+		m_pngInfo = png_create_info_struct(m_png);
+	if (!m_pngInfo)
+		throw std::runtime_error("Failed to initialize the PNG library");
+	if (setjmp(png_jmpbuf(m_png)))
+		throw std::runtime_error("Error writing '" + m_filename + "'");
+	png_init_io(m_png, m_file);
+	pngEncoder.configure(m_png);
+#ifdef PNG_SET_USER_LIMITS_SUPPORTED
+	png_set_user_limits(m_png, PNG_UINT_31_MAX, PNG_UINT_31_MAX);
+#endif
+	png_set_IHDR(m_png, m_pngInfo, width, height, 8, PNG_COLOR_TYPE_RGB,
+		PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_write_info(m_png, m_pngInfo);
+	m_pngRow.resize(static_cast<size_t>(width) * 3);
+}
+
+// Like libgd, the alpha channel of the pixels is not saved
+void PaintEngine_libgdStream::writeRows(int rows)
+{
+	if (setjmp(png_jmpbuf(m_png)))
+		throw std::runtime_error("Error writing '" + m_filename + "'");
+	for (int row = 0; row < rows; row++) {
+		const int *pixels = image->tpixels[row];
+		png_byte *p = m_pngRow.data();
+		for (int x = 0; x < width; x++) {
+			*p++ = png_byte(gdTrueColorGetRed(pixels[x]));
+			*p++ = png_byte(gdTrueColorGetGreen(pixels[x]));
+			*p++ = png_byte(gdTrueColorGetBlue(pixels[x]));
+		}
+		png_write_row(m_png, m_pngRow.data());
+	}
+}
+
+void PaintEngine_libgdStream::closeOutput()
+{
+	if (setjmp(png_jmpbuf(m_png)))
+		throw std::runtime_error("Error writing '" + m_filename + "'");
+	png_write_end(m_png, m_pngInfo);
+	png_destroy_write_struct(&m_png, &m_pngInfo);
+	if (fclose(m_file) != 0) {
+		m_file = nullptr;
+		std::ostringstream oss;
+		oss << "Error writing '" << m_filename << "': " << porting::strerror(errno);
+		throw std::runtime_error(oss.str());
+	}
+	m_file = nullptr;
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include "PaintEngine_libgd.h"
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <png.h>
+#include <string>
+#include <vector>
+
+// Writes a PNG file while the map is rendered.
+//
+// Only a band of rows is kept in memory, as a libgd image. The drawing
+// operations are recorded, and drawn (using libgd) on every band they
+// intersect: the background operations when a band is started, the overlay
+// operations when the band is complete. The band is then encoded, using
+// libpng, and the next band is started. Map pixels must be written in
+// increasing row order.
+//
+// Derived classes can write the bands differently (see writeRows()).
+class PaintEngine_libgdStream :
+	public PaintEngine_libgd
+{
+public:
+	explicit PaintEngine_libgdStream(const std::string &filename);
+	~PaintEngine_libgdStream() override;
+	bool checkImageSize(int w, int h, std::ostream &out) override;
+	bool create(int w, int h) override;
+	void fill(const Color &color) override;
+	void drawText(int x, int y, Font font, const std::string &text, const Color &color) override;
+	void drawChar(int x, int y, Font font, char ch, const Color &color) override;
+	void drawRect(int x1, int y1, int x2, int y2, const Color &color) override;
+	void drawLine(int x1, int y1, int x2, int y2, const Color &color) override;
+	void drawCircle(int x, int y, int r, const Color &color) override;
+	void drawArc(int x, int y, int w, int h, int start, int end, const Color &color) override;
+	void drawFilledRect(int x1, int y1, int x2, int y2, const Color &color) override;
+	void drawPixel(int x, int y, const Color &color) override;
+	void writeSpan(int x, int y, const Color *colors, int count) override;
+	bool save(const std::string &filename, const std::string &format, int quality) override;
+	void clean() override;
+	bool isStreaming() const override { return true; }
+	void beginOverlay() override { m_overlay = true; }
+	void rowsComplete(int y) override;
+
+protected:
+	// Bands of bandRows rows. The band image is a multiple of bandAlign
+	// pixels wide; the pixels beyond the image width are background.
+	PaintEngine_libgdStream(const std::string &filename, int bandRows, int bandAlign);
+	virtual void openOutput();
+	// Write the first rows of the band (the pixels of the band image,
+	// image->tpixels, beginning at row m_bandY of the image)
+	virtual void writeRows(int rows);
+	virtual void closeOutput();
+	// Hash of all drawing operations (and their parameters) which may affect
+	// the pixels x1,y1 ... x2,y2
+	uint64_t operationsHash(int x1, int y1, int x2, int y2) const;
+
+	std::string m_filename;
+	const int m_bandRows;
+	const int m_bandAlign;
+	int m_bandY = 0;	// Image row of the first row of the band
+
+private:
+	// A recorded drawing operation, which affects pixels x1,y1 ... x2,y2
+	struct Operation {
+		int x1;
+		int y1;
+		int x2;
+		int y2;
+		uint64_t hash;
+		std::function<void()> draw;
+	};
+
+	FILE *m_file = nullptr;
+	png_structp m_png = nullptr;
+	png_infop m_pngInfo = nullptr;
+	std::vector<png_byte> m_pngRow;
+	std::vector<Operation> m_background;
+	std::vector<Operation> m_overlays;
+	bool m_overlay = false;
+
+	void record(int x1, int y1, int x2, int y2, uint64_t hash, std::function<void()> draw);
+	void drawOperations(const std::vector<Operation> &operations);
+	int *bandRow(int y);
+	void startBand(int y);
+	void writeBand();
+};
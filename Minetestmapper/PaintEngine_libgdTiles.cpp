@@ -0,0 +1,620 @@
+#include "PaintEngine_libgdTiles.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <csetjmp>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <png.h>
+#include <sstream>
+#include <stdexcept>
+#include <string_view>
+
+#include "util.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+const char *const StateFile = "tiles.state";
+const char *const StateHeader = "minetestmapper tiles state 1";
+
+std::string tileFile(int z, int x, int y)
+{
+	std::ostringstream name;
+	name << z << "/" << x << "/" << y << ".png";
+	return name.str();
+}
+
+void appendPngData(png_structp png, png_bytep data, png_size_t length)
+{
+	auto *out = static_cast<std::vector<unsigned char> *>(png_get_io_ptr(png));
+	out->insert(out->end(), data, data + length);
+}
+
+void flushPngData(png_structp)
+{
+}
+
+// Encode a tile of libgd pixels as an RGB PNG image. Returns false on error.
+bool encodePng(const int *pixels, int size, const PngEncoder &encoder, std::vector<png_byte> &row, std::vector<unsigned char> &out)
+{
+	png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+	png_infop info = png ? png_create_info_struct(png) : nullptr;
+	if (!info) {
+		png_destroy_write_struct(&png, nullptr);
+		return false;
+	}
+	if (setjmp(png_jmpbuf(png))) {
+		png_destroy_write_struct(&png, &info);
+		return false;
+	}
+	png_set_write_fn(png, &out, appendPngData, flushPngData);
+	encoder.configure(png);
+	png_set_IHDR(png, info, size, size, 8, PNG_COLOR_TYPE_RGB,
+		PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_write_info(png, info);
+	for (int y = 0; y < size; y++) {
+		const int *p = pixels + static_cast<size_t>(y) * size;
+		png_byte *r = row.data();
+		for (int x = 0; x < size; x++) {
+			*r++ = png_byte(gdTrueColorGetRed(p[x]));
+			*r++ = png_byte(gdTrueColorGetGreen(p[x]));
+			*r++ = png_byte(gdTrueColorGetBlue(p[x]));
+		}
+		png_write_row(png, row.data());
+	}
+	png_write_end(png, info);
+	png_destroy_write_struct(&png, &info);
+	return true;
+}
+
+bool fileContentsEqual(const fs::path &path, const std::vector<unsigned char> &data)
+{
+	std::ifstream file(path, std::ios::binary);
+	std::vector<unsigned char> contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	return file.good() || file.eof() ? contents == data : false;
+}
+
+} // namespace
+
+PaintEngine_libgdTiles::PaintEngine_libgdTiles(const std::string &directory, int tileSize, int zoomLevels, int threads)
+	: PaintEngine_libgdStream(directory, tileSize, tileSize),
+	m_tileSize(tileSize),
+	m_zoomLevels(std::max(zoomLevels, 1)),
+	m_threads(std::max(threads, 1))
+{
+	if (m_zoomLevels > 1 && m_tileSize % 2)
+		throw std::runtime_error("The tile size must be even when generating multiple zoom levels");
+}
+
+PaintEngine_libgdTiles::~PaintEngine_libgdTiles()
+{
+	clean();
+}
+
+void PaintEngine_libgdTiles::fill(const Color &color)
+{
+	// The color of a background pixel, as libgd draws it
+	gdImagePtr pixel = gdImageCreateTrueColor(1, 1);
+	if (pixel) {
+		gdImageFilledRectangle(pixel, 0, 0, 0, 0, color.to_libgd());
+		m_background = pixel->tpixels[0][0];
+		gdImageDestroy(pixel);
+	}
+	PaintEngine_libgdStream::fill(color);
+}
+
+void PaintEngine_libgdTiles::clean()
+{
+	stopWorkers();
+	PaintEngine_libgdStream::clean();
+}
+
+void PaintEngine_libgdTiles::openOutput()
+{
+	std::error_code ec;
+	fs::create_directories(m_filename, ec);
+	if (ec)
+		throw std::runtime_error("Error creating directory '" + m_filename + "': " + ec.message());
+	int w = width;
+	int h = height;
+	m_levelSizes.resize(m_zoomLevels);
+	m_levels.clear();
+	for (int z = m_zoomLevels - 1; z >= 0; z--) {
+		if (z < m_zoomLevels - 1) {
+			w = (w + 1) / 2;
+			h = (h + 1) / 2;
+		}
+		m_levelSizes[z] = { w, h, (w + m_tileSize - 1) / m_tileSize, (h + m_tileSize - 1) / m_tileSize };
+		if (z == m_zoomLevels - 1)
+			continue;
+		Level level{ z, w, h };
+		int stride = (w + m_tileSize - 1) / m_tileSize * m_tileSize;
+		level.pixels.resize(static_cast<size_t>(stride) * m_tileSize);
+		for (int row = 0; row < m_tileSize; row++)
+			level.rows.push_back(level.pixels.data() + static_cast<size_t>(row) * stride);
+		m_levels.push_back(std::move(level));
+	}
+	m_queueLimit = 4 * m_threads;
+	for (int i = 0; i < m_threads; i++)
+		m_workers.emplace_back(&PaintEngine_libgdTiles::encodeTiles, this);
+}
+
+void PaintEngine_libgdTiles::writeRows(int rows)
+{
+	// Figures may have been drawn beyond the edges of the image
+	for (int row = 0; row < m_tileSize; row++) {
+		if (row < rows)
+			std::fill(image->tpixels[row] + width, image->tpixels[row] + image->sx, m_background);
+		else
+			std::fill_n(image->tpixels[row], image->sx, m_background);
+	}
+	int tileY = m_bandY / m_tileSize;
+	loadTiles(m_zoomLevels - 1, tileY, image->tpixels);
+	writeTiles(m_zoomLevels - 1, tileY, image->tpixels, width);
+	reduceRows(0, image->tpixels, width, rows, tileY, m_bandY + rows >= height);
+}
+
+void PaintEngine_libgdTiles::writeTiles(int z, int tileY, int *const *rows, int levelWidth)
+{
+	for (int x = 0; x * m_tileSize < levelWidth; x++) {
+		if (!tileChanged(z, x, tileY)) {
+			keepTile(z, x, tileY);
+			continue;
+		}
+		bool empty = true;
+		for (int row = 0; row < m_tileSize && empty; row++) {
+			const int *pixels = rows[row] + x * m_tileSize;
+			empty = std::all_of(pixels, pixels + m_tileSize, [this](int p) { return p == m_background; });
+		}
+		if (empty) {
+			m_emptyTiles++;
+			if (m_incremental) {
+				// Remove the tile of the previous run
+				std::error_code ec;
+				fs::remove(fs::path(m_filename) / tileFile(z, x, tileY), ec);
+			}
+			continue;
+		}
+		Tile tile{ z, x, tileY, std::vector<int>(static_cast<size_t>(m_tileSize) * m_tileSize) };
+		for (int row = 0; row < m_tileSize; row++)
+			std::copy_n(rows[row] + x * m_tileSize, m_tileSize, tile.pixels.begin() + static_cast<size_t>(row) * m_tileSize);
+		queueTile(std::move(tile));
+	}
+}
+
+// Reduce a row of tiles (of which rowCount rows are part of the image) into
+// the next coarser level. Two rows of tiles make one row of the coarser level,
+// which is written when it is complete.
+void PaintEngine_libgdTiles::reduceRows(size_t level, int *const *rows, int rowsWidth, int rowCount, int tileY, bool last)
+{
+	if (level >= m_levels.size())
+		return;
+	Level &coarse = m_levels[level];
+	int half = m_tileSize / 2;
+	int offset = (tileY % 2) * half;
+	if (!offset)
+		std::fill(coarse.pixels.begin(), coarse.pixels.end(), m_background);
+
+	// Average the pixels that are part of the image, per channel (including alpha)
+	for (int y = 0; 2 * y < rowCount; y++) {
+		const int *src1 = rows[2 * y];
+		const int *src2 = 2 * y + 1 < rowCount ? rows[2 * y + 1] : nullptr;
+		int *dst = coarse.rows[offset + y];
+		for (int x = 0; 2 * x < rowsWidth; x++) {
+			int pixels[4];
+			int n = 0;
+			pixels[n++] = src1[2 * x];
+			if (2 * x + 1 < rowsWidth)
+				pixels[n++] = src1[2 * x + 1];
+			if (src2) {
+				pixels[n++] = src2[2 * x];
+				if (2 * x + 1 < rowsWidth)
+					pixels[n++] = src2[2 * x + 1];
+			}
+			int color = 0;
+			for (int shift = 0; shift < 32; shift += 8) {
+				int sum = 0;
+				for (int i = 0; i < n; i++)
+					sum += (pixels[i] >> shift) & 0xff;
+				color |= ((sum + n / 2) / n) << shift;
+			}
+			dst[x] = color;
+		}
+	}
+
+	if (offset || last) {
+		loadTiles(coarse.z, tileY / 2, coarse.rows.data());
+		writeTiles(coarse.z, tileY / 2, coarse.rows.data(), coarse.width);
+		reduceRows(level + 1, coarse.rows.data(), coarse.width, offset + (rowCount + 1) / 2, tileY / 2, last);
+	}
+}
+
+void PaintEngine_libgdTiles::closeOutput()
+{
+	stopWorkers();
+	if (m_error)
+		std::rethrow_exception(m_error);
+	writeManifest();
+	if (m_incremental) {
+		writeState();
+	}
+	else {
+		// The tiles no longer match the state
+		std::error_code ec;
+		fs::remove(fs::path(m_filename) / StateFile, ec);
+	}
+}
+
+void PaintEngine_libgdTiles::queueTile(Tile &&tile)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_tileTaken.wait(lock, [this] { return m_error || m_queue.size() < m_queueLimit; });
+	if (m_error)
+		std::rethrow_exception(m_error);
+	m_queue.push_back(std::move(tile));
+	m_tileQueued.notify_one();
+}
+
+void PaintEngine_libgdTiles::encodeTiles()
+{
+	while (true) {
+		Tile tile;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_tileQueued.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+			if (m_queue.empty())
+				return;
+			tile = std::move(m_queue.front());
+			m_queue.pop_front();
+			m_tileTaken.notify_one();
+		}
+		try {
+			std::vector<unsigned char> png = encode(tile);
+			writeTile(tile, png);
+		}
+		catch (...) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (!m_error)
+				m_error = std::current_exception();
+			m_tileTaken.notify_all();
+		}
+	}
+}
+
+std::vector<unsigned char> PaintEngine_libgdTiles::encode(const Tile &tile) const
+{
+	std::vector<png_byte> row(static_cast<size_t>(m_tileSize) * 3);
+	std::vector<unsigned char> png;
+	if (!encodePng(tile.pixels.data(), m_tileSize, pngEncoder, row, png)) {
+		std::ostringstream oss;
+		oss << "Error encoding tile " << tile.z << "/" << tile.x << "/" << tile.y;
+		throw std::runtime_error(oss.str());
+	}
+	return png;
+}
+
+// Tiles that are identical to a tile written earlier are hard links to it.
+// Only the lookup of those tiles, and the list of tiles are used with m_mutex
+// locked, so that the workers write their files in parallel. A tile is found
+// once its file was written (identical tiles that are written at the same
+// time are not linked).
+void PaintEngine_libgdTiles::writeTile(const Tile &tile, const std::vector<unsigned char> &png)
+{
+	TileInfo info{ tile.z, tile.x, tile.y, tileFile(tile.z, tile.x, tile.y), std::string() };
+	fs::path path = fs::path(m_filename) / info.file;
+	std::error_code ec;
+	fs::create_directories(path.parent_path(), ec);
+	if (ec)
+		throw std::runtime_error("Error creating directory '" + path.parent_path().string() + "': " + ec.message());
+	// Never write through a link made by an earlier run
+	fs::remove(path, ec);
+
+	size_t hash = std::hash<std::string_view>()(std::string_view(reinterpret_cast<const char *>(png.data()), png.size()));
+	std::vector<std::string> sameHash;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto tiles = m_tilesByHash.find(hash);
+		if (tiles != m_tilesByHash.end())
+			for (size_t i : tiles->second)
+				sameHash.push_back(m_tiles[i].file);
+	}
+	for (const std::string &file : sameHash) {
+		fs::path original = fs::path(m_filename) / file;
+		if (!fileContentsEqual(original, png))
+			continue;
+		fs::create_hard_link(original, path, ec);
+		if (!ec)
+			info.linkedTo = file;
+		break;
+	}
+	if (info.linkedTo.empty()) {
+		std::ofstream file(path, std::ios::binary);
+		file.write(reinterpret_cast<const char *>(png.data()), png.size());
+		file.close();
+		if (!file)
+			throw std::runtime_error("Error writing '" + path.string() + "'");
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (info.linkedTo.empty())
+		m_tilesByHash[hash].push_back(m_tiles.size());
+	m_tiles.push_back(std::move(info));
+}
+
+void PaintEngine_libgdTiles::stopWorkers()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_tileQueued.notify_all();
+	for (auto &worker : m_workers)
+		if (worker.joinable())
+			worker.join();
+	m_workers.clear();
+}
+
+void PaintEngine_libgdTiles::writeManifest()
+{
+	std::sort(m_tiles.begin(), m_tiles.end(), [](const TileInfo &a, const TileInfo &b) {
+		if (a.z != b.z) return a.z < b.z;
+		if (a.y != b.y) return a.y < b.y;
+		return a.x < b.x;
+	});
+	long long links = std::count_if(m_tiles.begin(), m_tiles.end(), [](const TileInfo &t) { return !t.linkedTo.empty(); });
+	fs::path path = fs::path(m_filename) / "tiles.json";
+	std::ofstream json(path);
+	json << "{\n";
+	json << "\t\"tileSize\": " << m_tileSize << ",\n";
+	json << "\t\"width\": " << width << ",\n";
+	json << "\t\"height\": " << height << ",\n";
+	json << "\t\"columns\": " << (width + m_tileSize - 1) / m_tileSize << ",\n";
+	json << "\t\"rows\": " << (height + m_tileSize - 1) / m_tileSize << ",\n";
+	json << "\t\"zoomLevels\": [";
+	int w = width;
+	int h = height;
+	for (int z = m_zoomLevels - 1; z >= 0; z--) {
+		json << (z == m_zoomLevels - 1 ? "\n" : ",\n") << "\t\t{ \"z\": " << z << ", \"width\": " << w << ", \"height\": " << h
+			<< ", \"columns\": " << (w + m_tileSize - 1) / m_tileSize << ", \"rows\": " << (h + m_tileSize - 1) / m_tileSize << " }";
+		w = (w + 1) / 2;
+		h = (h + 1) / 2;
+	}
+	json << "\n\t],\n";
+	json << "\t\"emptyTiles\": " << m_emptyTiles << ",\n";
+	json << "\t\"linkedTiles\": " << links << ",\n";
+	json << "\t\"tiles\": [";
+	for (size_t i = 0; i < m_tiles.size(); i++) {
+		const TileInfo &t = m_tiles[i];
+		json << (i ? ",\n" : "\n") << "\t\t{ \"z\": " << t.z << ", \"x\": " << t.x << ", \"y\": " << t.y
+			<< ", \"file\": \"" << t.file << "\"";
+		if (!t.linkedTo.empty())
+			json << ", \"linkedTo\": \"" << t.linkedTo << "\"";
+		json << " }";
+	}
+	json << "\n\t]\n}\n";
+	json.close();
+	if (!json)
+		throw std::runtime_error("Error writing '" + path.string() + "'");
+}
+
+uint64_t PaintEngine_libgdTiles::tileKey(int z, int x, int y)
+{
+	return (static_cast<uint64_t>(z) << 56) | (static_cast<uint64_t>(x) << 28) | static_cast<uint64_t>(y);
+}
+
+bool PaintEngine_libgdTiles::tileChanged(int z, int x, int y) const
+{
+	if (!m_incremental)
+		return true;
+	return m_tileChanged[z][static_cast<size_t>(y) * m_levelSizes[z].columns + x];
+}
+
+bool PaintEngine_libgdTiles::readState(uint64_t settingsHash, const std::string &dataSignature)
+{
+	m_settingsHash = settingsHash;
+	m_dataSignature = dataSignature;
+	m_previousDataSignature.clear();
+	m_previousBlockHashes.clear();
+	m_previousTiles.clear();
+
+	std::ifstream state(fs::path(m_filename) / StateFile);
+	std::string line;
+	if (!std::getline(state, line) || line != StateHeader)
+		return false;
+	uint64_t settings = 0;
+	int tileSize = 0;
+	int zoomLevels = 0;
+	int w = 0;
+	int h = 0;
+	while (std::getline(state, line)) {
+		std::istringstream iss(line);
+		std::string type;
+		iss >> type;
+		if (type == "settings") {
+			iss >> std::hex >> settings;
+		}
+		else if (type == "data") {
+			std::getline(iss >> std::ws, m_previousDataSignature);
+		}
+		else if (type == "image") {
+			iss >> tileSize >> zoomLevels >> w >> h;
+		}
+		else if (type == "blocks") {
+			uint64_t hash;
+			while (iss >> std::hex >> hash)
+				m_previousBlockHashes.push_back(hash);
+		}
+		else if (type == "tile") {
+			int z, x, y;
+			TileState tile{ 0, std::string(), std::string(), 0 };
+			iss >> z >> x >> y >> std::hex >> tile.hash >> tile.file >> tile.linkedTo;
+			if (tile.file == "-")
+				tile.file.clear();
+			int lz, lx, ly;
+			if (!tile.linkedTo.empty() && sscanf(tile.linkedTo.c_str(), "%d/%d/%d.png", &lz, &lx, &ly) == 3)
+				tile.linkedKey = tileKey(lz, lx, ly);
+			else
+				tile.linkedTo.clear();
+			m_previousTiles[tileKey(z, x, y)] = std::move(tile);
+		}
+	}
+	if (settings != settingsHash || tileSize != m_tileSize || zoomLevels != m_zoomLevels || w != width || h != height
+		|| m_previousBlockHashes.size() != static_cast<size_t>(columns()) * rows()) {
+		m_previousDataSignature.clear();
+		m_previousBlockHashes.clear();
+		m_previousTiles.clear();
+		return false;
+	}
+	return true;
+}
+
+long long PaintEngine_libgdTiles::setBlockHashes(std::vector<uint64_t> blockHashes)
+{
+	m_incremental = true;
+	m_blockHashes = std::move(blockHashes);
+	m_tileHashes.assign(m_zoomLevels, std::vector<uint64_t>());
+	m_tileChanged.assign(m_zoomLevels, std::vector<char>());
+	long long changed = 0;
+	for (int z = m_zoomLevels - 1; z >= 0; z--) {
+		const LevelSize &size = m_levelSizes[z];
+		for (int y = 0; y < size.rows; y++) {
+			for (int x = 0; x < size.columns; x++) {
+				uint64_t hash;
+				if (z == m_zoomLevels - 1) {
+					// The blocks, the settings and the figures drawn on the tile
+					hash = hashCombine(m_settingsHash, m_blockHashes[static_cast<size_t>(y) * size.columns + x]);
+					hash = hashCombine(hash, operationsHash(x * m_tileSize, y * m_tileSize, (x + 1) * m_tileSize - 1, (y + 1) * m_tileSize - 1));
+				}
+				else {
+					// The four tiles of the finer level
+					const LevelSize &finer = m_levelSizes[z + 1];
+					hash = static_cast<uint64_t>(z);
+					for (int fy = 2 * y; fy < std::min(2 * y + 2, finer.rows); fy++)
+						for (int fx = 2 * x; fx < std::min(2 * x + 2, finer.columns); fx++)
+							hash = hashCombine(hash, m_tileHashes[z + 1][static_cast<size_t>(fy) * finer.columns + fx]);
+				}
+				m_tileHashes[z].push_back(hash);
+				auto previous = m_previousTiles.find(tileKey(z, x, y));
+				bool tileChanged = previous == m_previousTiles.end() || previous->second.hash != hash;
+				m_tileChanged[z].push_back(tileChanged);
+				changed += tileChanged;
+			}
+		}
+	}
+	return changed;
+}
+
+// An unchanged tile: the file of the previous run is kept
+void PaintEngine_libgdTiles::keepTile(int z, int x, int y)
+{
+	const TileState &state = m_previousTiles.at(tileKey(z, x, y));
+	if (state.file.empty()) {
+		m_emptyTiles++;
+		return;
+	}
+	TileInfo info{ z, x, y, state.file, state.linkedTo };
+	// The tile it was identical to may have changed
+	if (!info.linkedTo.empty()) {
+		uint64_t key = state.linkedKey;
+		if (tileChanged(static_cast<int>(key >> 56), static_cast<int>((key >> 28) & 0xfffffff), static_cast<int>(key & 0xfffffff)))
+			info.linkedTo.clear();
+	}
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_tiles.push_back(std::move(info));
+}
+
+// Read the unchanged tiles of a row of tiles back from disk, if they are
+// needed to compute a changed tile of the next coarser level.
+void PaintEngine_libgdTiles::loadTiles(int z, int tileY, int *const *rows)
+{
+	if (!m_incremental || z == 0)
+		return;
+	std::vector<png_byte> pixels;
+	for (int x = 0; x < m_levelSizes[z].columns; x++) {
+		if (tileChanged(z, x, tileY) || !tileChanged(z - 1, x / 2, tileY / 2))
+			continue;
+		const TileState &state = m_previousTiles.at(tileKey(z, x, tileY));
+		if (state.file.empty()) {
+			for (int row = 0; row < m_tileSize; row++)
+				std::fill_n(rows[row] + x * m_tileSize, m_tileSize, m_background);
+			continue;
+		}
+		std::string path = (fs::path(m_filename) / state.file).string();
+		png_image png;
+		memset(&png, 0, sizeof(png));
+		png.version = PNG_IMAGE_VERSION;
+		bool ok = false;
+		if (png_image_begin_read_from_file(&png, path.c_str())) {
+			png.format = PNG_FORMAT_RGB;
+			if (png.width == static_cast<png_uint_32>(m_tileSize) && png.height == static_cast<png_uint_32>(m_tileSize)) {
+				pixels.resize(PNG_IMAGE_SIZE(png));
+				ok = png_image_finish_read(&png, nullptr, pixels.data(), 0, nullptr) != 0;
+			}
+			png_image_free(&png);
+		}
+		if (!ok)
+			throw std::runtime_error("Error reading '" + path + "' (remove " + StateFile + " to regenerate all tiles)");
+		const png_byte *p = pixels.data();
+		for (int row = 0; row < m_tileSize; row++) {
+			int *dst = rows[row] + x * m_tileSize;
+			for (int i = 0; i < m_tileSize; i++, p += 3) {
+				int color = Color(p[0], p[1], p[2]).to_libgd();
+				// The alpha channel is not saved
+				dst[i] = color == (m_background & 0xffffff) ? m_background : color;
+			}
+		}
+	}
+}
+
+void PaintEngine_libgdTiles::writeState()
+{
+	std::unordered_map<uint64_t, const TileInfo *> files;
+	for (const TileInfo &tile : m_tiles)
+		files[tileKey(tile.z, tile.x, tile.y)] = &tile;
+
+	fs::path path = fs::path(m_filename) / StateFile;
+	fs::path temporary = path;
+	temporary += ".tmp";
+	std::ofstream state(temporary);
+	state << StateHeader << "\n";
+	state << "settings " << std::hex << m_settingsHash << std::dec << "\n";
+	state << "data " << m_dataSignature << "\n";
+	state << "image " << m_tileSize << " " << m_zoomLevels << " " << width << " " << height << "\n";
+	state << std::hex;
+	for (int y = 0; y < rows(); y++) {
+		state << "blocks";
+		for (int x = 0; x < columns(); x++)
+			state << " " << m_blockHashes[static_cast<size_t>(y) * columns() + x];
+		state << "\n";
+	}
+	for (int z = 0; z < m_zoomLevels; z++) {
+		const LevelSize &size = m_levelSizes[z];
+		for (int y = 0; y < size.rows; y++) {
+			for (int x = 0; x < size.columns; x++) {
+				state << std::dec << "tile " << z << " " << x << " " << y << " "
+					<< std::hex << m_tileHashes[z][static_cast<size_t>(y) * size.columns + x];
+				auto file = files.find(tileKey(z, x, y));
+				if (file == files.end()) {
+					state << " -";
+				}
+				else {
+					state << " " << file->second->file;
+					if (!file->second->linkedTo.empty())
+						state << " " << file->second->linkedTo;
+				}
+				state << "\n";
+			}
+		}
+	}
+	state.close();
+	if (!state)
+		throw std::runtime_error("Error writing '" + temporary.string() + "'");
+	std::error_code ec;
+	fs::rename(temporary, path, ec);
+	if (ec)
+		throw std::runtime_error("Error writing '" + path.string() + "': " + ec.message());
+}
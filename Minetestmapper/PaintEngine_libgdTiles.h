@@ -0,0 +1,142 @@
+#pragma once
+#include "PaintEngine_libgdStream.h"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Writes the image as a directory of square PNG tiles: <z>/<x>/<y>.png,
+// while the map is rendered, and a manifest (tiles.json) listing them.
+//
+// The bands of the streaming engine are one tile high. When a band is
+// complete, its tiles are encoded and written by worker threads. Tiles that
+// only contain the background are not written, and a tile that is identical
+// to a tile that was already written, is a hard link to that tile.
+// Tiles at the right and bottom edges are padded with the background.
+//
+// With more than one zoom level, the image is the finest level (the highest
+// z), and each coarser level is computed by reducing (averaging) every 2x2
+// pixels of the level below it, a row of tiles at a time. Only one row of
+// tiles per level is kept in memory.
+//
+// Incremental output: the hashes of the inputs of every tile (the map blocks,
+// the settings and the drawing operations) are saved in a state file
+// (tiles.state). When they are set (setBlockHashes()), only the tiles that
+// changed since the previous run are written. Unchanged tiles that are needed
+// to compute a changed tile of a coarser level are read back from disk.
+class PaintEngine_libgdTiles :
+	public PaintEngine_libgdStream
+{
+public:
+	PaintEngine_libgdTiles(const std::string &directory, int tileSize, int zoomLevels, int threads);
+	~PaintEngine_libgdTiles() override;
+	void fill(const Color &color) override;
+	void clean() override;
+
+	int columns() const { return m_levelSizes.back().columns; }
+	int rows() const { return m_levelSizes.back().rows; }
+	// Read the state of the previous run. Returns false if there is none, or
+	// if it was made using different settings, or for a different image.
+	bool readState(uint64_t settingsHash, const std::string &dataSignature);
+	// Whether the database is unchanged since the previous run
+	bool dataUnchanged() const { return !m_dataSignature.empty() && m_dataSignature == m_previousDataSignature; }
+	// The block hashes of the previous run (see setBlockHashes())
+	const std::vector<uint64_t> &previousBlockHashes() const { return m_previousBlockHashes; }
+	// Enable incremental output. blockHashes contains the hash of the map
+	// blocks of every tile of the finest zoom level, row by row. Returns the
+	// number of tiles (of all levels) that changed.
+	long long setBlockHashes(std::vector<uint64_t> blockHashes);
+	// Whether a tile of the finest zoom level changed
+	bool tileChanged(int x, int y) const { return tileChanged(m_zoomLevels - 1, x, y); }
+
+protected:
+	void openOutput() override;
+	void writeRows(int rows) override;
+	void closeOutput() override;
+
+private:
+	struct Tile {
+		int z;
+		int x;
+		int y;
+		std::vector<int> pixels;	// tileSize x tileSize libgd colors
+	};
+	struct TileInfo {
+		int z;
+		int x;
+		int y;
+		std::string file;
+		std::string linkedTo;		// Identical to this tile (if not empty)
+	};
+	// A tile of the previous run
+	struct TileState {
+		uint64_t hash;
+		std::string file;		// Empty if the tile was empty
+		std::string linkedTo;
+		uint64_t linkedKey;
+	};
+	struct LevelSize {
+		int width;
+		int height;
+		int columns;
+		int rows;
+	};
+	// A reduced (coarser) zoom level
+	struct Level {
+		int z;
+		int width;
+		int height;
+		std::vector<int> pixels;	// One row of tiles
+		std::vector<int *> rows;
+	};
+
+	const int m_tileSize;
+	const int m_zoomLevels;
+	const int m_threads;
+	std::vector<Level> m_levels;
+	std::vector<LevelSize> m_levelSizes;	// Indexed by z
+	int m_background{ 0 };			// libgd color of the background
+	long long m_emptyTiles{ 0 };
+
+	std::mutex m_mutex;
+	std::condition_variable m_tileQueued;
+	std::condition_variable m_tileTaken;
+	std::deque<Tile> m_queue;
+	size_t m_queueLimit{ 0 };
+	bool m_stop{ false };
+	std::exception_ptr m_error;
+	std::vector<std::thread> m_workers;
+	// Written tiles, by hash of their PNG data (the first tile of each hash)
+	std::unordered_map<size_t, std::vector<size_t>> m_tilesByHash;
+	std::vector<TileInfo> m_tiles;
+
+	// Incremental output
+	bool m_incremental{ false };
+	uint64_t m_settingsHash{ 0 };
+	std::string m_dataSignature;
+	std::string m_previousDataSignature;
+	std::vector<uint64_t> m_blockHashes;
+	std::vector<uint64_t> m_previousBlockHashes;
+	std::unordered_map<uint64_t, TileState> m_previousTiles;
+	std::vector<std::vector<uint64_t>> m_tileHashes;	// [z][y * columns + x]
+	std::vector<std::vector<char>> m_tileChanged;	// [z][y * columns + x]
+
+	static uint64_t tileKey(int z, int x, int y);
+	bool tileChanged(int z, int x, int y) const;
+	void keepTile(int z, int x, int y);
+	void loadTiles(int z, int tileY, int *const *rows);
+	void writeState();
+	void writeTiles(int z, int tileY, int *const *rows, int levelWidth);
+	void reduceRows(size_t level, int *const *rows, int rowsWidth, int rowCount, int tileY, bool last);
+	void queueTile(Tile &&tile);
+	void encodeTiles();
+	void writeTile(const Tile &tile, const std::vector<unsigned char> &png);
+	std::vector<unsigned char> encode(const Tile &tile) const;
+	void stopWorkers();
+	void writeManifest();
+};
@@ -8,51 +8,53 @@
  */
 
 #include "PixelAttributes.h"
-#include <cstring> // memcpy
+#include <algorithm>
+#include <cstddef>
 
-using namespace std;
+// PIXELKERNELS_SCALAR disables the SSE2 kernels (to compare them with the
+// scalar ones)
+#if (defined(__SSE2__) || defined(_M_X64)) && !defined(PIXELKERNELS_SCALAR)
+#define PIXELKERNELS_SSE2
+#include <emmintrin.h>
+#endif
 
-PixelAttribute::AlphaMixingMode PixelAttribute::m_mixMode = PixelAttribute::AlphaMixCumulative;
+using namespace std;
 
 
 void PixelAttributes::setParameters(int width, int lines, int nextY, int scale, bool defaultEmpty)
 {
 	freeAttributes();
 	m_width = width + 1; // 1px gradient calculation
-	m_previousLine = 0;
-	//m_firstLine = 1;
 	m_lastLine = m_firstLine + lines - 1;
-	m_emptyLine = m_lastLine + 1;
-	m_lineCount = m_emptyLine + 1;
+	m_lineCount = m_lastLine + 1;
+	m_ringStart = 0;
 	m_firstY = 0;
 	m_nextY = nextY;
 	m_lastY = -1;
 	m_firstUnshadedY = 0;
 	m_scale = scale;
 
-	m_pixelAttributes = vector<vector<PixelAttribute>>(m_lineCount, vector<PixelAttribute>(m_width, PixelAttribute()));
+	// Make the line length a multiple of 64 bytes
+	m_lineStride = (m_width + 3) & ~size_t(3);
+	m_pixelAttributes.resize(m_lineStride * m_lineCount);
 
-	if (defaultEmpty)
-		for (int i = 0; i < m_lineCount; i++)
-			for (int j = 0; j < m_width; j++) {
-				m_pixelAttributes[i][j].nextEmpty = (j - 1) % (16 / scale) == 0;
-			}
+	m_blockWidth = 16 / scale;
+	int blocks = (width + m_blockWidth - 1) / m_blockWidth;
+	m_emptyBlockWords = (blocks + 63) / 64;
+	m_defaultEmpty = defaultEmpty ? ~uint64_t(0) : 0;
+	m_emptyBlocks.assign(static_cast<size_t>(m_emptyBlockWords) * m_lineCount, m_defaultEmpty);
 }
 
 void PixelAttributes::scroll(int keepY)
 {
 	int scroll = keepY - m_firstY;
 	if (scroll > 0) {
-		int i;
-		for (i = m_previousLine; i + scroll <= m_lastLine; i++) {
-			m_pixelAttributes[i].swap(m_pixelAttributes[i + scroll]);
-		}
-
-		size_t lineLength = m_width * sizeof(PixelAttribute);
-		for (; i <= m_lastLine; ++i) {
-			// TODO: get rid of memcpy. This seems non-trivial.
-			memcpy(m_pixelAttributes[i].data(), m_pixelAttributes[m_emptyLine].data(), lineLength);
-		}
+		// Line 'scroll' becomes line 0. The lines after the last line that is
+		// kept, are recycled.
+		int keep = max(m_lastLine + 1 - scroll, 0);
+		m_ringStart = (m_ringStart + scroll) % m_lineCount;
+		for (int i = keep; i <= m_lastLine; ++i)
+			clearLine(i);
 
 		m_firstY += scroll;
 		m_nextY = m_firstY;
@@ -62,66 +64,452 @@ void PixelAttributes::scroll(int keepY)
 	}
 }
 
+void PixelAttributes::reset(int firstY)
+{
+	m_ringStart = 0;
+	for (int i = 0; i <= m_lastLine; ++i)
+		clearLine(i);
+	m_firstY = firstY;
+	m_nextY = firstY;
+	m_lastY = firstY + (m_lastLine - m_firstLine);
+	m_firstUnshadedY = firstY;
+}
+
+void PixelAttributes::copyLines(const PixelAttributes &source, int yBegin, int yEnd)
+{
+	assert(source.m_width == m_width && source.m_emptyBlockWords == m_emptyBlockWords);
+	for (int y = yBegin; y < yEnd; ++y) {
+		int line = yCoord2Line(y);
+		int sourceLine = source.yCoord2Line(y);
+		if (!validLine(line) || !source.validLine(sourceLine))
+			continue;
+		copy_n(source.lineData(sourceLine), m_width, lineData(line));
+		copy_n(source.emptyBlocks(sourceLine), m_emptyBlockWords, emptyBlocks(line));
+	}
+}
+
+void PixelAttributes::clearLine(int line)
+{
+	fill_n(lineData(line), m_width, PixelAttribute());
+	fill_n(emptyBlocks(line), m_emptyBlockWords, m_defaultEmpty);
+}
+
 void PixelAttributes::freeAttributes()
 {
 	m_pixelAttributes.clear();
+	m_emptyBlocks.clear();
 }
 
 
-static inline double colorSafeBounds(double color)
+// The kernels that process runs of pixels of a line: shading and downscaling.
+// The SSE2 implementations give the same results as the scalar ones.
+struct PixelKernels
+{
+	typedef PixelAttributes::ScaleSum ScaleSum;
+
+	// Shading of the pixels begin ... end - 1 of a line: the color of a pixel is
+	// changed according to the height difference with its left and upper
+	// neighbours.
+	static void shade(PixelAttribute *line, const PixelAttribute *previousLine, int begin, int end, double emphasis, bool drawAlpha);
+	static void shadeScalar(PixelAttribute *line, const PixelAttribute *previousLine, int begin, int end, double emphasis, bool drawAlpha);
+	// Add the pixels begin ... end - 1 of a line to the sums of the scaled
+	// pixels x / scale.
+	static void sum(const PixelAttribute *line, int begin, int end, int scale, ScaleSum *sums);
+	static void sumScalar(const PixelAttribute *line, int begin, int end, int scale, ScaleSum *sums);
+#ifdef PIXELKERNELS_SSE2
+	static void shadeSSE2(PixelAttribute *line, const PixelAttribute *previousLine, int begin, int end, double emphasis, bool drawAlpha);
+	template<int Scale>
+	static void sumSSE2(const PixelAttribute *line, int begin, int end, ScaleSum *sums);
+
+	// The fields of 4 pixels, one pixel per 32-bit lane
+	struct Lanes {
+		__m128i rg;	// r | g << 16
+		__m128i ba;	// b | a << 16
+		__m128 h;
+		__m128i tn;	// t | nValid << 16
+	};
+	static inline Lanes load(const PixelAttribute *p);
+	static inline void store(PixelAttribute *p, const Lanes &lanes);
+	static inline __m128i mask(const Lanes &pixel, const Lanes &left, const Lanes &up);
+	static inline __m128 neighbourHeight(const Lanes &pixel, const Lanes &neighbour);
+	static inline void setColors(Lanes &pixel, __m128i mask, __m128i r, __m128i g, __m128i b);
+	static inline __m128d heightDifference(__m128 h, __m128 h1, __m128 h2);
+	static inline __m128i shadeChannel(__m128i channel, __m128d d);
+	static inline __m128i shadeChannel(__m128i channel, __m128d dLo, __m128d dHi);
+	static inline void addSum(ScaleSum &sum, __m128 rgba, __m128 thn);
+#endif
+};
+
+void PixelKernels::shadeScalar(PixelAttribute *line, const PixelAttribute *previousLine, int begin, int end, double emphasis, bool drawAlpha)
 {
-	if (color > 1) {
-		return 1;
+	for (int x = begin; x < end; x++) {
+		PixelAttribute &pixel = line[x];
+		const PixelAttribute &left = line[x - 1];
+		const PixelAttribute &up = previousLine[x];
+		if (!pixel.is_valid() || !left.is_valid() || !up.is_valid())
+			continue;
+		if (!pixel.m_a)
+			continue;
+		double h = pixel.m_h;
+		double h1 = left.m_a ? left.m_h : h;
+		double h2 = up.m_a ? up.m_h : h;
+		double d = (h - h1) + (h - h2);
+		if (d > 3) {
+			d = 3;
+		}
+		d = d * 12 / 255 * emphasis;
+		if (drawAlpha)
+			d = d * (1 - pixel.t());
+		pixel.m_r = PixelAttribute::toFixed(PixelAttribute::fromFixed(pixel.m_r) + d);
+		pixel.m_g = PixelAttribute::toFixed(PixelAttribute::fromFixed(pixel.m_g) + d);
+		pixel.m_b = PixelAttribute::toFixed(PixelAttribute::fromFixed(pixel.m_b) + d);
 	}
-	else if (color < 0) {
-		return 0;
+}
+
+void PixelKernels::sumScalar(const PixelAttribute *line, int begin, int end, int scale, ScaleSum *sums)
+{
+	const float k = float(1 / PixelAttribute::FixedOne);
+	for (int x = begin; x < end; x++) {
+		const PixelAttribute &pixel = line[x];
+		ScaleSum &sum = sums[x / scale];
+		if (!pixel.is_valid() || pixel.n()) {
+			// Invalid pixels without a color are not added at all
+			if (pixel.is_valid() || pixel.m_r || pixel.m_g || pixel.m_b || pixel.m_a)
+				sum.special = 1;
+			continue;
+		}
+		float a = pixel.m_a * k;
+		sum.r += pixel.m_r * k * a;
+		sum.g += pixel.m_g * k * a;
+		sum.b += pixel.m_b * k * a;
+		sum.a += a;
+		sum.t += pixel.m_t * k;
+		sum.h += pixel.m_h;
+		sum.n += 1;
 	}
-	else {
-		return color;
+}
+
+#ifdef PIXELKERNELS_SSE2
+
+static_assert(sizeof(PixelAttribute) == 16, "PixelAttribute layout assumed by the SIMD kernels");
+
+inline PixelKernels::Lanes PixelKernels::load(const PixelAttribute *p)
+{
+	static_assert(offsetof(PixelAttribute, m_r) == 0 && offsetof(PixelAttribute, m_g) == 2
+		&& offsetof(PixelAttribute, m_b) == 4 && offsetof(PixelAttribute, m_a) == 6
+		&& offsetof(PixelAttribute, m_h) == 8 && offsetof(PixelAttribute, m_t) == 12
+		&& offsetof(PixelAttribute, m_nValid) == 14, "PixelAttribute layout assumed by the SIMD kernels");
+	const float *f = reinterpret_cast<const float *>(p);
+	__m128 p0 = _mm_loadu_ps(f);
+	__m128 p1 = _mm_loadu_ps(f + 4);
+	__m128 p2 = _mm_loadu_ps(f + 8);
+	__m128 p3 = _mm_loadu_ps(f + 12);
+	_MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+	return { _mm_castps_si128(p0), _mm_castps_si128(p1), p2, _mm_castps_si128(p3) };
+}
+
+inline void PixelKernels::store(PixelAttribute *p, const Lanes &lanes)
+{
+	__m128 p0 = _mm_castsi128_ps(lanes.rg);
+	__m128 p1 = _mm_castsi128_ps(lanes.ba);
+	__m128 p2 = lanes.h;
+	__m128 p3 = _mm_castsi128_ps(lanes.tn);
+	_MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+	float *f = reinterpret_cast<float *>(p);
+	_mm_storeu_ps(f, p0);
+	_mm_storeu_ps(f + 4, p1);
+	_mm_storeu_ps(f + 8, p2);
+	_mm_storeu_ps(f + 12, p3);
+}
+
+// All ones for the pixels that are shaded: the pixel and its neighbours are
+// valid, and the pixel is not transparent.
+inline __m128i PixelKernels::mask(const Lanes &pixel, const Lanes &left, const Lanes &up)
+{
+	const __m128i validBit = _mm_set1_epi32(int(uint32_t(PixelAttribute::ValidBit) << 16));
+	__m128i valid = _mm_and_si128(_mm_and_si128(pixel.tn, left.tn), _mm_and_si128(up.tn, validBit));
+	__m128i transparent = _mm_cmpeq_epi32(_mm_srli_epi32(pixel.ba, 16), _mm_setzero_si128());
+	return _mm_andnot_si128(transparent, _mm_cmpeq_epi32(valid, validBit));
+}
+
+// The height of the neighbour, or the height of the pixel if the neighbour is transparent
+inline __m128 PixelKernels::neighbourHeight(const Lanes &pixel, const Lanes &neighbour)
+{
+	__m128 transparent = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_srli_epi32(neighbour.ba, 16), _mm_setzero_si128()));
+	return _mm_or_ps(_mm_and_ps(transparent, pixel.h), _mm_andnot_ps(transparent, neighbour.h));
+}
+
+inline void PixelKernels::setColors(Lanes &pixel, __m128i mask, __m128i r, __m128i g, __m128i b)
+{
+	__m128i rg = _mm_or_si128(r, _mm_slli_epi32(g, 16));
+	__m128i ba = _mm_or_si128(b, _mm_and_si128(pixel.ba, _mm_set1_epi32(int(0xffff0000u))));
+	pixel.rg = _mm_or_si128(_mm_and_si128(mask, rg), _mm_andnot_si128(mask, pixel.rg));
+	pixel.ba = _mm_or_si128(_mm_and_si128(mask, ba), _mm_andnot_si128(mask, pixel.ba));
+}
+
+// Two lanes of a channel: fixed point + d, clamped, back to fixed point
+inline __m128i PixelKernels::shadeChannel(__m128i channel, __m128d d)
+{
+	const __m128d zero = _mm_setzero_pd();
+	const __m128d one = _mm_set1_pd(1);
+	__m128d v = _mm_add_pd(_mm_mul_pd(_mm_cvtepi32_pd(channel), _mm_set1_pd(1 / PixelAttribute::FixedOne)), d);
+	v = _mm_min_pd(_mm_max_pd(v, zero), one);
+	return _mm_cvttpd_epi32(_mm_add_pd(_mm_mul_pd(v, _mm_set1_pd(PixelAttribute::FixedOne)), _mm_set1_pd(0.5)));
+}
+
+inline __m128i PixelKernels::shadeChannel(__m128i channel, __m128d dLo, __m128d dHi)
+{
+	return _mm_unpacklo_epi64(shadeChannel(channel, dLo), shadeChannel(_mm_srli_si128(channel, 8), dHi));
+}
+
+inline __m128d PixelKernels::heightDifference(__m128 h, __m128 h1, __m128 h2)
+{
+	__m128d hd = _mm_cvtps_pd(h);
+	__m128d d = _mm_add_pd(_mm_sub_pd(hd, _mm_cvtps_pd(h1)), _mm_sub_pd(hd, _mm_cvtps_pd(h2)));
+	return _mm_min_pd(d, _mm_set1_pd(3));
+}
+
+void PixelKernels::shadeSSE2(PixelAttribute *line, const PixelAttribute *previousLine, int begin, int end, double emphasis, bool drawAlpha)
+{
+	const __m128i low16 = _mm_set1_epi32(0xffff);
+	int x = begin;
+	for (; x + 4 <= end; x += 4) {
+		Lanes pixel = load(line + x);
+		Lanes left = load(line + x - 1);
+		Lanes up = load(previousLine + x);
+		__m128i shade = mask(pixel, left, up);
+		if (!_mm_movemask_epi8(shade))
+			continue;
+		__m128 h1 = neighbourHeight(pixel, left);
+		__m128 h2 = neighbourHeight(pixel, up);
+		__m128d d[2] = {
+			heightDifference(pixel.h, h1, h2),
+			heightDifference(_mm_movehl_ps(pixel.h, pixel.h), _mm_movehl_ps(h1, h1), _mm_movehl_ps(h2, h2)),
+		};
+		__m128i t = _mm_and_si128(pixel.tn, low16);
+		for (int i = 0; i < 2; i++) {
+			d[i] = _mm_mul_pd(_mm_div_pd(_mm_mul_pd(d[i], _mm_set1_pd(12)), _mm_set1_pd(255)), _mm_set1_pd(emphasis));
+			if (drawAlpha) {
+				__m128d td = _mm_mul_pd(_mm_cvtepi32_pd(i ? _mm_srli_si128(t, 8) : t), _mm_set1_pd(1 / PixelAttribute::FixedOne));
+				d[i] = _mm_mul_pd(d[i], _mm_sub_pd(_mm_set1_pd(1), td));
+			}
+		}
+		__m128i r = shadeChannel(_mm_and_si128(pixel.rg, low16), d[0], d[1]);
+		__m128i g = shadeChannel(_mm_srli_epi32(pixel.rg, 16), d[0], d[1]);
+		__m128i b = shadeChannel(_mm_and_si128(pixel.ba, low16), d[0], d[1]);
+		setColors(pixel, shade, r, g, b);
+		store(line + x, pixel);
 	}
+	shadeScalar(line, previousLine, x, end, emphasis, drawAlpha);
 }
 
+inline void PixelKernels::addSum(ScaleSum &sum, __m128 rgba, __m128 thn)
+{
+	static_assert(offsetof(ScaleSum, r) == 0 && offsetof(ScaleSum, t) == 16 && offsetof(ScaleSum, special) == 28,
+		"ScaleSum layout assumed by the SIMD kernels");
+	float *f = &sum.r;
+	_mm_storeu_ps(f, _mm_add_ps(_mm_loadu_ps(f), rgba));
+	_mm_storeu_ps(f + 4, _mm_add_ps(_mm_loadu_ps(f + 4), thn));
+}
+
+// Blocks of 4 pixels are summed in lanes, transposed to one pixel per vector,
+// and added to the sums of their scaled pixels. Pixels that are not summed
+// are masked out.
+template<int Scale>
+void PixelKernels::sumSSE2(const PixelAttribute *line, int begin, int end, ScaleSum *sums)
+{
+	const __m128i low16 = _mm_set1_epi32(0xffff);
+	const __m128i validBit = _mm_set1_epi32(int(uint32_t(PixelAttribute::ValidBit) << 16));
+	const __m128i nBits = _mm_set1_epi32(int(uint32_t(PixelAttribute::MaxN) << 16));
+	const __m128 k = _mm_set1_ps(float(1 / PixelAttribute::FixedOne));
+	int x = begin;
+	int aligned = min((begin + 3) & ~3, end);
+	sumScalar(line, x, aligned, Scale, sums);
+	for (x = aligned; x + 4 <= end; x += 4) {
+		Lanes pixel = load(line + x);
+		__m128i valid = _mm_cmpeq_epi32(_mm_and_si128(pixel.tn, validBit), validBit);
+		__m128i normalized = _mm_cmpeq_epi32(_mm_and_si128(pixel.tn, nBits), _mm_setzero_si128());
+		__m128i summed = _mm_and_si128(valid, normalized);
+		__m128i colorless = _mm_cmpeq_epi32(_mm_or_si128(pixel.rg, pixel.ba), _mm_setzero_si128());
+		// Valid pixels that are sums, and invalid pixels with a color
+		__m128i special = _mm_or_si128(_mm_andnot_si128(normalized, valid), _mm_andnot_si128(_mm_or_si128(valid, colorless), _mm_set1_epi32(-1)));
+		int specialMask = _mm_movemask_ps(_mm_castsi128_ps(special));
+		if (specialMask)
+			for (int i = 0; i < 4; i++)
+				if (specialMask & (1 << i))
+					sums[(x + i) / Scale].special = 1;
+		if (!_mm_movemask_epi8(summed))
+			continue;
+		__m128 mask = _mm_castsi128_ps(summed);
+		__m128 a = _mm_and_ps(mask, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(pixel.ba, 16)), k));
+		__m128 r = _mm_mul_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(pixel.rg, low16)), k), a);
+		__m128 g = _mm_mul_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(pixel.rg, 16)), k), a);
+		__m128 b = _mm_mul_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(pixel.ba, low16)), k), a);
+		__m128 t = _mm_and_ps(mask, _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(pixel.tn, low16)), k));
+		__m128 h = _mm_and_ps(mask, pixel.h);
+		__m128 n = _mm_and_ps(mask, _mm_set1_ps(1));
+		__m128 zero = _mm_setzero_ps();
+		_MM_TRANSPOSE4_PS(r, g, b, a);
+		_MM_TRANSPOSE4_PS(t, h, n, zero);
+		// One pixel at a time, in the order of sumScalar(), because the
+		// float sums depend on the order of the additions
+		addSum(sums[x / Scale], r, t);
+		addSum(sums[(x + 1) / Scale], g, h);
+		addSum(sums[(x + 2) / Scale], b, n);
+		addSum(sums[(x + 3) / Scale], a, zero);
+	}
+	sumScalar(line, x, end, Scale, sums);
+}
+
+#endif // PIXELKERNELS_SSE2
+
+inline void PixelKernels::shade(PixelAttribute *line, const PixelAttribute *previousLine, int begin, int end, double emphasis, bool drawAlpha)
+{
+#ifdef PIXELKERNELS_SSE2
+	shadeSSE2(line, previousLine, begin, end, emphasis, drawAlpha);
+#else
+	shadeScalar(line, previousLine, begin, end, emphasis, drawAlpha);
+#endif
+}
+
+inline void PixelKernels::sum(const PixelAttribute *line, int begin, int end, int scale, ScaleSum *sums)
+{
+#ifdef PIXELKERNELS_SSE2
+	switch (scale) {
+	case 2: sumSSE2<2>(line, begin, end, sums); return;
+	case 4: sumSSE2<4>(line, begin, end, sums); return;
+	case 8: sumSSE2<8>(line, begin, end, sums); return;
+	case 16: sumSSE2<16>(line, begin, end, sums); return;
+	}
+#endif
+	sumScalar(line, begin, end, scale, sums);
+}
 
 void PixelAttributes::renderShading(double emphasis, bool drawAlpha)
 {
 	int y;
 	for (y = yCoord2Line(m_firstUnshadedY); y <= yCoord2Line(m_lastY); y++) {
-		for (int x = 1; x < m_width; x++) {
-			if (m_pixelAttributes[y][x].nextEmpty) {
-				x += 16 / m_scale - 1;
+		PixelAttribute *line = lineData(y);
+		const PixelAttribute *previousLine = lineData(y - 1);
+		const uint64_t *emptyBlocks = this->emptyBlocks(y);
+		auto blockEmpty = [&](int x) {
+			int block = (x - 1) / m_blockWidth;
+			return (emptyBlocks[block >> 6] >> (block & 63)) & 1;
+		};
+		// Shade runs of block columns that are not empty
+		int x = 1;
+		while (x < m_width) {
+			if (blockEmpty(x)) {
+				x += m_blockWidth;
+				continue;
+			}
+			int begin = x;
+			do {
+				x += m_blockWidth;
+			} while (x < m_width && !blockEmpty(x));
+			int end = min(x, m_width);
+			// Normalizing does not change the heights and alpha values used
+			// for shading the neighbours.
+			for (int i = begin; i < end; i++)
+				if (!line[i].isNormalized())
+					line[i].normalize();
+			PixelKernels::shade(line, previousLine, begin, end, emphasis, drawAlpha);
+		}
+	}
+	m_firstUnshadedY = y - yCoord2Line(0);
+}
+
+// The pixels of each scaled pixel are summed by the kernels. The result is
+// the same as adding the pixels one by one (add()), and normalizing, which is
+// done instead if any of them is not a plain valid pixel.
+void PixelAttributes::scaleLines(PixelAttributes &scaled, int yBegin, int yEnd, int xBegin, int xEnd)
+{
+	int scale = scaled.m_scale;
+	if (yBegin >= yEnd || xBegin >= xEnd)
+		return;
+	int scaledBegin = xBegin / scale;
+	int scaledEnd = (xEnd - 1) / scale + 1;
+	if (scaled.m_scaleSums.size() < size_t(scaledEnd))
+		scaled.m_scaleSums.resize(scaledEnd);
+	ScaleSum *sums = scaled.m_scaleSums.data();
+	// The first block column that can be skipped
+	int firstBlock = (xBegin + m_blockWidth - 1) / m_blockWidth * m_blockWidth;
+	auto skipped = [&](int y, int x) {
+		return x >= firstBlock && nextEmpty(y, x / m_blockWidth * m_blockWidth);
+	};
+
+	for (int scaledY = yBegin / scale; scaledY * scale < yEnd; scaledY++) {
+		PixelAttribute *scaledLine = scaled.line(scaledY);
+		if (!scaledLine)
+			continue;
+		int y0 = max(yBegin, scaledY * scale);
+		int y1 = min(yEnd, (scaledY + 1) * scale);
+		fill(sums + scaledBegin, sums + scaledEnd, ScaleSum());
+		for (int y = y0; y < y1; y++) {
+			const PixelAttribute *line = this->line(y);
+			if (!line)
 				continue;
+			int begin = xBegin;
+			for (int x = firstBlock; x < xEnd; x += m_blockWidth) {
+				if (!nextEmpty(y, x))
+					continue;
+				scaled.setNextEmpty(scaledY, x / scale, true);
+				PixelKernels::sum(line, begin, x, scale, sums);
+				begin = x + m_blockWidth;
 			}
-			if (!m_pixelAttributes[y][x].isNormalized())
-				m_pixelAttributes[y][x].normalize();
-			if (!m_pixelAttributes[y][x].is_valid()) {
-				if (x + 1 < m_width && !m_pixelAttributes[y][x + 1].isNormalized())
-					m_pixelAttributes[y][x + 1].normalize();
-				x++;
+			PixelKernels::sum(line, begin, xEnd, scale, sums);
+		}
+
+		for (int scaledX = scaledBegin; scaledX < scaledEnd; scaledX++) {
+			const ScaleSum &sum = sums[scaledX];
+			PixelAttribute &pixel = scaledLine[scaledX];
+			// Call f for the source pixels of the scaled pixel, in the order
+			// in which they would be added, until it returns false.
+			auto forEachPixel = [&](auto f) {
+				for (int y = y0; y < y1; y++) {
+					const PixelAttribute *line = this->line(y);
+					if (!line)
+						continue;
+					for (int x = max(xBegin, scaledX * scale); x < min(xEnd, (scaledX + 1) * scale); x++)
+						if (!skipped(y, x) && !f(line[x]))
+							return;
+				}
+			};
+			if (sum.special || pixel.is_valid()) {
+				forEachPixel([&](const PixelAttribute &p) {
+					if (p.is_valid() || p.color().to_uint())
+						pixel.add(p);
+					return true;
+				});
+				if (pixel.n() && (pixel.is_valid() || pixel.color().to_uint()))
+					pixel.normalize();
 				continue;
 			}
-			if (!m_pixelAttributes[y - 1][x].is_valid() || !m_pixelAttributes[y][x - 1].is_valid())
+			if (!sum.n)
 				continue;
-			if (!m_pixelAttributes[y][x].m_a)
+			// As in add(), the thickness of the first pixel is not counted
+			const PixelAttribute *first = nullptr;
+			forEachPixel([&](const PixelAttribute &p) {
+				if (p.is_valid())
+					first = &p;
+				return !first;
+			});
+			if (sum.n == 1) {
+				pixel = *first;
+				pixel.m_t = 0;
 				continue;
-			double h = m_pixelAttributes[y][x].m_h;
-			double h1 = m_pixelAttributes[y][x - 1].m_a ? m_pixelAttributes[y][x - 1].m_h : h;
-			double h2 = m_pixelAttributes[y - 1][x].m_a ? m_pixelAttributes[y - 1][x].m_h : h;
-			double d = (h - h1) + (h - h2);
-			if (d > 3) {
-				d = 3;
 			}
-			d = d * 12 / 255 * emphasis;
-#define pixel (m_pixelAttributes[y][x])
-			//PixelAttribute &pixel = m_pixelAttributes[y][x];
-			if (drawAlpha)
-				d = d * (1 - pixel.m_t);
-			pixel.m_r = colorSafeBounds(pixel.m_r + d);
-			pixel.m_g = colorSafeBounds(pixel.m_g + d);
-			pixel.m_b = colorSafeBounds(pixel.m_b + d);
-#undef pixel
+			PixelAttribute::Values v;
+			v.n = 0;
+			v.h = double(sum.h) / sum.n;
+			v.t = (double(sum.t) - first->t()) / sum.n;
+			v.a = double(sum.a) / sum.n;
+			v.r = sum.a ? double(sum.r) / sum.a : 0;
+			v.g = sum.a ? double(sum.g) / sum.a : 0;
+			v.b = sum.a ? double(sum.b) / sum.a : 0;
+			pixel.pack(v);
 		}
 	}
-	m_firstUnshadedY = y - yCoord2Line(0);
 }
 
 // Meaning and usage of parameter 'n'.
@@ -155,131 +543,160 @@ void PixelAttributes::renderShading(double emphasis, bool drawAlpha)
 // normalize() converts from n>0 to n==0 representation
 void PixelAttribute::normalize(double count, Color defaultColor)
 {
-	if (!m_n) {
+	if (!n()) {
+		// Already normalized
+		return;
+	}
+	Values v = unpack();
+	normalize(v, count, defaultColor);
+	pack(v);
+}
+
+void PixelAttribute::normalize(Values &v, double count, Color defaultColor)
+{
+	if (!v.n) {
 		// Already normalized
 		return;
 	}
-	if (m_n < count) {
-		m_r += (defaultColor.r / 255.0) * (defaultColor.a / 255.0) * (count - m_n);
-		m_g += (defaultColor.g / 255.0) * (defaultColor.a / 255.0) * (count - m_n);
-		m_b += (defaultColor.b / 255.0) * (defaultColor.a / 255.0) * (count - m_n);
-		m_a += (defaultColor.a / 255.0) * (count - m_n);
-		m_h *= double(count) / m_n;
-		m_t *= double(count) / m_n;
-		m_n = count;
+	if (v.n < count) {
+		v.r += (defaultColor.r / 255.0) * (defaultColor.a / 255.0) * (count - v.n);
+		v.g += (defaultColor.g / 255.0) * (defaultColor.a / 255.0) * (count - v.n);
+		v.b += (defaultColor.b / 255.0) * (defaultColor.a / 255.0) * (count - v.n);
+		v.a += (defaultColor.a / 255.0) * (count - v.n);
+		v.h *= double(count) / v.n;
+		v.t *= double(count) / v.n;
+		v.n = count;
 	}
-	if (m_n != 1) {
-		m_r /= m_a;
-		m_g /= m_a;
-		m_b /= m_a;
-		m_a /= m_n;
-		m_t /= m_n;
-		m_h /= m_n;
+	if (v.n != 1) {
+		// No color if there is no alpha
+		v.r = v.a ? v.r / v.a : 0;
+		v.g = v.a ? v.g / v.a : 0;
+		v.b = v.a ? v.b / v.a : 0;
+		v.a /= v.n;
+		v.t /= v.n;
+		v.h /= v.n;
 	}
-	m_n = 0;
+	v.n = 0;
 }
 
 void PixelAttribute::add(const PixelAttribute &p)
 {
-	if (!m_n) {
-		m_r *= m_a;
-		m_g *= m_a;
-		m_b *= m_a;
-		m_n = 1;
+	Values v = unpack();
+	add(v, p.unpack());
+	pack(v);
+}
+
+void PixelAttribute::add(Values &v, const Values &p)
+{
+	if (!v.n) {
+		v.r *= v.a;
+		v.g *= v.a;
+		v.b *= v.a;
+		v.n = 1;
 	}
-	if (!is_valid()) {
-		m_r = p.m_r;
-		m_g = p.m_g;
-		m_b = p.m_b;
-		m_a = p.m_a;
-		m_t = 0;
-		m_h = p.m_h;
-		m_n = p.m_n;
+	if (std::isnan(v.h)) {
+		v.r = p.r;
+		v.g = p.g;
+		v.b = p.b;
+		v.a = p.a;
+		v.t = 0;
+		v.h = p.h;
+		v.n = p.n;
 	}
-	else if (!p.m_n) {
-		m_r += p.m_r * p.m_a;
-		m_g += p.m_g * p.m_a;
-		m_b += p.m_b * p.m_a;
-		m_a += p.m_a;
-		m_t += p.m_t;
-		m_h += p.m_h;
-		m_n++;
+	else if (!p.n) {
+		v.r += p.r * p.a;
+		v.g += p.g * p.a;
+		v.b += p.b * p.a;
+		v.a += p.a;
+		v.t += p.t;
+		v.h += p.h;
+		v.n++;
 	}
 	else {
-		m_r += p.m_r;
-		m_g += p.m_g;
-		m_b += p.m_b;
-		m_a += p.m_a;
-		m_t += p.m_t;
-		m_h += p.m_h;
-		m_n += p.m_n;
+		v.r += p.r;
+		v.g += p.g;
+		v.b += p.b;
+		v.a += p.a;
+		v.t += p.t;
+		v.h += p.h;
+		v.n += p.n;
 	}
 }
 
-void PixelAttribute::mixUnder(const PixelAttribute &p)
+void PixelAttribute::mixUnder(const PixelAttribute &p, AlphaMixingMode mixMode)
 {
 	if (!is_valid() || m_a == 0) {
 		if (!is_valid() || p.m_a != 0) {
-			m_n = p.m_n;
+			m_nValid = p.m_nValid;
 			m_r = p.m_r;
 			m_g = p.m_g;
 			m_b = p.m_b;
 			m_a = p.m_a;
 			m_t = 0;
+			m_h = p.m_h;
+		}
+		else {
+			// Keep the summed values, use the height of p.
+			Values v = unpack();
+			v.h = p.unpack().h;
+			pack(v);
 		}
-		m_h = p.m_h;
 	}
-	else if (m_a == 1)
+	else if (m_a == 0xffff && n() <= 1)
 		; // Nothing to do: pixel is already fully opaque.
-	else if ((m_mixMode & AlphaMixCumulative) == AlphaMixCumulative || (m_mixMode == AlphaMixAverage && p.m_a == 1)) {
-		PixelAttribute pp(p);
+	else if ((mixMode & AlphaMixCumulative) == AlphaMixCumulative || (mixMode == AlphaMixAverage && p.m_a == 0xffff)) {
+		Values pp = p.unpack();
 #ifdef DEBUG
-		assert(pp.isNormalized());
+		assert(!pp.n);
 #else
-		if (!pp.isNormalized())
-			pp.normalize();
+		if (pp.n)
+			normalize(pp, 0, Color(127, 127, 127));
 #endif
-		if (!isNormalized())
-			normalize();
-		int prev_alpha = alpha();
-		m_r = (m_a * m_r + pp.m_a * (1 - m_a) * pp.m_r);
-		m_g = (m_a * m_g + pp.m_a * (1 - m_a) * pp.m_g);
-		m_b = (m_a * m_b + pp.m_a * (1 - m_a) * pp.m_b);
-		m_a = (m_a + (1 - m_a) * pp.m_a);
-		if (pp.m_a != 1)
-			m_t = (m_t + pp.m_t) / 2;
+		Values v = unpack();
+		normalize(v, 0, Color(127, 127, 127));
+		int prev_alpha = int(v.a * 255 + 0.5);
+		v.r = (v.a * v.r + pp.a * (1 - v.a) * pp.r);
+		v.g = (v.a * v.g + pp.a * (1 - v.a) * pp.g);
+		v.b = (v.a * v.b + pp.a * (1 - v.a) * pp.b);
+		v.a = (v.a + (1 - v.a) * pp.a);
+		if (pp.a != 1)
+			v.t = (v.t + pp.t) / 2;
 		else
-			m_h = pp.m_h;
-		if ((m_mixMode & AlphaMixDarkenBit) && prev_alpha >= 254 && pp.alpha() < 255) {
+			v.h = pp.h;
+		if ((mixMode & AlphaMixDarkenBit) && prev_alpha >= 254 && int(pp.a * 255 + 0.5) < 255) {
 			// Darken
 			// Parameters make deep water look good :-)
 			// (maybe this setting should be per-node-type, and obtained from the colors file ?)
-			m_r = m_r * 0.95;
-			m_g = m_g * 0.95;
-			m_b = m_b * 0.95;
+			v.r = v.r * 0.95;
+			v.g = v.g * 0.95;
+			v.b = v.b * 0.95;
 		}
+		pack(v);
 	}
 #ifdef DEBUG
-	else if (m_mixMode == AlphaMixAverage && p.m_a != 1) {
+	else if (mixMode == AlphaMixAverage && p.m_a != 0xffff) {
 #else
 	else {
 #endif
-		if (p.m_a == 1)
-			normalize();
-		double h = p.m_h;
-		double t = m_t;
-		add(p);
-		if (p.m_a == 1) {
-			normalize();
-			m_t = t;
-			m_a = 1;
-			m_h = m_n * h;
+		Values v = unpack();
+		Values pv = p.unpack();
+		if (pv.a == 1)
+			normalize(v, 0, Color(127, 127, 127));
+		double h = pv.h;
+		double t = v.t;
+		add(v, pv);
+		if (pv.a == 1) {
+			normalize(v, 0, Color(127, 127, 127));
+			v.t = t;
+			v.a = 1;
+			v.h = v.n * h;
 		}
+		pack(v);
 	}
 #ifdef DEBUG
 	else {
 		// Internal error
-		assert(1 && m_mixMode);
+		assert(1 && mixMode);
 	}
 #endif
 }
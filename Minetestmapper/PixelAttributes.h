@@ -10,6 +10,7 @@
 #pragma once
 
 #include "Color.h"
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstdint>
@@ -17,7 +18,15 @@
 #include <stdexcept>
 #include <vector>
 
-class PixelAttribute
+// A pixel of the map, with its color, height and transparency.
+//
+// The values are stored in 16 bytes: color, alpha and thickness as 16-bit
+// fixed point, the height as a float, and the count of summed pixels (see
+// normalize()) and the valid flag together in 16 bits. An invalid height is a
+// flag, not NaN. For summed pixels, the averages are stored instead of the
+// sums, so that they stay in the range of the fixed point values.
+// Computations are done on the unpacked (double) values.
+class alignas(16) PixelAttribute
 {
 public:
 	enum AlphaMixingMode {
@@ -26,46 +35,76 @@ public:
 		AlphaMixCumulativeDarken = 0x03,
 		AlphaMixAverage = 0x04,
 	};
-	static void setMixMode(AlphaMixingMode mode);
 	PixelAttribute() = default;
 	//	PixelAttribute(const PixelAttribute &p);
 	PixelAttribute(const Color &color, double height);
 	PixelAttribute(const ColorEntry &entry, double height);
-	bool nextEmpty{false};
-	double h() const { return m_h / (m_n ? m_n : 1); }
-	double t() const { return m_t / (m_n ? m_n : 1); }
-	double a() const { return m_a / (m_n ? m_n : 1); }
-	double r() const { return m_r / (m_n ? m_a : 1); }
-	double g() const { return m_g / (m_n ? m_a : 1); }
-	double b() const { return m_b / (m_n ? m_a : 1); }
+	double h() const { return m_h; }
+	double t() const { return fromFixed(m_t); }
+	double a() const { return fromFixed(m_a); }
+	double r() const { return n() ? premultipliedColor(m_r) : fromFixed(m_r); }
+	double g() const { return n() ? premultipliedColor(m_g) : fromFixed(m_g); }
+	double b() const { return n() ? premultipliedColor(m_b) : fromFixed(m_b); }
 	uint8_t red() const { return int(r() * 255 + 0.5); }
 	uint8_t green() const { return int(g() * 255 + 0.5); }
 	uint8_t blue() const { return int(b() * 255 + 0.5); }
 	uint8_t alpha() const { return int(a() * 255 + 0.5); }
 	uint8_t thicken() const { return int(t() * 255 + 0.5); }
 	unsigned height() const { return unsigned(h() + 0.5); }
-	bool isNormalized() const { return !m_n; }
+	bool isNormalized() const { return !n(); }
 	Color color() const { return Color(red(), green(), blue(), alpha()); }
 
-	inline bool is_valid() const { return !std::isnan(m_h); }
-	PixelAttribute &operator=(const PixelAttribute &p);
+	inline bool is_valid() const { return m_nValid & ValidBit; }
 	void normalize(double count = 0, Color defaultColor = Color(127, 127, 127));
 	void add(const PixelAttribute &p);
-	void mixUnder(const PixelAttribute &p);
+	// Mix p under this pixel, using the given alpha mixing mode
+	void mixUnder(const PixelAttribute &p, AlphaMixingMode mixMode);
 
 private:
-	static AlphaMixingMode m_mixMode;
-	double m_n{0};
-	double m_h{std::numeric_limits<double>::quiet_NaN()};
-	double m_t{0};
-	double m_a{0};
-	double m_r{0};
-	double m_g{0};
-	double m_b{0};
+	// The pixel values as double. An invalid height is NaN. When n > 0, the
+	// other values are sums.
+	struct Values {
+		double n;
+		double h;
+		double t;
+		double a;
+		double r;
+		double g;
+		double b;
+	};
+	static constexpr double FixedOne = 0xffff;
+	static constexpr uint16_t MaxN = 0x7fff;	// Larger counts are saturated
+	static constexpr uint16_t ValidBit = 0x8000;
+
+	uint16_t m_r{0};
+	uint16_t m_g{0};
+	uint16_t m_b{0};
+	uint16_t m_a{0};
+	float m_h{0};
+	uint16_t m_t{0};
+	uint16_t m_nValid{0};	// Bits 0-14: count of summed pixels (n), bit 15: valid
+
+	static double fromFixed(uint16_t v) { return v * (1 / FixedOne); }
+	static uint16_t toFixed(double v) { return uint16_t(std::min(std::max(v, 0.0), 1.0) * FixedOne + 0.5); }
+	unsigned n() const { return m_nValid & MaxN; }
+	// Color of a summed pixel. No color if there is no alpha.
+	double premultipliedColor(uint16_t c) const { return m_a ? double(c) / m_a : 0; }
+	Values unpack() const;
+	void pack(const Values &v);
+	static void normalize(Values &v, double count, Color defaultColor);
+	static void add(Values &v, const Values &p);
 
 	friend class PixelAttributes;
+	friend struct PixelKernels;
 };
+static_assert(sizeof(PixelAttribute) <= 16, "PixelAttribute should be compact");
 
+// The pixels of a number of map lines, and the line before them (for shading).
+//
+// The lines are stored in a single allocation, which is used as a ring buffer:
+// scrolling only moves the start of the ring, and clears the recycled lines.
+// Whether a block column (16 nodes) of a line is empty, is kept in a bitmap
+// per line.
 class PixelAttributes
 {
 public:
@@ -73,29 +112,71 @@ public:
 	~PixelAttributes() = default;
 	void setParameters(int width, int lines, int nextY, int scale, bool defaultEmpty);
 	void scroll(int keepY);
+	// Clear all lines, and make firstY the first line
+	void reset(int firstY);
+	// Copy the lines yBegin ... yEnd - 1 of source, which has the same width
+	void copyLines(const PixelAttributes &source, int yBegin, int yEnd);
 	PixelAttribute &attribute(int y, int x);
+	// Pixel x = 0 of line y, or nullptr if y is not in the buffer.
+	// Pixels -1 ... width - 1 of the line can be indexed.
+	PixelAttribute *line(int y);
+	// Whether the block column that starts at pixel x of line y is empty.
+	// Always false if x is not the first pixel of a block column.
+	bool nextEmpty(int y, int x) const;
+	void setNextEmpty(int y, int x, bool empty);
+	// Shade the lines that were added since the last call (using SSE2 if available)
 	void renderShading(double emphasis, bool drawAlpha);
+	// Downscale the lines yBegin ... yEnd - 1, pixels xBegin ... xEnd - 1,
+	// into the (normalized) pixels of scaled: the average of each block of
+	// scale x scale pixels. Empty block columns are skipped, and marked empty
+	// in scaled. Uses SSE2 if available.
+	void scaleLines(PixelAttributes &scaled, int yBegin, int yEnd, int xBegin, int xEnd);
 	int getNextY() { return m_nextY; }
 	void setLastY(int y);
 	int getLastY() { return m_lastY; }
 
 private:
-	int yCoord2Line(int y) { return y - m_firstY + m_firstLine; }
+	// The sums of the source pixels of a scaled pixel (see scaleLines()):
+	// premultiplied color, alpha, thickness, height and count of the valid
+	// normalized pixels.
+	struct ScaleSum {
+		float r{0}, g{0}, b{0}, a{0};
+		float t{0}, h{0}, n{0};
+		float special{0};	// Nonzero if other pixels must be added too
+	};
+
+	int yCoord2Line(int y) const { return y - m_firstY + m_firstLine; }
+	bool validLine(int line) const { return line >= m_firstLine && line <= m_lastLine; }
+	int ringIndex(int line) const { int i = m_ringStart + line; return i < m_lineCount ? i : i - m_lineCount; }
+	// Pixel -1 of a line
+	PixelAttribute *lineData(int line) { return m_pixelAttributes.data() + static_cast<size_t>(ringIndex(line)) * m_lineStride; }
+	const PixelAttribute *lineData(int line) const { return m_pixelAttributes.data() + static_cast<size_t>(ringIndex(line)) * m_lineStride; }
+	uint64_t *emptyBlocks(int line) { return m_emptyBlocks.data() + static_cast<size_t>(ringIndex(line)) * m_emptyBlockWords; }
+	const uint64_t *emptyBlocks(int line) const { return m_emptyBlocks.data() + static_cast<size_t>(ringIndex(line)) * m_emptyBlockWords; }
+	void clearLine(int line);
 	void freeAttributes();
 
 private:
-	int m_previousLine{};
-	const int m_firstLine{1};
+	const int m_firstLine{1};	// Line 0 is the line before the first line
 	int m_lastLine{};
-	int m_emptyLine{};
 	int m_lineCount{};
-	std::vector<std::vector<PixelAttribute>> m_pixelAttributes;
+	int m_ringStart{};		// Index in the ring of line 0
+	std::vector<PixelAttribute> m_pixelAttributes;
+	size_t m_lineStride{};		// Pixels per line, including padding
+	std::vector<uint64_t> m_emptyBlocks;
+	int m_emptyBlockWords{};	// Bitmap words per line
+	uint64_t m_defaultEmpty{};	// Bitmap word of a cleared line
+	int m_blockWidth{};		// Pixels per block column
 	int m_width{};
 	int m_firstY{};
 	int m_nextY{};
 	int m_lastY{};
 	int m_firstUnshadedY{};
 	int m_scale{};
+	std::vector<ScaleSum> m_scaleSums;
+	PixelAttribute m_outsidePixel;	// Returned by attribute() for a line that is not in the buffer
+
+	friend struct PixelKernels;
 };
 
 inline void PixelAttributes::setLastY(int y)
@@ -110,23 +191,55 @@ inline void PixelAttributes::setLastY(int y)
 	m_lastY = y;
 }
 
-inline void PixelAttribute::setMixMode(AlphaMixingMode mode)
+inline PixelAttribute &PixelAttributes::attribute(int y, int x)
 {
-	if (mode == AlphaMixDarkenBit)
-		mode = AlphaMixCumulativeDarken;
-	m_mixMode = mode;
+#ifdef DEBUG
+	assert(validLine(yCoord2Line(y)));
+#else
+	if (!validLine(yCoord2Line(y))) {
+		m_outsidePixel = PixelAttribute();
+		return m_outsidePixel;
+	}
+#endif
+	return lineData(yCoord2Line(y))[x + 1];
 }
 
-inline PixelAttribute &PixelAttributes::attribute(int y, int x)
+inline PixelAttribute *PixelAttributes::line(int y)
 {
 #ifdef DEBUG
-	assert(yCoord2Line(y) >= m_firstLine && yCoord2Line(y) <= m_lastLine);
+	assert(validLine(yCoord2Line(y)));
 #else
-	static PixelAttribute p;
-	if (!(yCoord2Line(y) >= m_firstLine && yCoord2Line(y) <= m_lastLine))
-		return p;
+	if (!validLine(yCoord2Line(y)))
+		return nullptr;
 #endif
-	return m_pixelAttributes[yCoord2Line(y)][x + 1];
+	return lineData(yCoord2Line(y)) + 1;
+}
+
+inline bool PixelAttributes::nextEmpty(int y, int x) const
+{
+	int line = yCoord2Line(y);
+	if (!validLine(line) || x < 0 || x % m_blockWidth)
+		return false;
+	int block = x / m_blockWidth;
+	return (emptyBlocks(line)[block >> 6] >> (block & 63)) & 1;
+}
+
+inline void PixelAttributes::setNextEmpty(int y, int x, bool empty)
+{
+	int line = yCoord2Line(y);
+#ifdef DEBUG
+	assert(validLine(line));
+	assert(x >= 0 && x % m_blockWidth == 0);
+#else
+	if (!validLine(line) || x < 0)
+		return;
+#endif
+	int block = x / m_blockWidth;
+	uint64_t bit = uint64_t(1) << (block & 63);
+	if (empty)
+		emptyBlocks(line)[block >> 6] |= bit;
+	else
+		emptyBlocks(line)[block >> 6] &= ~bit;
 }
 
 //inline PixelAttribute::PixelAttribute(const PixelAttribute &p) :
@@ -135,25 +248,52 @@ inline PixelAttribute &PixelAttributes::attribute(int y, int x)
 //}
 
 inline PixelAttribute::PixelAttribute(const Color &color, double height)
-	: nextEmpty(false), m_n(0), m_h(height), m_t(0), m_a(color.a / 255.0),
-	  m_r(color.r / 255.0), m_g(color.g / 255.0), m_b(color.b / 255.0)
+	: m_r(color.r * 0x101), m_g(color.g * 0x101), m_b(color.b * 0x101), m_a(color.a * 0x101),
+	  m_h(std::isnan(height) ? 0 : float(height)), m_t(0), m_nValid(std::isnan(height) ? 0 : ValidBit)
 {
 }
 
 inline PixelAttribute::PixelAttribute(const ColorEntry &entry, double height)
-	: nextEmpty(false), m_n(0), m_h(height), m_t(entry.t / 255.0), m_a(entry.a / 255.0),
-	  m_r(entry.r / 255.0), m_g(entry.g / 255.0), m_b(entry.b / 255.0)
+	: m_r(entry.r * 0x101), m_g(entry.g * 0x101), m_b(entry.b * 0x101), m_a(entry.a * 0x101),
+	  m_h(std::isnan(height) ? 0 : float(height)), m_t(entry.t * 0x101), m_nValid(std::isnan(height) ? 0 : ValidBit)
+{
+}
+
+inline PixelAttribute::Values PixelAttribute::unpack() const
 {
+	Values v;
+	v.n = n();
+	v.h = is_valid() ? m_h : std::numeric_limits<double>::quiet_NaN();
+	v.t = t();
+	v.a = fromFixed(m_a);
+	v.r = fromFixed(m_r);
+	v.g = fromFixed(m_g);
+	v.b = fromFixed(m_b);
+	if (v.n) {
+		v.h *= v.n;
+		v.t *= v.n;
+		v.a *= v.n;
+		v.r *= v.n;
+		v.g *= v.n;
+		v.b *= v.n;
+	}
+	return v;
 }
 
-inline PixelAttribute &PixelAttribute::operator=(const PixelAttribute &p)
+inline void PixelAttribute::pack(const Values &v)
 {
-	m_n = p.m_n;
-	m_h = p.m_h;
-	m_t = p.m_t;
-	m_a = p.m_a;
-	m_r = p.m_r;
-	m_g = p.m_g;
-	m_b = p.m_b;
-	return *this;
+	double scale = v.n > 1 ? 1 / v.n : 1;
+	m_nValid = v.n > MaxN ? MaxN : uint16_t(v.n);
+	if (std::isnan(v.h)) {
+		m_h = 0;
+	}
+	else {
+		m_nValid |= ValidBit;
+		m_h = float(v.h * scale);
+	}
+	m_t = toFixed(v.t * scale);
+	m_a = toFixed(v.a * scale);
+	m_r = toFixed(v.r * scale);
+	m_g = toFixed(v.g * scale);
+	m_b = toFixed(v.b * scale);
 }
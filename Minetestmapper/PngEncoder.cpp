@@ -0,0 +1,342 @@
+#include "PngEncoder.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <gd.h>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+
+namespace {
+
+const size_t GroupBytes = 1 << 18;		// Uncompressed bytes per group of rows (approximately)
+const size_t DictionarySize = 32768;		// The deflate window
+const int FilterTypes = 5;
+
+struct Group {
+	std::vector<unsigned char> data;	// Compressed
+	uLong adler;				// Adler-32 of the uncompressed data
+	size_t length;				// Uncompressed length
+};
+
+inline int paethPredictor(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = std::abs(p - a);
+	int pb = std::abs(p - b);
+	int pc = std::abs(p - c);
+	if (pa <= pb && pa <= pc)
+		return a;
+	return pb <= pc ? b : c;
+}
+
+// The value that filter Type subtracts from byte i of row (3 bytes per pixel)
+template<int Type>
+inline int predictor(const unsigned char *row, const unsigned char *prev, size_t i)
+{
+	int a = i >= 3 ? row[i - 3] : 0;
+	int b = prev[i];
+	switch (Type) {
+	case 1: return a;
+	case 2: return b;
+	case 3: return (a + b) / 2;
+	case 4: return paethPredictor(a, b, i >= 3 ? prev[i - 3] : 0);
+	default: return 0;
+	}
+}
+
+template<int Type>
+void filterRow(const unsigned char *row, const unsigned char *prev, size_t bytes, unsigned char *out)
+{
+	out[0] = Type;
+	for (size_t i = 0; i < bytes; i++)
+		out[i + 1] = static_cast<unsigned char>(row[i] - predictor<Type>(row, prev, i));
+}
+
+// The sum of the filtered bytes as signed values (the heuristic of libpng)
+template<int Type>
+uint64_t filterCost(const unsigned char *row, const unsigned char *prev, size_t bytes)
+{
+	uint64_t sum = 0;
+	for (size_t i = 0; i < bytes; i++)
+		sum += std::abs(static_cast<signed char>(row[i] - predictor<Type>(row, prev, i)));
+	return sum;
+}
+
+void filterRow(int type, const unsigned char *row, const unsigned char *prev, size_t bytes, unsigned char *out)
+{
+	switch (type) {
+	case 0: filterRow<0>(row, prev, bytes, out); break;
+	case 1: filterRow<1>(row, prev, bytes, out); break;
+	case 2: filterRow<2>(row, prev, bytes, out); break;
+	case 3: filterRow<3>(row, prev, bytes, out); break;
+	default: filterRow<4>(row, prev, bytes, out); break;
+	}
+}
+
+int adaptiveFilter(const unsigned char *row, const unsigned char *prev, size_t bytes)
+{
+	uint64_t costs[FilterTypes] = {
+		filterCost<0>(row, prev, bytes),
+		filterCost<1>(row, prev, bytes),
+		filterCost<2>(row, prev, bytes),
+		filterCost<3>(row, prev, bytes),
+		filterCost<4>(row, prev, bytes),
+	};
+	return static_cast<int>(std::min_element(costs, costs + FilterTypes) - costs);
+}
+
+// Like libgd, the alpha channel of the pixels is not saved
+void rgbRow(const int *pixels, int width, unsigned char *out)
+{
+	for (int x = 0; x < width; x++) {
+		*out++ = static_cast<unsigned char>(gdTrueColorGetRed(pixels[x]));
+		*out++ = static_cast<unsigned char>(gdTrueColorGetGreen(pixels[x]));
+		*out++ = static_cast<unsigned char>(gdTrueColorGetBlue(pixels[x]));
+	}
+}
+
+void putUint32(std::vector<unsigned char> &data, uint32_t value)
+{
+	data.insert(data.end(), {
+		static_cast<unsigned char>(value >> 24), static_cast<unsigned char>(value >> 16),
+		static_cast<unsigned char>(value >> 8), static_cast<unsigned char>(value) });
+}
+
+void writeChunk(FILE *file, const std::string &filename, const char *type, const std::vector<unsigned char> &data)
+{
+	std::vector<unsigned char> chunk;
+	chunk.reserve(data.size() + 12);
+	putUint32(chunk, static_cast<uint32_t>(data.size()));
+	chunk.insert(chunk.end(), type, type + 4);
+	chunk.insert(chunk.end(), data.begin(), data.end());
+	putUint32(chunk, static_cast<uint32_t>(crc32(0, chunk.data() + 4, static_cast<uInt>(data.size() + 4))));
+	if (fwrite(chunk.data(), 1, chunk.size(), file) != chunk.size())
+		throw std::runtime_error("Error writing '" + filename + "'");
+}
+
+} // namespace
+
+
+PngEncoder::PngEncoder(int level, Filter filter, int threads)
+	: m_level(level), m_filter(filter), m_threads(std::max(threads, 1))
+{
+}
+
+void PngEncoder::configure(png_structp png) const
+{
+	if (m_level >= 0)
+		png_set_compression_level(png, m_level);
+	int filters = PNG_ALL_FILTERS;
+	switch (m_filter) {
+	case Filter::None: filters = PNG_FILTER_NONE; break;
+	case Filter::Sub: filters = PNG_FILTER_SUB; break;
+	case Filter::Up: filters = PNG_FILTER_UP; break;
+	case Filter::Average: filters = PNG_FILTER_AVG; break;
+	case Filter::Paeth: filters = PNG_FILTER_PAETH; break;
+	case Filter::Adaptive: filters = PNG_ALL_FILTERS; break;
+	case Filter::Default: return;
+	}
+	png_set_filter(png, PNG_FILTER_TYPE_BASE, filters);
+}
+
+bool PngEncoder::parseFilter(const std::string &name, Filter &filter)
+{
+	static const struct {
+		const char *name;
+		Filter filter;
+	} filters[] = {
+		{ "none", Filter::None },
+		{ "sub", Filter::Sub },
+		{ "up", Filter::Up },
+		{ "average", Filter::Average },
+		{ "paeth", Filter::Paeth },
+		{ "adaptive", Filter::Adaptive },
+	};
+	for (const auto &f : filters) {
+		if (name == f.name) {
+			filter = f.filter;
+			return true;
+		}
+	}
+	return false;
+}
+
+void PngEncoder::write(FILE *file, const std::string &filename, const int *const *rows, int width, int height) const
+{
+	const size_t rowBytes = static_cast<size_t>(width) * 3;
+	const size_t filteredBytes = rowBytes + 1;
+	const int groupRows = static_cast<int>(std::max<size_t>(1, GroupBytes / filteredBytes));
+	const int groupCount = (height + groupRows - 1) / groupRows;
+	const int dictionaryRows = static_cast<int>((DictionarySize + filteredBytes - 1) / filteredBytes);
+	const int level = m_level >= 0 ? m_level : Z_DEFAULT_COMPRESSION;
+	const int fixedFilter = m_filter == Filter::None ? 0 : m_filter == Filter::Sub ? 1 : m_filter == Filter::Up ? 2
+		: m_filter == Filter::Average ? 3 : m_filter == Filter::Paeth ? 4 : -1;
+	// Like libpng
+	const int strategy = m_filter == Filter::None ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+
+	// Filter and compress a group of rows. The last rows of the previous
+	// group are filtered again, for the dictionary.
+	auto encodeGroup = [&](int index, Group &group) {
+		int yBegin = index * groupRows;
+		int yEnd = std::min(yBegin + groupRows, height);
+		int first = std::max(yBegin - dictionaryRows, 0);
+		std::vector<unsigned char> filtered(static_cast<size_t>(yEnd - first) * filteredBytes);
+		std::vector<unsigned char> row(rowBytes);
+		std::vector<unsigned char> prev(rowBytes, 0);
+		if (first > 0)
+			rgbRow(rows[first - 1], width, prev.data());
+		for (int y = first; y < yEnd; y++) {
+			rgbRow(rows[y], width, row.data());
+			int type = fixedFilter >= 0 ? fixedFilter : adaptiveFilter(row.data(), prev.data(), rowBytes);
+			filterRow(type, row.data(), prev.data(), rowBytes, filtered.data() + static_cast<size_t>(y - first) * filteredBytes);
+			std::swap(row, prev);
+		}
+		const unsigned char *data = filtered.data() + static_cast<size_t>(yBegin - first) * filteredBytes;
+		size_t dictionaryLength = std::min<size_t>(data - filtered.data(), DictionarySize);
+		group.length = filtered.data() + filtered.size() - data;
+		group.adler = adler32(adler32(0, nullptr, 0), data, static_cast<uInt>(group.length));
+
+		z_stream z{};
+		if (deflateInit2(&z, level, Z_DEFLATED, -15, 8, strategy) != Z_OK)
+			throw std::runtime_error("Failed to initialize the PNG compression");
+		if (dictionaryLength)
+			deflateSetDictionary(&z, data - dictionaryLength, static_cast<uInt>(dictionaryLength));
+		bool last = index == groupCount - 1;
+		group.data.resize(deflateBound(&z, static_cast<uLong>(group.length)) + 16);
+		z.next_in = const_cast<unsigned char *>(data);
+		z.avail_in = static_cast<uInt>(group.length);
+		z.next_out = group.data.data();
+		z.avail_out = static_cast<uInt>(group.data.size());
+		int result;
+		while ((result = deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH)) == Z_OK && (last || !z.avail_out)) {
+			// The output buffer is full
+			size_t used = group.data.size() - z.avail_out;
+			group.data.resize(group.data.size() * 2);
+			z.next_out = group.data.data() + used;
+			z.avail_out = static_cast<uInt>(group.data.size() - used);
+		}
+		group.data.resize(z.total_out);
+		deflateEnd(&z);
+		if (result != (last ? Z_STREAM_END : Z_OK))
+			throw std::runtime_error("Failed to compress the PNG image");
+	};
+
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	if (fwrite(signature, 1, sizeof(signature), file) != sizeof(signature))
+		throw std::runtime_error("Error writing '" + filename + "'");
+	std::vector<unsigned char> header;
+	putUint32(header, static_cast<uint32_t>(width));
+	putUint32(header, static_cast<uint32_t>(height));
+	header.insert(header.end(), { 8, 2, 0, 0, 0 });	// 8 bit RGB, deflate, adaptive filtering, no interlace
+	writeChunk(file, filename, "IHDR", header);
+
+	// The groups are written as IDAT chunks, in order
+	uLong adler = adler32(0, nullptr, 0);
+	auto writeGroup = [&](int index, Group &group) {
+		adler = adler32_combine(adler, group.adler, static_cast<z_off_t>(group.length));
+		if (index == 0) {
+			// zlib header: deflate, 32K window, compression level
+			int flevel = level == Z_DEFAULT_COMPRESSION || level == 6 ? 2 : level < 2 ? 0 : level < 6 ? 1 : 3;
+			unsigned cmf = 0x78;
+			unsigned flg = flevel << 6;
+			flg += 31 - (cmf * 256 + flg) % 31;
+			group.data.insert(group.data.begin(), { static_cast<unsigned char>(cmf), static_cast<unsigned char>(flg) });
+		}
+		if (index == groupCount - 1)
+			putUint32(group.data, static_cast<uint32_t>(adler));
+		writeChunk(file, filename, "IDAT", group.data);
+		group.data.clear();
+		group.data.shrink_to_fit();
+	};
+
+	if (m_threads <= 1) {
+		Group group;
+		for (int i = 0; i < groupCount; i++) {
+			encodeGroup(i, group);
+			writeGroup(i, group);
+		}
+	}
+	else {
+		// Groups are encoded by the threads, and written by this thread. At
+		// most a few groups are encoded ahead of the group that is written.
+		const int slots = 2 * m_threads;
+		std::vector<Group> groups(slots);
+		std::vector<int> groupIndex(slots, -1);	// The group that was encoded into a slot
+		std::mutex mutex;
+		std::condition_variable groupDone;
+		std::condition_variable slotFree;
+		std::atomic<int> nextGroup{ 0 };
+		int written = 0;
+		bool stop = false;
+		std::exception_ptr error;
+		std::vector<std::thread> workers;
+		for (int t = 0; t < m_threads; t++) {
+			workers.emplace_back([&]() {
+				try {
+					for (;;) {
+						int index = nextGroup++;
+						if (index >= groupCount)
+							return;
+						{
+							std::unique_lock<std::mutex> lock(mutex);
+							slotFree.wait(lock, [&]() { return stop || index < written + slots; });
+							if (stop)
+								return;
+						}
+						encodeGroup(index, groups[index % slots]);
+						std::lock_guard<std::mutex> lock(mutex);
+						groupIndex[index % slots] = index;
+						groupDone.notify_all();
+					}
+				}
+				catch (...) {
+					std::lock_guard<std::mutex> lock(mutex);
+					if (!error)
+						error = std::current_exception();
+					stop = true;
+					groupDone.notify_all();
+					slotFree.notify_all();
+				}
+			});
+		}
+		auto stopWorkers = [&]() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stop = true;
+				slotFree.notify_all();
+			}
+			for (std::thread &worker : workers)
+				worker.join();
+		};
+		try {
+			for (int i = 0; i < groupCount; i++) {
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					groupDone.wait(lock, [&]() { return error || groupIndex[i % slots] == i; });
+					if (error)
+						break;
+				}
+				writeGroup(i, groups[i % slots]);
+				std::lock_guard<std::mutex> lock(mutex);
+				written = i + 1;
+				slotFree.notify_all();
+			}
+		}
+		catch (...) {
+			stopWorkers();
+			throw;
+		}
+		stopWorkers();
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+	writeChunk(file, filename, "IEND", std::vector<unsigned char>());
+}
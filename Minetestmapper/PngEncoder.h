@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdio>
+#include <png.h>
+#include <string>
+
+// PNG compression settings, and an encoder which compresses the image using
+// multiple threads.
+//
+// The encoder divides the image into groups of rows, which are filtered and
+// deflated concurrently, each into a deflate stream that ends on a byte
+// boundary. The streams are concatenated into the single zlib stream of the
+// image, whose checksum is combined from those of the groups. Every group
+// uses the last 32 KiB of (filtered) data of the previous group as its
+// dictionary, so the compression is almost as good as when compressing the
+// image as a whole. The groups do not depend on the number of threads, so
+// neither does the file.
+class PngEncoder
+{
+public:
+	enum class Filter {
+		Default,		// Adaptive (like libpng)
+		None,
+		Sub,
+		Up,
+		Average,
+		Paeth,
+		Adaptive,		// The filter that gives the smallest sum of differences, for every row
+	};
+
+	PngEncoder() = default;
+	// level: zlib compression level (0 ... 9), or -1 for the default level
+	PngEncoder(int level, Filter filter, int threads);
+
+	int level() const { return m_level; }
+	Filter filter() const { return m_filter; }
+	int threads() const { return m_threads; }
+	// Whether the settings differ from the libpng / libgd defaults
+	bool customized() const { return m_level >= 0 || m_filter != Filter::Default; }
+	// Use the settings for an image that is written using libpng
+	void configure(png_structp png) const;
+	// Write an RGB PNG file of an image of libgd true color pixels
+	void write(FILE *file, const std::string &filename, const int *const *rows, int width, int height) const;
+	// Parse a filter name (none, sub, up, average, paeth or adaptive).
+	// Returns false if the name is not valid.
+	static bool parseFilter(const std::string &name, Filter &filter);
+
+private:
+	int m_level{ -1 };
+	Filter m_filter{ Filter::Default };
+	int m_threads{ 1 };
+};
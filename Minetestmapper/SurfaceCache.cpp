@@ -0,0 +1,328 @@
+#include "SurfaceCache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace {
+
+const char Magic[8] = { 'M', 'T', 'M', 'S', 'U', 'R', 'F', '\n' };
+const uint32_t Version = 1;
+const uint32_t ByteOrder = 0x01020304;
+
+inline void putUint16(std::vector<unsigned char> &data, unsigned value)
+{
+	data.push_back(static_cast<unsigned char>(value & 0xff));
+	data.push_back(static_cast<unsigned char>((value >> 8) & 0xff));
+}
+
+inline unsigned getUint16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+} // namespace
+
+
+void BlockSurface::clear()
+{
+	m_columns.fill(0);
+	m_nodes.clear();
+	m_colors.clear();
+	m_colorPointers.clear();
+	m_unknownNames.clear();
+	m_notDrawn = false;
+}
+
+// A block has at most 4096 different nodes, so the indexes of the colors
+// and of the unknown node names do not overlap.
+int BlockSurface::colorIndex(const ColorEntry *color)
+{
+	for (size_t i = 0; i < m_colorPointers.size(); i++)
+		if (m_colorPointers[i] == color)
+			return static_cast<int>(i);
+	m_colorPointers.push_back(color);
+	m_colors.push_back(*color);
+	return static_cast<int>(m_colors.size() - 1);
+}
+
+int BlockSurface::unknownIndex(const std::string &name)
+{
+	for (size_t i = 0; i < m_unknownNames.size(); i++)
+		if (m_unknownNames[i] == name)
+			return MaxIndex - static_cast<int>(i);
+	m_unknownNames.push_back(name);
+	return MaxIndex - static_cast<int>(m_unknownNames.size() - 1);
+}
+
+void BlockSurface::addNode(int column, int index, int y)
+{
+	m_columns[column]++;
+	m_nodes.push_back(static_cast<uint16_t>((index << 4) | y));
+}
+
+// Layout (16-bit values are little-endian):
+//	flags (1: not drawn)				16 bits
+//	node count, color count, unknown name count	3 x 16 bits
+//	column node counts and flags			256 x 8 bits
+//	colors (r, g, b, a, t, f)			color count x 6 x 8 bits
+//	unknown names (length, characters)		unknown name count x (8 bits + length x 8 bits)
+//	nodes ((index << 4) | y)			node count x 16 bits
+void BlockSurface::serialize(std::vector<unsigned char> &data) const
+{
+	data.clear();
+	putUint16(data, m_notDrawn ? 1 : 0);
+	putUint16(data, static_cast<unsigned>(m_nodes.size()));
+	putUint16(data, static_cast<unsigned>(m_colors.size()));
+	putUint16(data, static_cast<unsigned>(m_unknownNames.size()));
+	data.insert(data.end(), m_columns.begin(), m_columns.end());
+	for (const ColorEntry &c : m_colors)
+		data.insert(data.end(), { c.r, c.g, c.b, c.a, c.t, c.f });
+	for (const std::string &name : m_unknownNames) {
+		size_t length = std::min<size_t>(name.size(), 255);
+		data.push_back(static_cast<unsigned char>(length));
+		data.insert(data.end(), name.begin(), name.begin() + length);
+	}
+	for (uint16_t node : m_nodes)
+		putUint16(data, node);
+}
+
+bool BlockSurface::deserialize(const unsigned char *data, size_t size)
+{
+	clear();
+	const unsigned char *end = data + size;
+	if (size < 8 + 256)
+		return false;
+	m_notDrawn = (getUint16(data) & 1) != 0;
+	unsigned nodeCount = getUint16(data + 2);
+	unsigned colorCount = getUint16(data + 4);
+	unsigned nameCount = getUint16(data + 6);
+	data += 8;
+	unsigned columnNodes = 0;
+	for (int i = 0; i < 256; i++) {
+		m_columns[i] = data[i];
+		columnNodes += data[i] & CountMask;
+	}
+	data += 256;
+	if (columnNodes != nodeCount || colorCount + nameCount > MaxIndex + 1)
+		return false;
+	if (static_cast<size_t>(end - data) < colorCount * 6)
+		return false;
+	m_colors.resize(colorCount);
+	for (ColorEntry &c : m_colors) {
+		c = ColorEntry(data[0], data[1], data[2], data[3], data[4], data[5]);
+		data += 6;
+	}
+	m_unknownNames.resize(nameCount);
+	for (std::string &name : m_unknownNames) {
+		if (data >= end || end - data - 1 < *data)
+			return false;
+		name.assign(reinterpret_cast<const char *>(data + 1), *data);
+		data += 1 + *data;
+	}
+	if (static_cast<size_t>(end - data) != nodeCount * 2)
+		return false;
+	m_nodes.resize(nodeCount);
+	for (uint16_t &node : m_nodes) {
+		node = static_cast<uint16_t>(getUint16(data));
+		unsigned index = node >> 4;
+		if (index >= colorCount && index <= unsigned(MaxIndex) - nameCount)
+			return false;
+		data += 2;
+	}
+	return true;
+}
+
+
+SurfaceCache::SurfaceCache(const std::string &filename, uint64_t settingsHash)
+	: m_filename(filename), m_settingsHash(settingsHash)
+{
+	open();
+}
+
+SurfaceCache::~SurfaceCache()
+{
+	close();
+}
+
+// Blocks are sorted by x, y, z. Block coordinates fit in 21 bits.
+uint64_t SurfaceCache::positionKey(const BlockPos &pos)
+{
+	return (uint64_t(uint32_t(pos.x() + 0x100000) & 0x1fffff) << 42)
+		| (uint64_t(uint32_t(pos.y() + 0x100000) & 0x1fffff) << 21)
+		| (uint32_t(pos.z() + 0x100000) & 0x1fffff);
+}
+
+// A missing, damaged or outdated file is not an error: it is not used, and
+// it is replaced by save().
+void SurfaceCache::open()
+{
+#ifdef _WIN32
+	std::ifstream file(m_filename, std::ios::binary);
+	if (!file)
+		return;
+	m_buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	m_data = m_buffer.data();
+	m_size = m_buffer.size();
+#else
+	int fd = ::open(m_filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		return;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		void *map = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			m_data = static_cast<const unsigned char *>(map);
+			m_size = static_cast<size_t>(st.st_size);
+		}
+	}
+	::close(fd);
+#endif
+	if (!m_data)
+		return;
+
+	Header header;
+	if (m_size < sizeof(header)) {
+		close();
+		return;
+	}
+	memcpy(&header, m_data, sizeof(header));
+	if (memcmp(header.magic, Magic, sizeof(Magic)) != 0
+		|| header.version != Version
+		|| header.byteOrder != ByteOrder
+		|| header.settingsHash != m_settingsHash
+		|| header.recordCount > (m_size - sizeof(header)) / sizeof(IndexEntry)) {
+		close();
+		return;
+	}
+	// The index directly follows the header, and is aligned
+	m_index = reinterpret_cast<const IndexEntry *>(m_data + sizeof(header));
+	m_recordCount = static_cast<size_t>(header.recordCount);
+}
+
+void SurfaceCache::close()
+{
+#ifndef _WIN32
+	if (m_data)
+		munmap(const_cast<unsigned char *>(m_data), m_size);
+#endif
+	m_buffer.clear();
+	m_buffer.shrink_to_fit();
+	m_data = nullptr;
+	m_size = 0;
+	m_index = nullptr;
+	m_recordCount = 0;
+}
+
+const SurfaceCache::IndexEntry *SurfaceCache::findRecord(uint64_t key, uint64_t hash) const
+{
+	if (!m_index)
+		return nullptr;
+	const IndexEntry *end = m_index + m_recordCount;
+	const IndexEntry *entry = std::lower_bound(m_index, end, key,
+		[](const IndexEntry &e, uint64_t k) { return e.key < k; });
+	if (entry == end || entry->key != key || entry->hash != hash)
+		return nullptr;
+	if (entry->offset > m_size || entry->size > m_size - entry->offset)
+		return nullptr;
+	return entry;
+}
+
+bool SurfaceCache::find(const BlockPos &pos, uint64_t hash, BlockSurface &surface)
+{
+	const IndexEntry *entry = findRecord(positionKey(pos), hash);
+	if (entry && surface.deserialize(m_data + entry->offset, static_cast<size_t>(entry->size))) {
+		m_hits++;
+		return true;
+	}
+	m_misses++;
+	return false;
+}
+
+void SurfaceCache::add(const BlockPos &pos, uint64_t hash, const BlockSurface &surface)
+{
+	Record record;
+	record.hash = hash;
+	surface.serialize(record.data);
+	std::lock_guard<std::mutex> lock(m_addedMutex);
+	m_added[positionKey(pos)] = std::move(record);
+}
+
+void SurfaceCache::save()
+{
+	if (m_added.empty())
+		return;
+
+	// Merge the index of the file with the added surfaces
+	std::vector<IndexEntry> index;
+	index.reserve(m_recordCount + m_added.size());
+	auto added = m_added.begin();
+	uint64_t offset = sizeof(Header);
+	auto addEntry = [&](uint64_t key, uint64_t hash, uint64_t size) {
+		index.push_back({ key, hash, offset, size });
+		offset += size;
+	};
+	for (size_t i = 0; i < m_recordCount; i++) {
+		const IndexEntry &entry = m_index[i];
+		for (; added != m_added.end() && added->first < entry.key; ++added)
+			addEntry(added->first, added->second.hash, added->second.data.size());
+		if (added != m_added.end() && added->first == entry.key)
+			continue;
+		if (entry.offset > m_size || entry.size > m_size - entry.offset)
+			continue;
+		addEntry(entry.key, entry.hash, entry.size);
+	}
+	for (; added != m_added.end(); ++added)
+		addEntry(added->first, added->second.hash, added->second.data.size());
+	uint64_t dataOffset = sizeof(Header) + index.size() * sizeof(IndexEntry);
+	for (IndexEntry &entry : index)
+		entry.offset += dataOffset - sizeof(Header);
+
+	fs::path path(m_filename);
+	fs::path temporary(m_filename + ".tmp");
+	std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+	if (!file)
+		throw std::runtime_error("Error opening '" + temporary.string() + "' for writing");
+	Header header;
+	memcpy(header.magic, Magic, sizeof(Magic));
+	header.version = Version;
+	header.byteOrder = ByteOrder;
+	header.settingsHash = m_settingsHash;
+	header.recordCount = index.size();
+	file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char *>(index.data()), index.size() * sizeof(IndexEntry));
+	for (const IndexEntry &entry : index) {
+		auto record = m_added.find(entry.key);
+		if (record != m_added.end()) {
+			file.write(reinterpret_cast<const char *>(record->second.data.data()), record->second.data.size());
+		}
+		else {
+			const IndexEntry *old = findRecord(entry.key, entry.hash);
+			file.write(reinterpret_cast<const char *>(m_data + old->offset), old->size);
+		}
+	}
+	file.close();
+	if (!file)
+		throw std::runtime_error("Error writing '" + temporary.string() + "'");
+
+	close();
+	std::error_code ec;
+	fs::rename(temporary, path, ec);
+	if (ec)
+		throw std::runtime_error("Error writing '" + path.string() + "': " + ec.message());
+	m_added.clear();
+}
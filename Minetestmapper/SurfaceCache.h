@@ -0,0 +1,130 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "BlockPos.h"
+#include "Color.h"
+
+// The surface of a map block: for every column (x,z) of the block, the nodes
+// that are drawn, from the top down, up to and including the first node that
+// hides the nodes below it. This is all that rendering the block needs.
+//
+// Nodes refer to an entry of the block's color table, which is numbered from
+// 0 up, or to the name of a node that has no color (an unknown node), which
+// are numbered from MaxIndex down.
+class BlockSurface
+{
+public:
+	static constexpr int Complete = 0x80;	// Column flag: the nodes below the last node are hidden
+	static constexpr int CountMask = 0x1f;
+	static constexpr int MaxIndex = 0x0fff;
+
+	void clear();
+	// Index of a color or of an unknown node name; added if necessary
+	int colorIndex(const ColorEntry *color);
+	int unknownIndex(const std::string &name);
+	// Add a node to a column (z * 16 + x). The nodes of a column must be added from the top down.
+	void addNode(int column, int index, int y);
+	void setComplete(int column) { m_columns[column] |= Complete; }
+	// The block is not drawn at all (e.g. it contains only air)
+	void setNotDrawn() { m_notDrawn = true; }
+
+	int nodeCount(int column) const { return m_columns[column] & CountMask; }
+	bool complete(int column) const { return (m_columns[column] & Complete) != 0; }
+	// The nodes of all columns, in column order
+	int nodeIndex(int node) const { return m_nodes[node] >> 4; }
+	int nodeY(int node) const { return m_nodes[node] & 0x0f; }
+	bool isUnknown(int index) const { return index >= static_cast<int>(m_colors.size()); }
+	const ColorEntry &color(int index) const { return m_colors[index]; }
+	const std::string &unknownName(int index) const { return m_unknownNames[MaxIndex - index]; }
+	bool empty() const { return m_nodes.empty(); }
+	bool notDrawn() const { return m_notDrawn; }
+
+	void serialize(std::vector<unsigned char> &data) const;
+	// Returns false if the data is not a valid surface
+	bool deserialize(const unsigned char *data, size_t size);
+
+private:
+	std::array<uint8_t, 256> m_columns{};		// Node count and flags
+	std::vector<uint16_t> m_nodes;			// (index << 4) | y
+	std::vector<ColorEntry> m_colors;
+	std::vector<const ColorEntry *> m_colorPointers;	// While adding nodes
+	std::vector<std::string> m_unknownNames;
+	bool m_notDrawn{ false };
+};
+
+// A file of block surfaces, keyed by block position and a hash of the block
+// data (and of anything else the surface depends on).
+//
+// The file consists of a header, an index sorted by block position, and the
+// serialized surfaces. It is memory-mapped, and only the surfaces that are
+// used are read. Surfaces that were computed during this run are kept in
+// memory until the file is rewritten by save(). The file is not used if it
+// was made using different settings (see the constructor).
+//
+// find() and add() may be used by multiple threads concurrently.
+class SurfaceCache
+{
+public:
+	// settingsHash: hash of the settings that affect the surfaces of all blocks
+	// (the node colors, the render mode, ...)
+	SurfaceCache(const std::string &filename, uint64_t settingsHash);
+	~SurfaceCache();
+
+	// Whether the surface of the block is in the cache file. Does not change
+	// the cache, so may be used by other threads until save() is called.
+	bool contains(const BlockPos &pos, uint64_t hash) const { return findRecord(positionKey(pos), hash) != nullptr; }
+	// Read the surface of the block from the cache file
+	bool find(const BlockPos &pos, uint64_t hash, BlockSurface &surface);
+	void add(const BlockPos &pos, uint64_t hash, const BlockSurface &surface);
+	// Write the cache file: the surfaces that were added, and those of the
+	// previous file that were not replaced.
+	void save();
+
+	size_t previousCount() const { return m_recordCount; }
+	long long hits() const { return m_hits; }
+	long long misses() const { return m_misses; }
+
+private:
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t byteOrder;
+		uint64_t settingsHash;
+		uint64_t recordCount;
+	};
+	struct IndexEntry {
+		uint64_t key;
+		uint64_t hash;
+		uint64_t offset;
+		uint64_t size;
+	};
+	struct Record {
+		uint64_t hash;
+		std::vector<unsigned char> data;
+	};
+
+	std::string m_filename;
+	uint64_t m_settingsHash;
+	const unsigned char *m_data = nullptr;	// The mapped file
+	size_t m_size = 0;
+	std::vector<unsigned char> m_buffer;	// The file, if it can not be mapped
+	const IndexEntry *m_index = nullptr;
+	size_t m_recordCount = 0;
+	std::map<uint64_t, Record> m_added;
+	std::mutex m_addedMutex;
+	std::atomic<long long> m_hits{ 0 };
+	std::atomic<long long> m_misses{ 0 };
+
+	static uint64_t positionKey(const BlockPos &pos);
+	void open();
+	void close();
+	const IndexEntry *findRecord(uint64_t key, uint64_t hash) const;
+};
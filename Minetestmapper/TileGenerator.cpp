@@ -6,26 +6,37 @@
  *        Company:  LinuxOS.sk
  * =====================================================================
  */
+#include <atomic>
 #include <cerrno>
+#include <chrono>
 #include <climits>
 #include <cstdio>
 #include <cstdlib>
+#include <condition_variable>
 #include <cstring>
+#include <exception>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <stdexcept>
+#include <thread>
 #include <utility>
 
 
 #include "config.h"
 #include "DataFileParser.h"
+#include "MapBlockPipeline.h"
+#include "NodeNameTable.h"
 #include "PaintEngine_libgd.h"
+#include "PaintEngine_libgdStream.h"
+#include "PaintEngine_libgdTiles.h"
 #include "PlayerAttributes.h"
 #include "Settings.h"
 #include "TileGenerator.h"
 #include "ZlibDecompressor.h"
+#include "util.h"
 #ifdef USE_SQLITE3
 #include "db-sqlite3.h"
 #endif
@@ -224,6 +235,13 @@ void TileGenerator::setDrawAlpha(bool drawAlpha)
     m_drawAlpha = drawAlpha;
 }
 
+void TileGenerator::setAlphaMixMode(PixelAttribute::AlphaMixingMode mode)
+{
+	if (mode == PixelAttribute::AlphaMixDarkenBit)
+		mode = PixelAttribute::AlphaMixCumulativeDarken;
+	m_alphaMixMode = mode;
+}
+
 void TileGenerator::setDrawAir(bool drawAir)
 {
 	m_drawAir = drawAir;
@@ -335,6 +353,45 @@ void TileGenerator::setChunkSize(int size)
 	m_chunkSize = size;
 }
 
+void TileGenerator::setThreads(int threads)
+{
+	m_threads = threads;
+}
+
+void TileGenerator::setParallelStrips(bool enable)
+{
+	m_parallelStrips = enable;
+}
+
+void TileGenerator::setStreamOutput(bool enable)
+{
+	m_streamOutput = enable;
+}
+
+void TileGenerator::setPngCompression(int level, PngEncoder::Filter filter)
+{
+	m_pngLevel = level;
+	m_pngFilter = filter;
+}
+
+void TileGenerator::setTiledOutput(int tileSize, int zoomLevels)
+{
+	m_tiledOutputSize = tileSize;
+	m_tiledOutputLevels = zoomLevels;
+}
+
+// settings: the options which affect the map (the command line)
+void TileGenerator::setIncremental(const std::string &settings)
+{
+	m_incremental = true;
+	m_incrementalSettings = settings;
+}
+
+void TileGenerator::setSurfaceCache(const std::string &file)
+{
+	m_surfaceCacheFile = file;
+}
+
 void TileGenerator::sanitizeParameters()
 {
 	if (m_scaleFactor > 1) {
@@ -371,6 +428,11 @@ void TileGenerator::sanitizeParameters()
 	}
 }
 
+void TileGenerator::addExtraOutput(TileGenerator *generator, const std::string &output)
+{
+	m_extraOutputs.push_back({ generator, output, nullptr });
+}
+
 void TileGenerator::generate(const std::string &input, const std::string &output)
 {
 	string input_path = input;
@@ -378,6 +440,10 @@ void TileGenerator::generate(const std::string &input, const std::string &output
 		input_path += PATH_SEPARATOR;
 	}
 
+	if (m_incremental && !m_tiledOutputSize)
+		throw std::runtime_error("--incremental requires --tiled-output");
+	if (!m_extraOutputs.empty() && (m_incremental || !m_surfaceCacheFile.empty()))
+		throw std::runtime_error("--extra-output can not be combined with --incremental or --surface-cache");
 	openDb(input_path);
 	sanitizeParameters();
 	loadBlocks();
@@ -385,31 +451,94 @@ void TileGenerator::generate(const std::string &input, const std::string &output
 		std::cout << "World is empty: no map generated" << std::endl;
 		return;
 	}
-	computeMapParameters(input);
-	createImage();
+	// The extra outputs are rendered from the blocks that are read for this map
+	std::vector<std::pair<TileGenerator *, const std::string *>> outputs;
+	outputs.emplace_back(this, &output);
+	for (ExtraOutput &extra : m_extraOutputs) {
+		extra.generator->sanitizeParameters();
+		extra.generator->shareBlocks(*this);
+		outputs.emplace_back(extra.generator, &extra.output);
+	}
+	for (auto &out : outputs) {
+		TileGenerator *generator = out.first;
+		generator->computeMapParameters(input);
+		generator->computeHeightMapColorTable();
+		generator->createImage(*out.second);
+		if (generator->paintEngine->isStreaming()) {
+			// The map rows are written out while they are rendered, so anything
+			// that is drawn over the map must be drawn first. The height scale
+			// depends on the map, but is below it.
+			generator->paintEngine->beginOverlay();
+			generator->renderOverlays(input_path, false);
+		}
+	}
+	if (m_tilesEngine && m_incremental)
+		selectChangedBlocks();
 	renderMap();
+	for (auto &out : outputs) {
+		TileGenerator *generator = out.first;
+		if (!generator->paintEngine->isStreaming())
+			generator->renderOverlays(input_path, true);
+		else if (generator->m_heightMap && (generator->m_drawScale & DRAWHEIGHTSCALE_MASK))
+			generator->renderHeightScale();
+	}
+	closeDb();
+	if (progressIndicator)
+	    cout << "Writing image...\r" << std::flush;
+	auto writeBegin = std::chrono::steady_clock::now();
+	for (auto &out : outputs)
+		out.first->writeImage(*out.second);
+	m_writeImageTime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - writeBegin).count();
+	if (progressIndicator)
+	    cout << std::setw(20) << " " <<  "\r" << std::flush;
+	for (auto &out : outputs)
+		out.first->printUnknown();
+}
+
+// Use the map area and the blocks of another generator, which loaded them
+void TileGenerator::shareBlocks(const TileGenerator &source)
+{
+	if (m_blockGeometry) {
+		m_mapXStartNodeOffset = 0;
+		m_mapXEndNodeOffset = 0;
+		m_mapYStartNodeOffset = 0;
+		m_mapYEndNodeOffset = 0;
+	}
+	m_xMin = source.m_xMin;
+	m_xMax = source.m_xMax;
+	m_yMin = source.m_yMin;
+	m_yMax = source.m_yMax;
+	m_zMin = source.m_zMin;
+	m_zMax = source.m_zMax;
+	if (m_shrinkGeometry) {
+		if (m_xMin != m_reqXMin) m_mapXStartNodeOffset = 0;
+		if (m_xMax != m_reqXMax) m_mapXEndNodeOffset = 0;
+		if (m_zMin != m_reqZMin) m_mapYEndNodeOffset = 0;
+		if (m_zMax != m_reqZMax) m_mapYStartNodeOffset = 0;
+	}
+	m_worldBlocks = source.m_worldBlocks;
+	progressIndicator = false;
+}
+
+// Draw the scales, the origin, the players and the other objects.
+// heightScale: also draw the height scale
+void TileGenerator::renderOverlays(const std::string &inputPath, bool heightScale)
+{
 	if ((m_drawScale & DRAWSCALE_MASK)) {
 		renderScale();
 	}
-	if (m_heightMap && (m_drawScale & DRAWHEIGHTSCALE_MASK)) {
+	if (heightScale && m_heightMap && (m_drawScale & DRAWHEIGHTSCALE_MASK)) {
 		renderHeightScale();
 	}
 	if (m_drawOrigin) {
 		renderOrigin();
 	}
 	if (m_drawPlayers) {
-		renderPlayers(input_path);
+		renderPlayers(inputPath);
 	}
 	if (!m_drawObjects.empty()) {
 		renderDrawObjects();
 	}
-	closeDb();
-	if (progressIndicator)
-	    cout << "Writing image...\r" << std::flush;
-	writeImage(output);
-	if (progressIndicator)
-	    cout << std::setw(20) << " " <<  "\r" << std::flush;
-	printUnknown();
 }
 
 std::string TileGenerator::getWorldDatabaseBackend(const std::string &input)
@@ -472,7 +601,7 @@ void TileGenerator::openDb(const std::string &input)
 #ifdef USE_SQLITE3
 		DBSQLite3 *db;
 		m_db = db = new DBSQLite3(input);
-		m_scanEntireWorld = true;
+		db->setConnections(m_threads);
 #else
 		unsupported = true;
 #endif
@@ -643,6 +772,10 @@ void TileGenerator::loadBlocks()
 			std::cerr << "WARNING: geometrymode 'shrink' not supported with '--disable-blocklist-prefetch'" << std::endl;
 			m_shrinkGeometry = false;
 		}
+		if (m_threads > 1) {
+			std::cerr << "WARNING: '--threads' not supported with '--disable-blocklist-prefetch' - using a single thread" << std::endl;
+			m_threads = 1;
+		}
 		m_xMin = m_reqXMin;
 		m_xMax = m_reqXMax;
 		m_yMin = m_reqYMin;
@@ -958,39 +1091,10 @@ void TileGenerator::loadBlocks()
 }
 
 void TileGenerator::scalePixelRows(PixelAttributes &pixelAttributes, PixelAttributes &pixelAttributesScaled, int zPosLimit) {
-	int y;
-	for (y = pixelAttributes.getNextY(); y <= pixelAttributes.getLastY() && y < worldBlockZ2StoredY(m_zMin - 1) + m_mapYEndNodeOffset; y++) {
-		for (int x = m_mapXStartNodeOffset; x < worldBlockX2StoredX(m_xMax + 1) + m_mapXEndNodeOffset; x++) {
-			#define pixel pixelAttributes.attribute(y, x)
-			//PixelAttribute &pixel = pixelAttributes.attribute(y, x);
-			if (pixel.nextEmpty) {
-				pixelAttributesScaled.attribute(y / m_scaleFactor, x/m_scaleFactor).nextEmpty = true;
-				x += 15;
-				continue;
-			}
-#ifdef DEBUG
-			int mapX = x - m_mapXStartNodeOffset;
-			int mapY = y - m_mapYStartNodeOffset;
-			{ int ix = mapX2ImageX(mapX / m_scaleFactor); assert(ix - borderLeft() >= 0 && ix - borderLeft() - borderRight() < m_pictWidth); }
-			{ int iy = mapY2ImageY(mapY / m_scaleFactor); assert(iy - borderTop() >= 0 && iy - borderTop() - borderBottom() < m_pictHeight); }
-#endif
-			if (pixel.is_valid() || pixel.color().to_uint())
-				pixelAttributesScaled.attribute(y / m_scaleFactor, x / m_scaleFactor).add(pixel);
-			#undef pixel
-		}
-	}
-	for (y = pixelAttributesScaled.getNextY(); y <= pixelAttributesScaled.getLastY(); y++) {
-		for (int x = m_mapXStartNodeOffset / m_scaleFactor; x < (worldBlockX2StoredX(m_xMax + 1) + m_mapXEndNodeOffset) / m_scaleFactor; x++) {
-			#define pixel pixelAttributesScaled.attribute(y, x)
-			if (pixel.nextEmpty) {
-				x += 16 / m_scaleFactor - 1;
-				continue;
-			}
-			if (pixel.is_valid() || pixel.color().to_uint())
-				pixel.normalize();
-			#undef pixel
-		}
-	}
+	int yEnd = min(pixelAttributes.getLastY() + 1, worldBlockZ2StoredY(m_zMin - 1) + m_mapYEndNodeOffset);
+	pixelAttributes.scaleLines(pixelAttributesScaled, pixelAttributes.getNextY(), yEnd,
+		m_mapXStartNodeOffset, worldBlockX2StoredX(m_xMax + 1) + m_mapXEndNodeOffset);
+	int y = max(pixelAttributesScaled.getNextY(), pixelAttributesScaled.getLastY() + 1);
 	int yLimit = worldBlockZ2StoredY(zPosLimit);
 	if (y <= yLimit) {
 		pixelAttributes.scroll(yLimit);
@@ -1002,26 +1106,52 @@ void TileGenerator::pushPixelRows(PixelAttributes &pixelAttributes, int zPosLimi
 		// Make shading less pronounced when map is scaled down
 		// (the formula for the emphasis parameter was determined (tuned) experimentally...)
 		pixelAttributes.renderShading(m_scaleFactor < 3 ? 1 : 1 / sqrt(m_scaleFactor), m_drawAlpha);
+	int xBegin = m_mapXStartNodeOffset / m_scaleFactor;
+	int xEnd = (worldBlockX2StoredX(m_xMax + 1) + m_mapXEndNodeOffset) / m_scaleFactor;
 	int y;
 	for (y = pixelAttributes.getNextY(); y <= pixelAttributes.getLastY() && y < (worldBlockZ2StoredY(m_zMin - 1) + m_mapYEndNodeOffset) / m_scaleFactor; y++) {
-		for (int x = m_mapXStartNodeOffset / m_scaleFactor; x < (worldBlockX2StoredX(m_xMax + 1) + m_mapXEndNodeOffset) / m_scaleFactor; x++) {
-			int mapX = x - m_mapXStartNodeOffset / m_scaleFactor;
-			int mapY = y - m_mapYStartNodeOffset / m_scaleFactor;
-			#define pixel pixelAttributes.attribute(y, x)
-			//PixelAttribute &pixel = pixelAttributes.attribute(y, x);
-			if (pixel.nextEmpty) {
+		const PixelAttribute *line = pixelAttributes.line(y);
+		if (!line)
+			continue;
+		int mapY = y - m_mapYStartNodeOffset / m_scaleFactor;
+		int imageY = mapY2ImageY(mapY);
+#ifdef DEBUG
+		assert(imageY - borderTop() >= 0 && imageY - borderTop() - borderBottom() < m_pictHeight);
+#endif
+		// Consecutive pixels are written as one span. Tile borders, and
+		// pixels that are not drawn, end a span.
+		int spanX = 0;
+		int spanLength = 0;
+		auto writeSpan = [&]() {
+			if (spanLength)
+				paintEngine->writeSpan(spanX, imageY, m_spanColors.data(), spanLength);
+			spanLength = 0;
+		};
+		for (int x = xBegin; x < xEnd; x++) {
+			if (pixelAttributes.nextEmpty(y, x)) {
+				writeSpan();
 				x += 16 / m_scaleFactor - 1;
 				continue;
 			}
+			const PixelAttribute &pixel = line[x];
+			Color color = pixel.color();
+			if (!pixel.is_valid() && !color.to_uint()) {
+				writeSpan();
+				continue;
+			}
+			int imageX = m_imageColumns[x - xBegin];
 #ifdef DEBUG
-			{ int ix = mapX2ImageX(mapX); assert(ix - borderLeft() >= 0 && ix - borderLeft() - borderRight() < m_pictWidth); }
-			{ int iy = mapY2ImageY(mapY); assert(iy - borderTop() >= 0 && iy - borderTop() - borderBottom() < m_pictHeight); }
+			assert(imageX - borderLeft() >= 0 && imageX - borderLeft() - borderRight() < m_pictWidth);
 #endif
-			if (pixel.is_valid() || pixel.color().to_uint())
-				paintEngine->drawPixel(mapX2ImageX(mapX), mapY2ImageY(mapY), pixel.color());
-			#undef pixel
+			if (imageX != spanX + spanLength)
+				writeSpan();
+			if (!spanLength)
+				spanX = imageX;
+			m_spanColors[spanLength++] = color;
 		}
+		writeSpan();
 	}
+	paintEngine->rowsComplete(mapY2ImageY(y - m_mapYStartNodeOffset / m_scaleFactor));
 	int yLimit = worldBlockZ2StoredY(zPosLimit) / m_scaleFactor;
 	if (y <= yLimit) {
 		pixelAttributes.scroll(yLimit);
@@ -1203,12 +1333,24 @@ void TileGenerator::computeMapParameters(const std::string &input)
 }
 
 
-void TileGenerator::createImage()
+void TileGenerator::createImage(const std::string &output)
 {
 	int totalPictHeight = m_pictHeight + borderTop() + borderBottom();
 	int totalPictWidth = m_pictWidth + borderLeft() + borderRight();
 
-	paintEngine = new PaintEngine_libgd();
+	PaintEngine_libgd *engine;
+	if (m_tiledOutputSize) {
+		m_tilesEngine = new PaintEngine_libgdTiles(output, m_tiledOutputSize, m_tiledOutputLevels, m_threads);
+		engine = m_tilesEngine;
+	}
+	else if (m_streamOutput)
+		engine = new PaintEngine_libgdStream(output);
+	else
+		engine = new PaintEngine_libgd();
+	// The tiles are already encoded concurrently, and the streaming engine
+	// encodes the rows while they are rendered.
+	engine->setPngEncoder(PngEncoder(m_pngLevel, m_pngFilter, m_tiledOutputSize || m_streamOutput ? 1 : m_threads));
+	paintEngine = engine;
 
 	paintEngine->checkImageSize(totalPictWidth, totalPictHeight, std::cerr);
 	if (!paintEngine->create(totalPictWidth, totalPictHeight)) {
@@ -1240,57 +1382,91 @@ void TileGenerator::createImage()
 			paintEngine->drawFilledRect(borderLeft(), yPos + borderTop(), m_pictWidth + borderLeft() - 1, yPos + (m_tileBorderSize - 1) + borderTop(), m_tileBorderColor);
 		}
 	}
+
+	// Map the columns of the map to image columns once, for pushPixelRows()
+	int mapColumns = (worldBlockX2StoredX(m_xMax + 1) + m_mapXEndNodeOffset) / m_scaleFactor - m_mapXStartNodeOffset / m_scaleFactor;
+	m_imageColumns.resize(max(mapColumns, 0));
+	for (int mapX = 0; mapX < mapColumns; mapX++)
+		m_imageColumns[mapX] = mapX2ImageX(mapX);
+	m_spanColors.resize(m_imageColumns.size());
 }
 
-void TileGenerator::processMapBlock(const DB::Block &mapBlock)
+void TileGenerator::processMapBlock(RenderState &state, const DB::Block &mapBlock)
+{
+	if (mapNodeColors(state, mapBlock))
+		renderMapBlock(state, mapBlock);
+}
+
+// Look up the colors of the nodes of the block. Returns false if there is
+// nothing to draw.
+bool TileGenerator::mapNodeColors(RenderState &state, const MapBlock &mapBlock)
 {
 	if ((!m_drawAir && mapBlock.onlyAir())
 		|| (!m_drawIgnore && mapBlock.onlyIgnore())) {
 		// Nothing to draw :-)
-		return;
+		return false;
+	}
+
+	state.nodeMask.reset();
+	for (const MapBlock::NodeMapping &mapping : mapBlock.getMappings()) {
+		if (mapping.nameId >= static_cast<int>(state.nameIdColor.size()))
+			resolveNodeColors(state);
+		const ColorEntry *color = state.nameIdColor[mapping.nameId];
+		state.nodeIDColor[mapping.nodeId] = color;
+		state.nodeIDNameId[mapping.nodeId] = mapping.nameId;
+		state.nodeIDSurfaceIndex[mapping.nodeId] = -1;
+		// Opaque: the render loop stops at the node
+		bool opaque = color && color != NodeColorNotDrawn
+			&& (!m_heightMap && m_drawAlpha ? color->a == 0xff : color->a != 0);
+		state.nodeMask.set(mapping.nodeId, color != NodeColorNotDrawn, opaque);
 	}
+	return true;
+}
+
+// Look up the colors of the node names that were added to the NodeNameTable
+// since the last time.
+void TileGenerator::resolveNodeColors(RenderState &state) const
+{
+	NodeNameTable &nameTable = NodeNameTable::instance();
+	size_t size = nameTable.size();
+	for (size_t nameId = state.nameIdColor.size(); nameId < size; nameId++)
+		state.nameIdColor.push_back(resolveNodeColor(nameTable.name(static_cast<int>(nameId))));
+	state.nameIdUnknown.resize(size);
+}
 
-	for (const auto &entry : mapBlock.getMappings()) {
-		const string &name = entry.second;
-		const int nodeId = entry.first;
-		// In case of a height map, it stores just dummy colors... 
-		NodeColorMap::const_iterator color = m_nodeColors.find(name);
-		if (name == "air" && !(m_drawAir && color != m_nodeColors.end())) {
-			m_nodeIDColor[nodeId] = NodeColorNotDrawn;
+const ColorEntry *TileGenerator::resolveNodeColor(const std::string &name) const
+{
+	// In case of a height map, it stores just dummy colors...
+	NodeColorMap::const_iterator color = m_nodeColors.find(name);
+	if (name == "air" && !(m_drawAir && color != m_nodeColors.end())) {
+		return NodeColorNotDrawn;
+	}
+	else if (name == "ignore" && !(m_drawIgnore && color != m_nodeColors.end())) {
+		return NodeColorNotDrawn;
+	}
+	else if (color != m_nodeColors.end()) {
+		// If the color is marked 'ignore', then treat it accordingly.
+		// Colors marked 'ignore' take precedence over 'air'
+		if ((color->second.f & ColorEntry::FlagIgnore)) {
+			if (m_drawIgnore)
+				return &color->second;
+			else
+				return NodeColorNotDrawn;
 		}
-		else if (name == "ignore" && !(m_drawIgnore && color != m_nodeColors.end())) {
-			m_nodeIDColor[nodeId] = NodeColorNotDrawn;
+		// If the color is marked 'air', then treat it accordingly.
+		else if ((color->second.f & ColorEntry::FlagAir)) {
+			if (m_drawAir)
+				return &color->second;
+			else
+				return NodeColorNotDrawn;
 		}
+		// Regular node.
 		else {
-			if (color != m_nodeColors.end()) {
-				// If the color is marked 'ignore', then treat it accordingly. 
-				// Colors marked 'ignore' take precedence over 'air' 
-				if ((color->second.f & ColorEntry::FlagIgnore)) {
-					if (m_drawIgnore)
-						m_nodeIDColor[nodeId] = &color->second;
-					else
-						m_nodeIDColor[nodeId] = NodeColorNotDrawn;
-				}
-				// If the color is marked 'air', then treat it accordingly. 
-				else if ((color->second.f & ColorEntry::FlagAir)) {
-					if (m_drawAir)
-						m_nodeIDColor[nodeId] = &color->second;
-					else
-						m_nodeIDColor[nodeId] = NodeColorNotDrawn;
-				}
-				// Regular node. 
-				else {
-					m_nodeIDColor[nodeId] = &color->second;
-				}
-			}
-			else {
-				m_nameMap[nodeId] = name;
-				m_nodeIDColor[nodeId] = nullptr;
-			}
+			return &color->second;
 		}
 	}
-
-	renderMapBlock(mapBlock);
+	// Unknown node
+	return nullptr;
 }
 
 class MapBlockIterator
@@ -1338,118 +1514,311 @@ private:
 };
 
 
-void TileGenerator::renderMap()
+// Incremental tiled output: compare the inputs of every tile with the
+// previous run, and render only the blocks of the tiles that changed.
+void TileGenerator::selectChangedBlocks()
 {
-	int unpackErrors = 0;
-	long long blocks_rendered = 0;
-	int area_rendered = 0;
-	BlockPos currentPos;
-	currentPos.x() = INT_MIN;
-	currentPos.y() = INT_MAX;
-	currentPos.z() = INT_MIN;
-	bool allReaded = false;
-	MapBlockIterator *position;
-	MapBlockIterator *begin;
-	MapBlockIterator *end;
 	if (m_generatePrefetch != BlockListPrefetch::Prefetch) {
-		position = new MapBlockIteratorBlockPos();
-		begin = new MapBlockIteratorBlockPos(BlockPosIterator(
-				BlockPos(m_xMin, m_yMax, m_zMax, m_databaseFormat),
-				BlockPos(m_xMax, m_yMin, m_zMin, m_databaseFormat)));
-		end = new MapBlockIteratorBlockPos(BlockPosIterator(
-				BlockPos(m_xMin, m_yMax, m_zMax, m_databaseFormat),
-				BlockPos(m_xMax, m_yMin, m_zMin, m_databaseFormat),
-				BlockPosIterator::End));
+		std::cerr << "NOTE: --incremental requires the block list prefetch: generating all tiles" << std::endl;
+		return;
+	}
+	if (m_heightMap && (m_drawScale & DRAWHEIGHTSCALE_MASK)) {
+		// The height scale depends on all rendered blocks
+		std::cerr << "NOTE: --incremental can not be used with a height scale: generating all tiles" << std::endl;
+		return;
+	}
+
+	uint64_t settings = hashCombine(hashString(m_incrementalSettings), nodeColorsHash());
+	for (const HeightMapColor &c : m_heightMapColors) {
+		settings = hashCombine(settings, (uint64_t(uint32_t(c.height[0])) << 32) | uint32_t(c.height[1]));
+		settings = hashCombine(settings, (uint64_t(c.color[0].to_uint()) << 32) | c.color[1].to_uint());
+	}
+	for (int value : { m_xMin, m_xMax, m_zMin, m_zMax, m_mapXStartNodeOffset, m_mapYStartNodeOffset, m_scaleFactor })
+		settings = hashCombine(settings, static_cast<uint64_t>(value));
+
+	bool haveState = m_tilesEngine->readState(settings, m_db->getChangeSignature());
+	std::vector<uint64_t> blockHashes;
+	long long hashTime = -1;
+	if (haveState && m_tilesEngine->dataUnchanged()) {
+		blockHashes = m_tilesEngine->previousBlockHashes();
 	}
 	else {
-		position = new MapBlockIteratorBlockList(std::list<BlockPos>::iterator());
-		begin = new MapBlockIteratorBlockList(m_positions.begin());
-		end = new MapBlockIteratorBlockList(m_positions.end());
+		auto hashBegin = std::chrono::steady_clock::now();
+		blockHashes = hashTileBlocks();
+		hashTime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - hashBegin).count();
+	}
+	long long tilesChanged = m_tilesEngine->setBlockHashes(std::move(blockHashes));
+
+	// Only the blocks of changed tiles are rendered
+	size_t blocks = m_positions.size();
+	std::unordered_map<int64_t, bool> columnChanged;
+	m_positions.remove_if([&](const BlockPos &pos) {
+		int64_t column = (int64_t(pos.x()) << 32) | uint32_t(pos.z());
+		auto known = columnChanged.find(column);
+		if (known != columnChanged.end())
+			return !known->second;
+		bool changed = false;
+		int x1, y1, x2, y2;
+		if (blockColumnTiles(pos.x(), pos.z(), x1, y1, x2, y2))
+			for (int y = y1; y <= y2 && !changed; y++)
+				for (int x = x1; x <= x2 && !changed; x++)
+					changed = m_tilesEngine->tileChanged(x, y);
+		columnChanged[column] = changed;
+		return !changed;
+	});
+	if (verboseStatistics >= 1) {
+		cout << "Incremental output: " << (haveState ? "" : "no previous state; ")
+			<< (haveState && m_tilesEngine->dataUnchanged() ? "database unchanged; " : "")
+			<< "tiles changed: " << tilesChanged << ";  blocks to render: " << m_positions.size() << " / " << blocks;
+		if (hashTime >= 0)
+			cout << ";  blocks hashed in " << hashTime << " ms";
+		cout << std::endl;
 	}
+}
+
+uint64_t TileGenerator::nodeColorsHash() const
+{
+	uint64_t colors = 0;
+	for (const auto &entry : m_nodeColors) {
+		const ColorEntry &c = entry.second;
+		uint64_t color = (uint64_t(c.r) << 40) | (uint64_t(c.g) << 32) | (uint64_t(c.b) << 24) | (c.a << 16) | (c.t << 8) | c.f;
+		// The order of the color map is not defined
+		colors += hashCombine(hashString(entry.first), color);
+	}
+	return colors;
+}
+
+// The hash of the blocks of every tile (of the finest zoom level)
+std::vector<uint64_t> TileGenerator::hashTileBlocks() const
+{
+	int columns = m_tilesEngine->columns();
+	std::vector<uint64_t> tileHashes(static_cast<size_t>(columns) * m_tilesEngine->rows());
+	std::vector<unsigned char> data;
+	auto addColumn = [&](const BlockPos &pos, uint64_t hash) {
+		int x1, y1, x2, y2;
+		if (!blockColumnTiles(pos.x(), pos.z(), x1, y1, x2, y2))
+			return;
+		// The order of the columns does not matter
+		hash = hashCombine(hash, (uint64_t(uint32_t(pos.x())) << 32) | uint32_t(pos.z()));
+		for (int y = y1; y <= y2; y++)
+			for (int x = x1; x <= x2; x++)
+				tileHashes[static_cast<size_t>(y) * columns + x] += hash;
+	};
+	// The blocks of a column are consecutive. All blocks are hashed, as
+	// which ones are hidden is only known when they are decoded, so they are
+	// read a row at a time.
+	m_db->setReadAheadAll(m_positions);
+	BlockPos column(INT_MIN, INT_MIN, INT_MIN);
+	uint64_t hash = 0;
+	for (const BlockPos &pos : m_positions) {
+		if (pos.x() != column.x() || pos.z() != column.z()) {
+			if (column.x() != INT_MIN)
+				addColumn(column, hash);
+			column = pos;
+			hash = 0;
+		}
+		hash = hashCombine(hash, static_cast<uint64_t>(pos.y()));
+		if (m_db->getBlockDataOnPos(pos, data))
+			hash = hashCombine(hash, hashBytes(data.data(), data.size()));
+	}
+	if (column.x() != INT_MIN)
+		addColumn(column, hash);
+	return tileHashes;
+}
+
+// The tiles of the finest zoom level that may be affected by a column of
+// blocks. Because of shading, this includes the pixels to the right and below
+// the blocks. Returns false if the blocks are not on the image.
+bool TileGenerator::blockColumnTiles(int xPos, int zPos, int &tileX1, int &tileY1, int &tileX2, int &tileY2) const
+{
+	int width = m_pictWidth + borderLeft() + borderRight();
+	int height = m_pictHeight + borderTop() + borderBottom();
+	int x1 = std::max(worldX2ImageX(xPos * 16), 0);
+	int x2 = std::min(worldX2ImageX(xPos * 16 + 15) + 1, width - 1);
+	int y1 = std::max(worldZ2ImageY(zPos * 16 + 15), 0);
+	int y2 = std::min(worldZ2ImageY(zPos * 16) + 1, height - 1);
+	if (x1 > x2 || y1 > y2)
+		return false;
+	int tileSize = m_tiledOutputSize;
+	tileX1 = x1 / tileSize;
+	tileY1 = y1 / tileSize;
+	tileX2 = x2 / tileSize;
+	tileY2 = y2 / tileSize;
+	return true;
+}
+
+// Output the rows of the pixel buffer before block row zPosLimit
+void TileGenerator::pushBlockRows(int zPosLimit)
+{
+	if (m_scaleFactor > 1) {
+		scalePixelRows(m_blockPixelAttributes, m_blockPixelAttributesScaled, zPosLimit);
+		pushPixelRows(m_blockPixelAttributesScaled, zPosLimit);
+	}
+	else {
+		pushPixelRows(m_blockPixelAttributes, zPosLimit);
+	}
+}
+
+// Output the rows before block row zPos, and make the pixel buffer hold it
+void TileGenerator::startBlockRow(int zPos)
+{
+	pushBlockRows(zPos);
+	if (m_scaleFactor > 1)
+		m_blockPixelAttributesScaled.setLastY(((m_zMax - zPos) * 16 + 15) / m_scaleFactor);
+	m_blockPixelAttributes.setLastY((m_zMax - zPos) * 16 + 15);
+	if (progressIndicator)
+	    cout << "Processing Z-coordinate: " << std::setw(6) << zPos*16
+		<< "  (" << std::fixed << std::setprecision(0) << 100.0 * (m_zMax - zPos) / (m_zMax - m_zMin)
+		<< "%)          \r" << std::flush;
+}
+
+void TileGenerator::renderMap()
+{
+	m_unpackErrors = 0;
+	long long blocks_rendered = 0;
+	int area_rendered = 0;
+	// Blocks whose surface is cached are not decoded.
+	std::unique_ptr<SurfaceCache> surfaceCache;
+	if (!m_surfaceCacheFile.empty()) {
+		uint64_t settings = nodeColorsHash();
+		for (bool flag : { m_drawAir, m_drawIgnore, m_drawAlpha, m_heightMap })
+			settings = hashCombine(settings, flag);
+		surfaceCache = std::make_unique<SurfaceCache>(m_surfaceCacheFile, settings);
+		m_surfaceCache = surfaceCache.get();
+	}
+	int pipelineWorkers = 0;
+	int pipelineQueueDepth = 0;
+	MapBlockPipeline::Statistics pipelineStatistics;
+	if (m_generatePrefetch == BlockListPrefetch::Prefetch)
+		m_db->setReadAhead(m_positions);
 	std::cout << std::flush;
 	std::cerr << std::flush;
-	for (*position = *begin; *position != *end; ++*position) {
-		const BlockPos &pos = **position;
-		if (currentPos.x() != pos.x() || currentPos.z() != pos.z()) {
-			area_rendered++;
-			if (currentPos.y() == m_yMin)
-				m_emptyMapArea++;
-			if (currentPos.z() != pos.z()) {
-				if (m_scaleFactor > 1) {
-					scalePixelRows(m_blockPixelAttributes, m_blockPixelAttributesScaled, pos.z());
-					pushPixelRows(m_blockPixelAttributesScaled, pos.z());
-					m_blockPixelAttributesScaled.setLastY(((m_zMax - pos.z()) * 16 + 15) / m_scaleFactor);
-				}
-				else {
-					pushPixelRows(m_blockPixelAttributes, pos.z());
-				}
-				m_blockPixelAttributes.setLastY((m_zMax - pos.z()) * 16 + 15);
-				if (progressIndicator)
-				    cout << "Processing Z-coordinate: " << std::setw(6) << pos.z()*16
-					<< "  (" << std::fixed << std::setprecision(0) << 100.0 * (m_zMax - pos.z()) / (m_zMax - m_zMin)
-					<< "%)          \r" << std::flush;
-			}
-			
-			m_readedPixels.fill(0);
-			allReaded = false;
-			currentPos = pos;
+	if (m_parallelStrips && m_threads > 1 && m_generatePrefetch == BlockListPrefetch::Prefetch && m_extraOutputs.empty()) {
+		renderMapStrips(blocks_rendered, area_rendered);
+	}
+	else {
+		auto renderState = std::make_unique<RenderState>();
+		RenderState &state = *renderState;
+		state.pixels = &m_blockPixelAttributes;
+		for (ExtraOutput &extra : m_extraOutputs) {
+			extra.state = std::make_unique<RenderState>();
+			extra.state->pixels = &extra.generator->m_blockPixelAttributes;
 		}
-		else if (allReaded) {
-			position->breakDim(1);
-			continue;
+		BlockPos currentPos;
+		currentPos.x() = INT_MIN;
+		currentPos.y() = INT_MAX;
+		currentPos.z() = INT_MIN;
+		bool allReaded = false;
+		MapBlockIterator *position;
+		MapBlockIterator *begin;
+		MapBlockIterator *end;
+		if (m_generatePrefetch != BlockListPrefetch::Prefetch) {
+			position = new MapBlockIteratorBlockPos();
+			begin = new MapBlockIteratorBlockPos(BlockPosIterator(
+					BlockPos(m_xMin, m_yMax, m_zMax, m_databaseFormat),
+					BlockPos(m_xMax, m_yMin, m_zMin, m_databaseFormat)));
+			end = new MapBlockIteratorBlockPos(BlockPosIterator(
+					BlockPos(m_xMin, m_yMax, m_zMax, m_databaseFormat),
+					BlockPos(m_xMax, m_yMin, m_zMin, m_databaseFormat),
+					BlockPosIterator::End));
 		}
-		currentPos.y() = pos.y();
-		const DB::Block block = m_db->getBlockOnPos(pos);
-		if (!block.isEmpty()) {
-			try {
-				processMapBlock(block);
+		else {
+			position = new MapBlockIteratorBlockList(std::list<BlockPos>::iterator());
+			begin = new MapBlockIteratorBlockList(m_positions.begin());
+			end = new MapBlockIteratorBlockList(m_positions.end());
+		}
+		// Blocks are fetched and decoded by the pipeline, ahead of rendering, in the
+		// same order as they are rendered.
+		std::unique_ptr<MapBlockPipeline> pipeline;
+		if (m_threads > 1 && m_generatePrefetch == BlockListPrefetch::Prefetch) {
+			MapBlockPipeline::CacheLookup isCached;
+			if (m_surfaceCache)
+				isCached = [this](const BlockPos &pos, uint64_t dataHash) { return m_surfaceCache->contains(pos, surfaceHash(pos, dataHash)); };
+			pipeline = std::make_unique<MapBlockPipeline>(m_db, m_positions, m_threads - 1, std::max(64, 16 * m_threads), std::move(isCached));
+		}
+		// The column of blocks is done when all outputs are complete
+		auto columnComplete = [](RenderState &s) {
+			s.columnComplete = true;
+			for (int i = 0; i < 16; ++i) {
+				if (s.readedPixels[i] != 0xffff) {
+					s.columnComplete = false;
+				}
+			}
+			return s.columnComplete;
+		};
+		for (*position = *begin; *position != *end; ++*position) {
+			const BlockPos &pos = **position;
+			if (currentPos.x() != pos.x() || currentPos.z() != pos.z()) {
+				area_rendered++;
+				if (currentPos.y() == m_yMin)
+					m_emptyMapArea++;
+				if (currentPos.z() != pos.z()) {
+					startBlockRow(pos.z());
+					for (ExtraOutput &extra : m_extraOutputs)
+						extra.generator->startBlockRow(pos.z());
+				}
 
+				state.readedPixels.fill(0);
+				state.columnComplete = false;
+				for (ExtraOutput &extra : m_extraOutputs) {
+					extra.state->readedPixels.fill(0);
+					extra.state->columnComplete = false;
+				}
+				allReaded = false;
+				currentPos = pos;
+			}
+			else if (allReaded) {
+				position->breakDim(1);
+				if (pipeline)
+					pipeline->skip();
+				continue;
+			}
+			currentPos.y() = pos.y();
+			if (renderBlock(state, pos, pipeline.get())) {
 				blocks_rendered++;
 
-				allReaded = true;
-				for (int i = 0; i < 16; ++i) {
-					if (m_readedPixels[i] != 0xffff) {
+				allReaded = columnComplete(state);
+				for (ExtraOutput &extra : m_extraOutputs) {
+					if (!columnComplete(*extra.state))
 						allReaded = false;
-					}
 				}
-			}
-			catch (UnpackError &e) {
-				std::cerr << "Failed to unpack map block " << pos.x() << "," << pos.y() << "," << pos.z()
-					<< " (id: " << pos.databasePosStr(BlockPos::I64) << "). Block corrupt ?"
-					<< std::endl
-					<< "\tCoordinates: " << pos.x()*16 << "," << pos.y()*16 << "," << pos.z()*16 << "+16+16+16"
-					<< ";  Data: " << e.type << " at: " << e.offset << "(+" << e.length <<  ")/" << e.dataLength
-					<< std::endl;
-				unpackErrors++;
-			}
-			catch (ZlibDecompressor::DecompressError &e) {
-				std::cerr << "Failed to decompress data in map block " << pos.x() << "," << pos.y() << "," << pos.z()
-					<< " (id: " << pos.databasePosStr(BlockPos::I64) << "). Block corrupt ?"
-					<< std::endl
-					<< "\tCoordinates: " << pos.x()*16 << "," << pos.y()*16 << "," << pos.z()*16 << "+16+16+16"
-					<< ";  Cause: " << e.message
-					<< std::endl;
-				unpackErrors++;
+				if (allReaded && pipeline)
+					pipeline->columnComplete(pos);
 			}
 		}
-		if (unpackErrors >= 100) {
-			throw(std::runtime_error("Too many block unpacking errors - bailing out"));
+		if (pipeline) {
+			pipelineWorkers = pipeline->workers();
+			pipelineQueueDepth = pipeline->queueDepth();
+			pipeline->stop();
+			pipelineStatistics = pipeline->statistics();
+			pipeline.reset();
 		}
-	}
-	delete position;
-	delete begin;
-	delete end;
-	if (currentPos.z() != INT_MIN) {
-		if (currentPos.y() == m_yMin)
-			m_emptyMapArea++;
-		if (m_scaleFactor > 1) {
-			scalePixelRows(m_blockPixelAttributes, m_blockPixelAttributesScaled, currentPos.z() - 1);
-			pushPixelRows(m_blockPixelAttributesScaled, currentPos.z() - 1);
-		}
-		else {
-			pushPixelRows(m_blockPixelAttributes, currentPos.z() - 1);
+		delete position;
+		delete begin;
+		delete end;
+		if (currentPos.z() != INT_MIN) {
+			if (currentPos.y() == m_yMin)
+				m_emptyMapArea++;
+			pushBlockRows(currentPos.z() - 1);
+			for (ExtraOutput &extra : m_extraOutputs)
+				extra.generator->pushBlockRows(currentPos.z() - 1);
 		}
-	}
+		mergeRenderState(state);
+		for (ExtraOutput &extra : m_extraOutputs)
+			extra.generator->mergeRenderState(*extra.state);
+	}
+	size_t surfacesCached = 0;
+	long long surfaceHits = 0;
+	long long surfaceMisses = 0;
+	if (m_surfaceCache) {
+		surfacesCached = m_surfaceCache->previousCount();
+		surfaceHits = m_surfaceCache->hits();
+		surfaceMisses = m_surfaceCache->misses();
+		m_surfaceCache->save();
+		m_surfaceCache = nullptr;
+		surfaceCache.reset();
+	}
+	int unpackErrors = m_unpackErrors;
 	bool eraseProgress = true;
 	if (verboseCoordinates >= 1) {
 		eraseProgress = false;
@@ -1517,6 +1886,26 @@ void TileGenerator::renderMap()
 		if (unpackErrors)
 			cout << "  (" << unpackErrors << " errors)";
 		cout << std::endl;
+		cout << "Block decompression:  " << ZlibDecompressor::backendName() << std::endl;
+		m_db->printStatistics(cout);
+		if (!m_surfaceCacheFile.empty()) {
+			cout << "Surface cache:  blocks cached: " << surfacesCached
+				<< ";  blocks found: " << surfaceHits
+				<< ";  blocks decoded: " << surfaceMisses << std::endl;
+		}
+	}
+	if (verboseStatistics >= 1 && pipelineWorkers) {
+		const MapBlockPipeline::Statistics &ps = pipelineStatistics;
+		long long samples = ps.samples ? ps.samples : 1;
+		cout << std::fixed << std::setprecision(1);
+		cout << "Pipeline statistics:  threads: 1 fetch + " << pipelineWorkers << " decode;  queue size: " << pipelineQueueDepth << std::endl
+			<< "    Fetch:   blocks: " << ps.blocksFetched << ";  stalls (queue full): " << ps.fetchStalls << std::endl
+			<< "    Decode:  blocks: " << ps.blocksDecoded << ";  cached: " << ps.blocksCached << ";  skipped (column complete): " << ps.blocksSkipped << ";  queue depth avg/max: "
+				<< 1.0 * ps.fetchQueueDepthSum / samples << " / " << ps.fetchQueueDepthMax
+				<< ";  stalls (queue empty): " << ps.decodeStalls << std::endl
+			<< "    Render:  blocks discarded: " << ps.blocksDiscarded << ";  queue depth avg/max: "
+				<< 1.0 * ps.readyQueueDepthSum / samples << " / " << ps.readyQueueDepthMax
+				<< ";  stalls (block not ready): " << ps.renderStalls << std::endl;
 	}
 	if (progressIndicator && eraseProgress)
 		cout << std::setw(50) << "" << "\r";
@@ -1566,7 +1955,265 @@ void TileGenerator::renderMap()
 	}
 }
 
-Color TileGenerator::computeMapHeightColor(int height)
+// Read the data of the block at pos (empty if there is no block). Reading
+// is serialized, unless the database supports concurrent reads.
+void TileGenerator::readBlockData(const BlockPos &pos, std::vector<unsigned char> &data)
+{
+	std::unique_lock<std::mutex> lock(m_dbMutex, std::defer_lock);
+	if (!m_db->concurrentReads())
+		lock.lock();
+	if (!m_db->getBlockDataOnPos(pos, data))
+		data.clear();
+}
+
+// Fetch the block at pos (from the pipeline, if there is one), and render it.
+// Returns true if the block was rendered.
+bool TileGenerator::renderBlock(RenderState &state, const BlockPos &pos, MapBlockPipeline *pipeline)
+{
+	DB::Block dbBlock;
+	try {
+		const DB::Block *block = &dbBlock;
+		bool cached = false;
+		if (m_surfaceCache) {
+			const std::vector<unsigned char> *data = &state.blockData;
+			if (pipeline) {
+				block = &pipeline->next();
+				data = &pipeline->data();
+			}
+			else {
+				readBlockData(pos, state.blockData);
+			}
+			if (!data->empty()) {
+				uint64_t hash = surfaceHash(pos, pipeline ? pipeline->dataHash() : hashBytes(data->data(), data->size()));
+				cached = m_surfaceCache->find(pos, hash, state.blockSurface);
+				if (!cached) {
+					if (!pipeline || pipeline->cached()) {
+						dbBlock = DB::Block(pos, *data);
+						block = &dbBlock;
+					}
+					computeBlockSurface(state, *block);
+					m_surfaceCache->add(pos, hash, state.blockSurface);
+				}
+			}
+		}
+		else if (pipeline) {
+			block = &pipeline->next();
+		}
+		else if (m_parallelStrips) {
+			// Only reading the data may be serialized; decoding is done in parallel.
+			readBlockData(pos, state.blockData);
+			dbBlock = DB::Block(pos, state.blockData);
+		}
+		else {
+			dbBlock = m_db->getBlockOnPos(pos);
+		}
+		if (cached || !block->isEmpty()) {
+			if (m_surfaceCache) {
+				renderBlockSurface(state, pos);
+			}
+			else {
+				if (!state.columnComplete)
+					processMapBlock(state, *block);
+				for (ExtraOutput &extra : m_extraOutputs) {
+					if (!extra.state->columnComplete)
+						extra.generator->processMapBlock(*extra.state, *block);
+				}
+			}
+			return true;
+		}
+	}
+	catch (UnpackError &e) {
+		std::lock_guard<std::mutex> lock(m_errorMutex);
+		std::cerr << "Failed to unpack map block " << pos.x() << "," << pos.y() << "," << pos.z()
+			<< " (id: " << pos.databasePosStr(BlockPos::I64) << "). Block corrupt ?"
+			<< std::endl
+			<< "\tCoordinates: " << pos.x()*16 << "," << pos.y()*16 << "," << pos.z()*16 << "+16+16+16"
+			<< ";  Data: " << e.type << " at: " << e.offset << "(+" << e.length <<  ")/" << e.dataLength
+			<< std::endl;
+		if (++m_unpackErrors >= 100)
+			throw(std::runtime_error("Too many block unpacking errors - bailing out"));
+	}
+	catch (ZlibDecompressor::DecompressError &e) {
+		std::lock_guard<std::mutex> lock(m_errorMutex);
+		std::cerr << "Failed to decompress data in map block " << pos.x() << "," << pos.y() << "," << pos.z()
+			<< " (id: " << pos.databasePosStr(BlockPos::I64) << "). Block corrupt ?"
+			<< std::endl
+			<< "\tCoordinates: " << pos.x()*16 << "," << pos.y()*16 << "," << pos.z()*16 << "+16+16+16"
+			<< ";  Cause: " << e.message
+			<< std::endl;
+		if (++m_unpackErrors >= 100)
+			throw(std::runtime_error("Too many block unpacking errors - bailing out"));
+	}
+	return false;
+}
+
+// Add the results of a render state to the totals of the map
+void TileGenerator::mergeRenderState(RenderState &state)
+{
+	if (m_nameIdUnknown.size() < state.nameIdUnknown.size())
+		m_nameIdUnknown.resize(state.nameIdUnknown.size());
+	for (size_t i = 0; i < state.nameIdUnknown.size(); i++)
+		if (state.nameIdUnknown[i])
+			m_nameIdUnknown[i] = true;
+	m_surfaceHeight = std::max(m_surfaceHeight, state.surfaceHeight);
+	m_surfaceDepth = std::min(m_surfaceDepth, state.surfaceDepth);
+	m_YMinMapped = std::min(m_YMinMapped, state.yMinMapped);
+	m_YMaxMapped = std::max(m_YMaxMapped, state.yMaxMapped);
+}
+
+// Parallel strips: the rows of blocks of the map are rendered by a number
+// of threads, each into a pixel buffer of its own (a strip). Threads take
+// the next row that is not being rendered when they are done with a row.
+// The strips are copied into the pixel buffer of the map in order, so the
+// line before each strip (needed for shading) is the last line of the
+// previous strip, and the image is the same as when rendering serially.
+// At most a few strips are rendered ahead of the row that is output.
+void TileGenerator::renderMapStrips(long long &blocksRendered, int &areaRendered)
+{
+	// The block positions of every row
+	struct Row {
+		int z;
+		std::list<BlockPos>::const_iterator begin;
+		std::list<BlockPos>::const_iterator end;
+	};
+	std::vector<Row> rows;
+	for (auto it = m_positions.cbegin(); it != m_positions.cend(); ++it) {
+		if (rows.empty() || rows.back().z != it->z())
+			rows.push_back({ it->z(), it, it });
+		rows.back().end = std::next(it);
+	}
+
+	int threads = std::max(1, m_threads - 1);
+	size_t slots = 2 * threads;
+	std::vector<Strip> strips(slots);
+	std::vector<long> stripRow(slots, -1);		// Row that was rendered into a strip
+	std::vector<std::unique_ptr<RenderState>> states;
+	for (Strip &strip : strips)
+		strip.pixels.setParameters(m_storedWidth, 16, 0, 1, true);
+	std::mutex mutex;
+	std::condition_variable stripDone;
+	std::condition_variable stripFree;
+	std::atomic<size_t> nextRow{ 0 };
+	size_t rowsDone = 0;			// Rows that were output
+	bool stop = false;
+	std::exception_ptr error;
+
+	auto renderRows = [&](RenderState &state) {
+		for (;;) {
+			size_t row = nextRow++;
+			if (row >= rows.size())
+				return;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				stripFree.wait(lock, [&]() { return stop || row < rowsDone + slots; });
+				if (stop)
+					return;
+			}
+			Strip &strip = strips[row % slots];
+			strip.pixels.reset(worldBlockZ2StoredY(rows[row].z));
+			strip.blocksRendered = 0;
+			strip.areaRendered = 0;
+			strip.emptyMapArea = 0;
+			state.pixels = &strip.pixels;
+			BlockPos currentPos;
+			currentPos.x() = INT_MIN;
+			currentPos.y() = INT_MAX;
+			bool allReaded = false;
+			for (auto it = rows[row].begin; it != rows[row].end; ++it) {
+				const BlockPos &pos = *it;
+				if (currentPos.x() != pos.x()) {
+					strip.areaRendered++;
+					if (currentPos.y() == m_yMin)
+						strip.emptyMapArea++;
+					state.readedPixels.fill(0);
+					allReaded = false;
+					currentPos = pos;
+				}
+				else if (allReaded) {
+					continue;
+				}
+				currentPos.y() = pos.y();
+				if (renderBlock(state, pos, nullptr)) {
+					strip.blocksRendered++;
+					allReaded = true;
+					for (int i = 0; i < 16; ++i) {
+						if (state.readedPixels[i] != 0xffff) {
+							allReaded = false;
+						}
+					}
+				}
+			}
+			if (currentPos.y() == m_yMin)
+				strip.emptyMapArea++;
+			std::lock_guard<std::mutex> lock(mutex);
+			stripRow[row % slots] = static_cast<long>(row);
+			stripDone.notify_all();
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (int i = 0; i < threads; i++) {
+		states.push_back(std::make_unique<RenderState>());
+		RenderState *state = states.back().get();
+		workers.emplace_back([&, state]() {
+			try {
+				renderRows(*state);
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!error)
+					error = std::current_exception();
+				stop = true;
+				stripDone.notify_all();
+				stripFree.notify_all();
+			}
+		});
+	}
+
+	auto stopWorkers = [&]() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+			stripFree.notify_all();
+		}
+		for (std::thread &worker : workers)
+			worker.join();
+		workers.clear();
+	};
+	try {
+		for (size_t row = 0; row < rows.size(); row++) {
+			const Strip &strip = strips[row % slots];
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				stripDone.wait(lock, [&]() { return error || stripRow[row % slots] == static_cast<long>(row); });
+				if (error)
+					break;
+			}
+			startBlockRow(rows[row].z);
+			int y = worldBlockZ2StoredY(rows[row].z);
+			m_blockPixelAttributes.copyLines(strip.pixels, y, y + 16);
+			blocksRendered += strip.blocksRendered;
+			areaRendered += strip.areaRendered;
+			m_emptyMapArea += strip.emptyMapArea;
+			std::lock_guard<std::mutex> lock(mutex);
+			rowsDone = row + 1;
+			stripFree.notify_all();
+		}
+	}
+	catch (...) {
+		stopWorkers();
+		throw;
+	}
+	stopWorkers();
+	if (error)
+		std::rethrow_exception(error);
+	if (!rows.empty())
+		pushBlockRows(rows.back().z - 1);
+	for (const std::unique_ptr<RenderState> &state : states)
+		mergeRenderState(*state);
+}
+
+Color TileGenerator::computeMapHeightColor(int height) const
 {
 	int adjustedHeight = int((height - m_seaLevel) * m_heightMapYScale + 0.5);
 	float r = 0;
@@ -1588,75 +2235,276 @@ Color TileGenerator::computeMapHeightColor(int height)
 	return Color(int(r / n + 0.5), int(g / n + 0.5), int(b / n + 0.5));
 }
 
-inline void TileGenerator::renderMapBlock(const MapBlock &mapBlock)
+// The colors of all heights that blocks in the map area can have, so that
+// rendering does not search the height map colors for every pixel.
+void TileGenerator::computeHeightMapColorTable()
+{
+	if (m_heightMap)
+		computeHeightMapColorTable(m_yMin, m_yMax);
+	else
+		m_heightMapColorTable.clear();
+}
+
+void TileGenerator::computeHeightMapColorTable(int yMin, int yMax)
+{
+	m_heightMapColorTable.clear();
+	if (yMin > yMax)
+		return;
+	m_heightMapColorTableMin = yMin * 16;
+	m_heightMapColorTable.reserve(static_cast<size_t>(yMax - yMin + 1) * 16);
+	for (int height = yMin * 16; height < (yMax + 1) * 16; height++)
+		m_heightMapColorTable.push_back(computeMapHeightColor(height));
+}
+
+#define RENDERMAPBLOCK_MODES(encoding, heightMap) \
+	{ \
+		{ &TileGenerator::renderMapBlockT<encoding, heightMap, false, false>, &TileGenerator::renderMapBlockT<encoding, heightMap, false, true> }, \
+		{ &TileGenerator::renderMapBlockT<encoding, heightMap, true, false>, &TileGenerator::renderMapBlockT<encoding, heightMap, true, true> } \
+	}
+const TileGenerator::RenderMapBlockFunction TileGenerator::m_renderMapBlockFunctions[2][2][2][2] = {
+	{ RENDERMAPBLOCK_MODES(MapBlock::ContentWide, false), RENDERMAPBLOCK_MODES(MapBlock::ContentWide, true) },
+	{ RENDERMAPBLOCK_MODES(MapBlock::ContentSplit, false), RENDERMAPBLOCK_MODES(MapBlock::ContentSplit, true) },
+};
+#undef RENDERMAPBLOCK_MODES
+
+inline void TileGenerator::renderMapBlock(RenderState &state, const MapBlock &mapBlock)
+{
+	// Select the render loop for this block's encoding and the render mode once,
+	// so that the per-node loop has no mode checks.
+	RenderMapBlockFunction render = m_renderMapBlockFunctions
+		[mapBlock.getContentEncoding()]
+		[m_heightMap]
+		[m_drawAlpha]
+		[m_blockDefaultColor.to_uint() != 0];
+	(this->*render)(state, mapBlock);
+}
+
+template<MapBlock::ContentEncoding Encoding, bool HeightMap, bool DrawAlpha, bool DefaultColor>
+void TileGenerator::renderMapBlockT(RenderState &state, const MapBlock &mapBlock)
 {
 	const BlockPos &pos = mapBlock.getPos();
 	int xBegin = worldBlockX2StoredX(pos.x());
 	int zBegin = worldBlockZ2StoredY(pos.z());
-	//const unsigned char *mapData = mapBlock.data();
 	int minY = (pos.y() < m_reqYMin) ? 16 : (pos.y() > m_reqYMin) ?  0 : m_reqYMinNode;
 	int maxY = (pos.y() > m_reqYMax) ? -1 : (pos.y() < m_reqYMax) ? 15 : m_reqYMaxNode;
 	bool renderedAnything = false;
+	// Find the topmost node that is drawn, and the topmost opaque node in
+	// every column, skipping air etc.
+	int8_t topY[16][16];
+	int8_t opaqueY[16][16];
+	bool haveTopY = Encoding == MapBlock::ContentWide;
+	if (haveTopY)
+		BlockColumnScan::findTopNodes(mapBlock.getMapData(), minY, maxY, state.nodeMask, state.readedPixels, topY, opaqueY);
 	for (int z = 0; z < 16; ++z) {
 		bool rowIsEmpty = true;
+		PixelAttribute *line = state.pixels->line(zBegin + 15 - z);
+		PixelAttribute *pixels = line ? line + xBegin : state.discardedPixels.data();
 		for (int x = 0; x < 16; ++x) {
-			if (m_readedPixels[z] & (1 << x)) {
+			if (state.readedPixels[z] & (1 << x)) {
 				continue;
 			}
-			// The #define of pixel performs *significantly* *better* than the definition of PixelAttribute &pixel ...
-			#define pixel m_blockPixelAttributes.attribute(zBegin + 15 - z,xBegin + x)
-			//PixelAttribute &pixel = m_blockPixelAttributes.attribute(zBegin + 15 - z,xBegin + x);
-			if (m_blockDefaultColor.to_uint() && !pixel.color().to_uint()) {
+			PixelAttribute &pixel = pixels[x];
+			if (DefaultColor && !pixel.color().to_uint()) {
 				rowIsEmpty = false;
 				pixel = PixelAttribute(m_blockDefaultColor, NAN);
 			}
-			for (int y = maxY; y >= minY; --y) {
+			if (haveTopY && topY[z][x] >= minY && topY[z][x] == opaqueY[z][x]) {
+				// The topmost node is opaque: it is the only one to draw
+				int y = topY[z][x];
+				int height = pos.y() * 16 + y;
+				const ColorEntry *nodeColor = state.nodeIDColor[mapBlock.readBlockContent<Encoding>(x + (y << 4) + (z << 8))];
+				rowIsEmpty = false;
+				renderedAnything = true;
+				if (HeightMap) {
+					if (height > state.surfaceHeight) state.surfaceHeight = height;
+					if (height < state.surfaceDepth) state.surfaceDepth = height;
+					pixel = PixelAttribute(mapHeightColor(height), height);
+				}
+				else {
+					pixel.mixUnder(PixelAttribute(*nodeColor, height), m_alphaMixMode);
+				}
+				state.readedPixels[z] |= (1 << x);
+				continue;
+			}
+			for (int y = haveTopY ? topY[z][x] : maxY; y >= minY; --y) {
 				int position = x + (y << 4) + (z << 8);
-				int content = mapBlock.readBlockContent(position);//readBlockContent(mapData, version, position);
-				#define nodeColor (*m_nodeIDColor[content])
-				//const ColorEntry &nodeColor = *m_nodeIDColor[content];
-				if (m_nodeIDColor[content] == NodeColorNotDrawn) {
+				int content = mapBlock.readBlockContent<Encoding>(position);
+				const ColorEntry *nodeColor = state.nodeIDColor[content];
+				if (nodeColor == NodeColorNotDrawn) {
 					continue;
 				}
 				int height = pos.y() * 16 + y;
-				if (m_heightMap) {
-					if (m_nodeIDColor[content] && nodeColor.a != 0) {
-						if (!(m_readedPixels[z] & (1 << x))) {
-							if (height > m_surfaceHeight) m_surfaceHeight = height;
-							if (height < m_surfaceDepth) m_surfaceDepth = height;
-						}
+				if (HeightMap) {
+					if (nodeColor && nodeColor->a != 0) {
+						if (height > state.surfaceHeight) state.surfaceHeight = height;
+						if (height < state.surfaceDepth) state.surfaceDepth = height;
 						rowIsEmpty = false;
 						renderedAnything = true;
-						pixel = PixelAttribute(computeMapHeightColor(height), height);
-						m_readedPixels[z] |= (1 << x);
+						pixel = PixelAttribute(mapHeightColor(height), height);
+						state.readedPixels[z] |= (1 << x);
 						break;
 					}
 				}
-				else if (m_nodeIDColor[content]) {
+				else if (nodeColor) {
 					rowIsEmpty = false;
 					renderedAnything = true;
-					pixel.mixUnder(PixelAttribute(nodeColor, height));
-					if ((m_drawAlpha && nodeColor.a == 0xff) || (!m_drawAlpha && nodeColor.a != 0)) {
-						m_readedPixels[z] |= (1 << x);
+					pixel.mixUnder(PixelAttribute(*nodeColor, height), m_alphaMixMode);
+					if (DrawAlpha ? nodeColor->a == 0xff : nodeColor->a != 0) {
+						state.readedPixels[z] |= (1 << x);
 						break;
 					}
-				} else {
-					NodeID2NameMap::iterator blockName = m_nameMap.find(content);
-					if (blockName != m_nameMap.end())
-						m_unknownNodes.insert(blockName->second);
 				}
-				#undef nodeColor
+				else if (state.nodeIDNameId[content] >= 0) {
+					state.nameIdUnknown[state.nodeIDNameId[content]] = true;
+				}
 			}
-			#undef pixel
 		}
 		if (!rowIsEmpty)
-			m_blockPixelAttributes.attribute(zBegin + 15 - z,xBegin).nextEmpty = false;
+			state.pixels->setNextEmpty(zBegin + 15 - z, xBegin, false);
 	}
 	if (renderedAnything) {
-		if (pos.y() < m_YMinMapped)
-			m_YMinMapped = pos.y();
-		if (pos.y() > m_YMaxMapped)
-			m_YMaxMapped = pos.y();
+		if (pos.y() < state.yMinMapped)
+			state.yMinMapped = pos.y();
+		if (pos.y() > state.yMaxMapped)
+			state.yMaxMapped = pos.y();
+	}
+}
+
+// Surface cache: the surface of a block depends on its data, and on the
+// vertical limits of the map within the block.
+uint64_t TileGenerator::surfaceHash(const BlockPos &pos, uint64_t dataHash) const
+{
+	int minY = (pos.y() < m_reqYMin) ? 16 : (pos.y() > m_reqYMin) ?  0 : m_reqYMinNode;
+	int maxY = (pos.y() > m_reqYMax) ? -1 : (pos.y() < m_reqYMax) ? 15 : m_reqYMaxNode;
+	return hashCombine(dataHash, (uint64_t(uint32_t(minY)) << 32) | uint32_t(maxY));
+}
+
+void TileGenerator::computeBlockSurface(RenderState &state, const MapBlock &mapBlock)
+{
+	BlockSurface &surface = state.blockSurface;
+	surface.clear();
+	if (!mapNodeColors(state, mapBlock)) {
+		surface.setNotDrawn();
+		return;
+	}
+	if (mapBlock.getContentEncoding() == MapBlock::ContentWide)
+		computeBlockSurfaceT<MapBlock::ContentWide>(state, mapBlock);
+	else
+		computeBlockSurfaceT<MapBlock::ContentSplit>(state, mapBlock);
+}
+
+// The nodes that renderMapBlockT() would use, in all columns of the block
+template<MapBlock::ContentEncoding Encoding>
+void TileGenerator::computeBlockSurfaceT(RenderState &state, const MapBlock &mapBlock)
+{
+	BlockSurface &surface = state.blockSurface;
+	const BlockPos &pos = mapBlock.getPos();
+	int minY = (pos.y() < m_reqYMin) ? 16 : (pos.y() > m_reqYMin) ?  0 : m_reqYMinNode;
+	int maxY = (pos.y() > m_reqYMax) ? -1 : (pos.y() < m_reqYMax) ? 15 : m_reqYMaxNode;
+	int8_t topY[16][16];
+	int8_t opaqueY[16][16];
+	bool haveTopY = Encoding == MapBlock::ContentWide;
+	if (haveTopY)
+		BlockColumnScan::findTopNodes(mapBlock.getMapData(), minY, maxY, state.nodeMask, std::array<uint16_t, 16>{}, topY, opaqueY);
+	for (int z = 0; z < 16; ++z) {
+		for (int x = 0; x < 16; ++x) {
+			int column = (z << 4) + x;
+			for (int y = haveTopY ? topY[z][x] : maxY; y >= minY; --y) {
+				int position = x + (y << 4) + (z << 8);
+				int content = mapBlock.readBlockContent<Encoding>(position);
+				const ColorEntry *nodeColor = state.nodeIDColor[content];
+				if (nodeColor == NodeColorNotDrawn) {
+					continue;
+				}
+				int &index = state.nodeIDSurfaceIndex[content];
+				if (m_heightMap) {
+					if (nodeColor && nodeColor->a != 0) {
+						if (index < 0)
+							index = surface.colorIndex(nodeColor);
+						surface.addNode(column, index, y);
+						surface.setComplete(column);
+						break;
+					}
+				}
+				else if (nodeColor) {
+					if (index < 0)
+						index = surface.colorIndex(nodeColor);
+					surface.addNode(column, index, y);
+					if (m_drawAlpha ? nodeColor->a == 0xff : nodeColor->a != 0) {
+						surface.setComplete(column);
+						break;
+					}
+				}
+				else if (state.nodeIDNameId[content] >= 0) {
+					if (index < 0)
+						index = surface.unknownIndex(NodeNameTable::instance().name(state.nodeIDNameId[content]));
+					surface.addNode(column, index, y);
+				}
+			}
+		}
+	}
+}
+
+// Render a block from its surface. This has the same result as renderMapBlockT().
+void TileGenerator::renderBlockSurface(RenderState &state, const BlockPos &pos)
+{
+	const BlockSurface &surface = state.blockSurface;
+	int xBegin = worldBlockX2StoredX(pos.x());
+	int zBegin = worldBlockZ2StoredY(pos.z());
+	bool defaultColor = m_blockDefaultColor.to_uint() != 0;
+	if (surface.notDrawn() || (surface.empty() && !defaultColor))
+		return;
+	bool renderedAnything = false;
+	int node = 0;
+	for (int z = 0; z < 16; ++z) {
+		bool rowIsEmpty = true;
+		PixelAttribute *line = state.pixels->line(zBegin + 15 - z);
+		PixelAttribute *pixels = line ? line + xBegin : state.discardedPixels.data();
+		for (int x = 0; x < 16; ++x) {
+			int column = (z << 4) + x;
+			int end = node + surface.nodeCount(column);
+			if (state.readedPixels[z] & (1 << x)) {
+				node = end;
+				continue;
+			}
+			PixelAttribute &pixel = pixels[x];
+			if (defaultColor && !pixel.color().to_uint()) {
+				rowIsEmpty = false;
+				pixel = PixelAttribute(m_blockDefaultColor, NAN);
+			}
+			for (; node < end; node++) {
+				int index = surface.nodeIndex(node);
+				int height = pos.y() * 16 + surface.nodeY(node);
+				if (surface.isUnknown(index)) {
+					int nameId = NodeNameTable::instance().intern(surface.unknownName(index));
+					if (nameId >= static_cast<int>(state.nameIdUnknown.size()))
+						resolveNodeColors(state);
+					state.nameIdUnknown[nameId] = true;
+				}
+				else if (m_heightMap) {
+					if (height > state.surfaceHeight) state.surfaceHeight = height;
+					if (height < state.surfaceDepth) state.surfaceDepth = height;
+					rowIsEmpty = false;
+					renderedAnything = true;
+					pixel = PixelAttribute(mapHeightColor(height), height);
+				}
+				else {
+					rowIsEmpty = false;
+					renderedAnything = true;
+					pixel.mixUnder(PixelAttribute(surface.color(index), height), m_alphaMixMode);
+				}
+			}
+			if (surface.complete(column))
+				state.readedPixels[z] |= (1 << x);
+		}
+		if (!rowIsEmpty)
+			state.pixels->setNextEmpty(zBegin + 15 - z, xBegin, false);
+	}
+	if (renderedAnything) {
+		if (pos.y() < state.yMinMapped)
+			state.yMinMapped = pos.y();
+		if (pos.y() > state.yMaxMapped)
+			state.yMaxMapped = pos.y();
 	}
 }
 
@@ -1769,7 +2617,7 @@ void TileGenerator::renderHeightScale()
 
 	double height = height_min;
 	for (int x = 0; height < height_limit; x++, height += height_step) {
-		Color color = computeMapHeightColor(int(height + 0.5));
+		Color color = mapHeightColor(int(height + 0.5));
 		paintEngine->drawLine(xBorderOffset + x, yBorderOffset + 8, xBorderOffset + x, yBorderOffset + borderBottom() - 20, color);
 	
 		int iheight = static_cast<int>(height + (height > 0 ? 0.5 : -0.5));
@@ -1978,9 +2826,14 @@ void TileGenerator::writeImage(const std::string &output)
 
 void TileGenerator::printUnknown()
 {
-	if (!m_unknownNodes.empty()) {
+	std::set<std::string> unknownNodes;
+	for (size_t nameId = 0; nameId < m_nameIdUnknown.size(); nameId++) {
+		if (m_nameIdUnknown[nameId])
+			unknownNodes.insert(NodeNameTable::instance().name(static_cast<int>(nameId)));
+	}
+	if (!unknownNodes.empty()) {
 		std::cerr << "Unknown nodes:" << std::endl;
-		for (const string &unknownNode : m_unknownNodes) {
+		for (const string &unknownNode : unknownNodes) {
 			std::cerr << unknownNode << std::endl;
 		}
 	}
@@ -15,19 +15,28 @@
 #include <iosfwd>
 #include <iostream>
 #include <list>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <sstream>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
+#include "BlockColumnScan.h"
 #include "BlockPos.h"
 #include "Color.h"
 #include "MapBlock.h"
 #include "PaintEngine.h"
 #include "PixelAttributes.h"
+#include "PngEncoder.h"
+#include "SurfaceCache.h"
 #include "config.h"
 #include "db.h"
 
+class MapBlockPipeline;
+class PaintEngine_libgdTiles;
+
 #define TILESIZE_CHUNK			(INT_MIN)
 #define TILECENTER_AT_WORLDCENTER	(INT_MAX)
 #define TILECORNER_AT_WORLDCENTER	(INT_MAX - 1)
@@ -58,7 +67,6 @@ class TileGenerator
 {
 private:
 	typedef std::unordered_map<std::string, ColorEntry> NodeColorMap;
-	typedef std::unordered_map<int, std::string> NodeID2NameMap;
 
 public:
 	using HeightMapColorList = std::list<HeightMapColor>;
@@ -125,6 +133,7 @@ public:
 	void setSideScaleInterval(int major, int minor);
 	void setHeightScaleInterval(int major, int minor);
 	void setDrawAlpha(bool drawAlpha);
+	void setAlphaMixMode(PixelAttribute::AlphaMixingMode mode);
 	void setDrawAir(bool drawAir);
 	void setDrawIgnore(bool drawIgnore);
 	void drawObject(const DrawObject &object) { m_drawObjects.push_back(object); }
@@ -147,18 +156,76 @@ public:
 	void setBackend(const std::string &backend);
 	void setScanEntireWorld(bool enable);
 	void setChunkSize(int size);
+	void setThreads(int threads);
+	void setParallelStrips(bool enable);
+	void setStreamOutput(bool enable);
+	void setPngCompression(int level, PngEncoder::Filter filter);
+	void setTiledOutput(int tileSize, int zoomLevels);
+	void setIncremental(const std::string &settings);
+	void setSurfaceCache(const std::string &file);
+	// Also generate the map of generator (which has different colors, scale,
+	// etc., but the same map area) into output, using the same blocks.
+	void addExtraOutput(TileGenerator *generator, const std::string &output);
 	void generate(const std::string &input, const std::string &output);
-	Color computeMapHeightColor(int height);
+	// Time that writing (encoding) the image(s) took, in milliseconds
+	long long writeImageTime() const { return m_writeImageTime; }
+	Color computeMapHeightColor(int height) const;
+	// Compute the height map colors of the heights of block layers yMin
+	// ... yMax, which mapHeightColor() looks up
+	void computeHeightMapColorTable(int yMin, int yMax);
+	Color mapHeightColor(int height) const
+	{
+		unsigned index = static_cast<unsigned>(height - m_heightMapColorTableMin);
+		if (index < m_heightMapColorTable.size())
+			return m_heightMapColorTable[index];
+		return computeMapHeightColor(height);
+	}
 
 private:
+	// The state of rendering map blocks into a pixel buffer. The map is
+	// rendered using a single state, or in strips of block rows by multiple
+	// threads, which each have their own state and pixel buffer.
+	struct RenderState {
+		PixelAttributes *pixels = nullptr;
+		const ColorEntry *nodeIDColor[MAPBLOCK_MAXCOLORS];
+		std::vector<int> nodeIDNameId = std::vector<int>(MAPBLOCK_MAXCOLORS, -1);
+		std::vector<int> nodeIDSurfaceIndex = std::vector<int>(MAPBLOCK_MAXCOLORS, -1);	// BlockSurface index, once used
+		BlockColumnScan::NodeMask nodeMask;		// Visible and opaque nodes of the current block
+		std::vector<const ColorEntry *> nameIdColor;	// Colors of NodeNameTable entries
+		std::vector<bool> nameIdUnknown;		// NodeNameTable entries that have no color, and were encountered
+		std::array<uint16_t, 16> readedPixels;
+		std::array<PixelAttribute, 16> discardedPixels;	// Rendered pixels of a block row that is outside the pixel buffer
+		BlockSurface blockSurface;			// Surface of the current block
+		std::vector<unsigned char> blockData;		// Data of the current block
+		int surfaceHeight{ INT_MIN };
+		int surfaceDepth{ INT_MAX };
+		int yMinMapped{ MAPBLOCK_MAX };
+		int yMaxMapped{ MAPBLOCK_MIN };
+		bool columnComplete{ false };			// All pixels of the current column of blocks were rendered
+	};
+	// Another map that is rendered from the same blocks
+	struct ExtraOutput {
+		TileGenerator *generator;
+		std::string output;
+		std::unique_ptr<RenderState> state;
+	};
+	// A strip of the map (a row of blocks), rendered by a thread
+	struct Strip {
+		PixelAttributes pixels;
+		long long blocksRendered{ 0 };
+		int areaRendered{ 0 };
+		long long emptyMapArea{ 0 };
+	};
+
 	std::string getWorldDatabaseBackend(const std::string &input);
 	int getMapChunkSize(const std::string &input);
 	void openDb(const std::string &input);
 	void closeDb();
 	void sanitizeParameters();
 	void loadBlocks();
-	void createImage();
+	void createImage(const std::string &output);
 	void computeMapParameters(const std::string &input);
+	void computeHeightMapColorTable();
 	void computeTileParameters(
 		// Input parameters
 		int minPos,
@@ -173,12 +240,34 @@ private:
 		int &tileMapEndOffset,
 		// Behavior selection
 		bool ascending);
+	void shareBlocks(const TileGenerator &source);
+	void renderOverlays(const std::string &inputPath, bool heightScale);
 	void renderMap();
+	void renderMapStrips(long long &blocksRendered, int &areaRendered);
+	void pushBlockRows(int zPosLimit);
+	void startBlockRow(int zPos);
+	void readBlockData(const BlockPos &pos, std::vector<unsigned char> &data);
+	bool renderBlock(RenderState &state, const BlockPos &pos, MapBlockPipeline *pipeline);
+	void mergeRenderState(RenderState &state);
+	void selectChangedBlocks();
+	std::vector<uint64_t> hashTileBlocks() const;
+	bool blockColumnTiles(int xPos, int zPos, int &tileX1, int &tileY1, int &tileX2, int &tileY2) const;
 	std::list<int> getZValueList() const;
 	void pushPixelRows(PixelAttributes &pixelAttributes, int zPosLimit);
 	void scalePixelRows(PixelAttributes &pixelAttributes, PixelAttributes &pixelAttributesScaled, int zPosLimit);
-	void processMapBlock(const DB::Block &mapBlock);
-	void renderMapBlock(const MapBlock &mapBlock);
+	void processMapBlock(RenderState &state, const DB::Block &mapBlock);
+	bool mapNodeColors(RenderState &state, const MapBlock &mapBlock);
+	void resolveNodeColors(RenderState &state) const;
+	const ColorEntry *resolveNodeColor(const std::string &name) const;
+	void renderMapBlock(RenderState &state, const MapBlock &mapBlock);
+	template<MapBlock::ContentEncoding Encoding, bool HeightMap, bool DrawAlpha, bool DefaultColor>
+	void renderMapBlockT(RenderState &state, const MapBlock &mapBlock);
+	uint64_t nodeColorsHash() const;
+	uint64_t surfaceHash(const BlockPos &pos, uint64_t dataHash) const;
+	void computeBlockSurface(RenderState &state, const MapBlock &mapBlock);
+	template<MapBlock::ContentEncoding Encoding>
+	void computeBlockSurfaceT(RenderState &state, const MapBlock &mapBlock);
+	void renderBlockSurface(RenderState &state, const BlockPos &pos);
 	void renderScale();
 	void renderHeightScale();
 	void renderOrigin();
@@ -221,6 +310,7 @@ private:
 	bool m_drawPlayers{ false };
 	int m_drawScale{ DRAWSCALE_NONE };
 	bool m_drawAlpha{ false };
+	PixelAttribute::AlphaMixingMode m_alphaMixMode{ PixelAttribute::AlphaMixCumulative };
 	bool m_drawAir{ false };
 	bool m_drawIgnore{ false };
 	bool m_shading{ true };
@@ -231,6 +321,17 @@ private:
 	bool m_blockGeometry{ false };
 	int m_scaleFactor{ 1 };
 	int m_chunkSize{ 0 };
+	int m_threads{ 1 };
+	bool m_parallelStrips{ false };
+	bool m_streamOutput{ false };
+	int m_pngLevel{ -1 };
+	PngEncoder::Filter m_pngFilter{ PngEncoder::Filter::Default };
+	int m_tiledOutputSize{ 0 };
+	int m_tiledOutputLevels{ 1 };
+	bool m_incremental{ false };
+	std::string m_incrementalSettings;
+	std::string m_surfaceCacheFile;
+	long long m_writeImageTime{ 0 };
 	int m_sideScaleMajor{ 0 };
 	int m_sideScaleMinor{ 0 };
 	int m_heightScaleMajor{ 0 };
@@ -244,6 +345,12 @@ private:
 	std::array<long long, BlockPos::STRFORMAT_MAX>  m_databaseFormatFound{ { 0 } };
 	bool m_reportDatabaseFormat{ false };
 	PaintEngine *paintEngine = nullptr;
+	PaintEngine_libgdTiles *m_tilesEngine = nullptr;
+	SurfaceCache *m_surfaceCache = nullptr;
+	std::vector<ExtraOutput> m_extraOutputs;
+	std::mutex m_dbMutex;			// With parallel strips, unless the database supports concurrent reads
+	std::mutex m_errorMutex;
+	int m_unpackErrors{ 0 };
 	PixelAttributes m_blockPixelAttributes;
 	PixelAttributes m_blockPixelAttributesScaled;
 	int m_xMin{ INT_MAX / 16 - 1 };
@@ -287,16 +394,19 @@ private:
 	int m_tileBorderYCount{ 0 };
 	int m_pictWidth;
 	int m_pictHeight;
+	std::vector<int> m_imageColumns;	// Image column of each (scaled) map column
+	std::vector<Color> m_spanColors;	// Pixels of the span that is being written
 	int m_surfaceHeight{ INT_MIN };
 	int m_surfaceDepth{ INT_MAX };
 	std::list<BlockPos> m_positions;
-	NodeID2NameMap m_nameMap;
 	static const ColorEntry *NodeColorNotDrawn;
-	const ColorEntry *m_nodeIDColor[MAPBLOCK_MAXCOLORS];
+	std::vector<bool> m_nameIdUnknown;			// NodeNameTable entries that have no color, and were encountered
 	NodeColorMap m_nodeColors;
 	HeightMapColorList m_heightMapColors;
-	std::array<uint16_t, 16> m_readedPixels;
-	std::set<std::string> m_unknownNodes;
+	std::vector<Color> m_heightMapColorTable;	// From height m_heightMapColorTableMin up
+	int m_heightMapColorTableMin{ 0 };
+	typedef void (TileGenerator::*RenderMapBlockFunction)(RenderState &state, const MapBlock &mapBlock);
+	static const RenderMapBlockFunction m_renderMapBlockFunctions[2][2][2][2];	// [encoding][heightmap][drawalpha][defaultcolor]
 	std::vector<DrawObject> m_drawObjects;
 }; /* -----  end of class TileGenerator  ----- */
 
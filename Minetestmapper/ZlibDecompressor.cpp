@@ -7,14 +7,206 @@
  * =====================================================================
  */
 
-#include <zlib.h>
+#include "build_config.h"
+
 #include <cstdint>
+#include <new>
+#if defined(USE_LIBDEFLATE)
+#include <libdeflate.h>
+#elif defined(USE_ZLIB_NG)
+#include <zlib-ng.h>
+#else
+#include <zlib.h>
+#endif
 #include "ZlibDecompressor.h"
 
+#if defined(USE_LIBDEFLATE)
+
+// libdeflate only decompresses entire streams at once. Streams of unknown size
+// are decompressed into a buffer, which grows as needed, and which is kept for
+// later streams.
+struct ZlibDecompressor::InflateState
+{
+	libdeflate_decompressor *decompressor;
+	std::vector<unsigned char> sink;
+
+	InflateState() : decompressor(libdeflate_alloc_decompressor()), sink(64 * 1024)
+	{
+		if (!decompressor)
+			throw std::bad_alloc();
+	}
+	~InflateState() { libdeflate_free_decompressor(decompressor); }
+
+	static void throwError(libdeflate_result result)
+	{
+		switch (result) {
+		case LIBDEFLATE_BAD_DATA:
+			throw DecompressError("invalid compressed data");
+		case LIBDEFLATE_INSUFFICIENT_SPACE:
+			throw DecompressError("decompressed data too large");
+		default:
+			throw DecompressError();
+		}
+	}
+
+	// Decompress the stream at data into out. Returns the size of the stream.
+	std::size_t decompressInto(const unsigned char *data, std::size_t size, unsigned char *out, std::size_t outSize)
+	{
+		std::size_t streamSize;
+		std::size_t outUsed;
+		libdeflate_result result = libdeflate_zlib_decompress_ex(decompressor, data, size, out, outSize, &streamSize, &outUsed);
+		if (result != LIBDEFLATE_SUCCESS)
+			throwError(result);
+		return streamSize;
+	}
+
+	// Decompress the stream at data into out (or discard it if out is null).
+	// Returns the size of the stream.
+	std::size_t decompressStream(const unsigned char *data, std::size_t size, std::vector<unsigned char> *out)
+	{
+		std::vector<unsigned char> &buffer = out ? *out : sink;
+		if (buffer.size() < sink.size())
+			buffer.resize(sink.size());
+		while (true) {
+			std::size_t streamSize;
+			std::size_t outUsed;
+			libdeflate_result result = libdeflate_zlib_decompress_ex(decompressor, data, size, buffer.data(), buffer.size(), &streamSize, &outUsed);
+			if (result == LIBDEFLATE_INSUFFICIENT_SPACE) {
+				buffer.resize(buffer.size() * 2);
+				continue;
+			}
+			if (result != LIBDEFLATE_SUCCESS)
+				throwError(result);
+			if (out)
+				out->resize(outUsed);
+			return streamSize;
+		}
+	}
+};
+
+std::string ZlibDecompressor::backendName()
+{
+#ifdef LIBDEFLATE_VERSION_STRING
+	return "libdeflate " LIBDEFLATE_VERSION_STRING;
+#else
+	return "libdeflate";
+#endif
+}
+
+#else // zlib or zlib-ng
+
+#ifdef USE_ZLIB_NG
+typedef zng_stream inflate_stream;
+#define ZFUNC(f) zng_##f
+#else
+typedef z_stream inflate_stream;
+#define ZFUNC(f) f
+#endif
+
+// The inflate state is initialized once, and reset for every stream.
+// Streams that are not needed are decompressed into a small sink.
+struct ZlibDecompressor::InflateState
+{
+	inflate_stream strm;
+	bool initialized{ false };
+	std::array<unsigned char, 4096> sink;
+
+	~InflateState()
+	{
+		if (initialized)
+			(void)ZFUNC(inflateEnd)(&strm);
+	}
+
+	void throwError()
+	{
+		if (strm.msg)
+			throw DecompressError(strm.msg);
+		throw DecompressError();
+	}
+
+	void start(const unsigned char *data, std::size_t size)
+	{
+		if (!initialized) {
+			strm.zalloc = nullptr;
+			strm.zfree = nullptr;
+			strm.opaque = nullptr;
+			strm.next_in = nullptr;
+			strm.avail_in = 0;
+			if (ZFUNC(inflateInit)(&strm) != Z_OK) {
+				throwError();
+			}
+			initialized = true;
+		}
+		else if (ZFUNC(inflateReset)(&strm) != Z_OK) {
+			throwError();
+		}
+
+		strm.next_in = const_cast<unsigned char *>(data);
+		strm.avail_in = static_cast<uint32_t>(size);
+	}
+
+	// Decompress the stream at data into out. Returns the size of the stream.
+	std::size_t decompressInto(const unsigned char *data, std::size_t size, unsigned char *out, std::size_t outSize)
+	{
+		start(data, size);
+		strm.avail_out = static_cast<uint32_t>(outSize);
+		strm.next_out = out;
+		if (ZFUNC(inflate)(&strm, Z_FINISH) != Z_STREAM_END) {
+			throwError();
+		}
+		return strm.next_in - data;
+	}
+
+	// Decompress the stream at data into out (or discard it if out is null).
+	// Returns the size of the stream.
+	std::size_t decompressStream(const unsigned char *data, std::size_t size, std::vector<unsigned char> *out)
+	{
+		start(data, size);
+		const size_t BUFSIZE = 16 * 1024;
+		int ret = 0;
+		do {
+			if (out) {
+				size_t used = out->size();
+				out->resize(used + BUFSIZE);
+				strm.avail_out = BUFSIZE;
+				strm.next_out = out->data() + used;
+				ret = ZFUNC(inflate)(&strm, Z_NO_FLUSH);
+				out->resize(used + BUFSIZE - strm.avail_out);
+			}
+			else {
+				strm.avail_out = static_cast<uint32_t>(sink.size());
+				strm.next_out = sink.data();
+				ret = ZFUNC(inflate)(&strm, Z_NO_FLUSH);
+			}
+		} while (ret == Z_OK);
+		if (ret != Z_STREAM_END) {
+			throwError();
+		}
+		return strm.next_in - data;
+	}
+};
+
+std::string ZlibDecompressor::backendName()
+{
+#ifdef USE_ZLIB_NG
+	return std::string("zlib-ng ") + zlibng_version();
+#else
+	return std::string("zlib ") + zlibVersion();
+#endif
+}
+
+#endif // USE_LIBDEFLATE
+
+ZlibDecompressor::ZlibDecompressor() :
+	ZlibDecompressor(nullptr, 0)
+{
+}
+
 ZlibDecompressor::ZlibDecompressor(const unsigned char *data, std::size_t size):
 	m_data(data),
 	m_seekPos(0),
-	m_size(size)
+	m_size(size),
+	m_state(new InflateState)
 {
 }
 
@@ -22,6 +214,13 @@ ZlibDecompressor::~ZlibDecompressor()
 {
 }
 
+void ZlibDecompressor::setData(const unsigned char *data, std::size_t size)
+{
+	m_data = data;
+	m_seekPos = 0;
+	m_size = size;
+}
+
 void ZlibDecompressor::setSeekPos(std::size_t seekPos)
 {
 	m_seekPos = seekPos;
@@ -34,107 +233,17 @@ std::size_t ZlibDecompressor::seekPos() const
 
 std::vector<unsigned char> ZlibDecompressor::decompress()
 {
-	const unsigned char *data = m_data + m_seekPos;
-	const std::size_t size = m_size - m_seekPos;
-
 	std::vector<unsigned char> buffer;
-	const size_t BUFSIZE = 256 * 1024;
-	unsigned char temp_buffer[BUFSIZE];
-
-	z_stream strm;
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
-	strm.next_in = Z_NULL;
-	strm.avail_in = static_cast<uInt>(size);
-
-	if (inflateInit(&strm) != Z_OK) {
-		throw DecompressError(strm.msg);
-	}
-
-	strm.next_in = const_cast<unsigned char *>(data);
-	int ret = 0;
-	do {
-		strm.avail_out = BUFSIZE;
-		strm.next_out = &temp_buffer[0];
-		ret = inflate(&strm, Z_NO_FLUSH);
-		buffer.insert(buffer.end(), &temp_buffer[0], &temp_buffer[BUFSIZE - strm.avail_out]);
-	} while (ret == Z_OK);
-	if (ret != Z_STREAM_END) {
-		throw DecompressError(strm.msg);
-	}
-	m_seekPos += strm.next_in - data;
-	(void)inflateEnd(&strm);
-
+	m_seekPos += m_state->decompressStream(m_data + m_seekPos, m_size - m_seekPos, &buffer);
 	return buffer;
 }
 
 void ZlibDecompressor::decompressVoid()
 {
-	const unsigned char *data = m_data + m_seekPos;
-	const std::size_t size = m_size - m_seekPos;
-
-	//std::vector<unsigned char> buffer;
-	const size_t BUFSIZE = 256 * 1024;
-	unsigned char temp_buffer[BUFSIZE];
-
-	z_stream strm;
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
-	strm.next_in = Z_NULL;
-	strm.avail_in = static_cast<uInt>(size);
-
-	if (inflateInit(&strm) != Z_OK) {
-		throw DecompressError(strm.msg);
-	}
-
-	strm.next_in = const_cast<unsigned char *>(data);
-	int ret = 0;
-	do {
-		strm.avail_out = BUFSIZE;
-		strm.next_out = &temp_buffer[0];
-		ret = inflate(&strm, Z_NO_FLUSH);
-		//buffer.insert(buffer.end(), &temp_buffer[0], &temp_buffer[BUFSIZE - strm.avail_out]);
-	} while (ret == Z_OK);
-	if (ret != Z_STREAM_END) {
-		throw DecompressError(strm.msg);
-	}
-	m_seekPos += strm.next_in - data;
-	(void)inflateEnd(&strm);
-
-	//return buffer;
+	m_seekPos += m_state->decompressStream(m_data + m_seekPos, m_size - m_seekPos, nullptr);
 }
 
-std::array<unsigned char, ZlibDecompressor::nodesBlockSize> ZlibDecompressor::decompressNodes()
+void ZlibDecompressor::decompressNodes(unsigned char *nodes, std::size_t size)
 {
-	const unsigned char *data = m_data + m_seekPos;
-	const std::size_t size = m_size - m_seekPos;
-
-	std::array<unsigned char, ZlibDecompressor::nodesBlockSize> nodes;
-
-	z_stream strm;
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
-	strm.next_in = Z_NULL;
-	strm.avail_in = static_cast<uInt>(size);
-
-	if (inflateInit(&strm) != Z_OK) {
-		throw DecompressError(strm.msg);
-	}
-
-	strm.next_in = const_cast<unsigned char *>(data);
-
-	strm.avail_out = static_cast<uInt>(nodes.size());
-	strm.next_out = nodes.data();
-	//inflate(&strm, Z_NO_FLUSH); // TODO: Test use of Z_FINISH
-	if (inflate(&strm, Z_FINISH) != Z_STREAM_END) {
-		throw DecompressError(strm.msg);
-	}
-	m_seekPos += strm.next_in - data;
-	(void)inflateEnd(&strm);
-
-	return nodes;
+	m_seekPos += m_state->decompressInto(m_data + m_seekPos, m_size - m_seekPos, nodes, size);
 }
-
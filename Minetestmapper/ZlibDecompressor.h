@@ -11,11 +11,16 @@
 
 #include <array>
 #include <cstdlib>
+#include <memory>
 #include <utility>
 #include <string>
 #include <vector>
 
-
+// A decompressor is meant to be reused for many blocks (but only by one thread
+// at a time): the inflate state is allocated once, and reset for every stream.
+//
+// The inflate implementation (zlib, zlib-ng or libdeflate) is selected at
+// build time (INFLATE_BACKEND).
 class ZlibDecompressor
 {
 public:
@@ -24,21 +29,30 @@ public:
 		const std::string message;
 	};
 
+	ZlibDecompressor();
 	ZlibDecompressor(const unsigned char *data, std::size_t size);
 	~ZlibDecompressor();
+	ZlibDecompressor(const ZlibDecompressor &) = delete;
+	ZlibDecompressor &operator=(const ZlibDecompressor &) = delete;
+	void setData(const unsigned char *data, std::size_t size);
 	void setSeekPos(std::size_t seekPos);
 	std::size_t seekPos() const;
 	std::vector<unsigned char> decompress();
 
+	// Decompress a stream, and discard the data
 	void decompressVoid();
 
 	static constexpr const size_t nodesBlockSize = 16 * 16 * 16 * 4;
-	std::array<unsigned char, nodesBlockSize> decompressNodes();
+	// Decompress a stream of at most size bytes into nodes
+	void decompressNodes(unsigned char *nodes, std::size_t size);
+
+	// Name and version of the inflate implementation
+	static std::string backendName();
 
 private:
 	const unsigned char *m_data;
 	std::size_t m_seekPos;
 	std::size_t m_size;
+	struct InflateState;
+	std::unique_ptr<InflateState> m_state;
 }; /* -----  end of class ZlibDecompressor  ----- */
-
-
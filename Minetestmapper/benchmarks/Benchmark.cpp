@@ -0,0 +1,43 @@
+#include "Benchmark.h"
+
+#include <stdexcept>
+
+#include "config.h"
+
+#ifdef USE_SQLITE3
+#include <sqlite3.h>
+#endif
+
+namespace Benchmark {
+
+std::vector<Block> readBlocks(const std::string &world, size_t limit)
+{
+	std::vector<Block> blocks;
+#ifdef USE_SQLITE3
+	std::string name = world + PATH_SEPARATOR + "map.sqlite";
+	sqlite3 *db;
+	if (sqlite3_open_v2(name.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+		std::string error = sqlite3_errmsg(db);
+		sqlite3_close(db);
+		throw std::runtime_error(error + ", Database file: " + name);
+	}
+	sqlite3_stmt *statement;
+	if (sqlite3_prepare_v2(db, "SELECT pos, data FROM blocks", -1, &statement, nullptr) != SQLITE_OK) {
+		std::string error = sqlite3_errmsg(db);
+		sqlite3_close(db);
+		throw std::runtime_error("Failed to prepare SQL statement: " + error);
+	}
+	while (blocks.size() < limit && sqlite3_step(statement) == SQLITE_ROW) {
+		const auto *data = static_cast<const unsigned char *>(sqlite3_column_blob(statement, 1));
+		int size = sqlite3_column_bytes(statement, 1);
+		blocks.emplace_back(sqlite3_column_int64(statement, 0), std::vector<unsigned char>(data, data + size));
+	}
+	sqlite3_finalize(statement);
+	sqlite3_close(db);
+#else
+	throw std::runtime_error("Reading " + world + ": the benchmarks need the sqlite3 backend");
+#endif
+	return blocks;
+}
+
+} // namespace Benchmark
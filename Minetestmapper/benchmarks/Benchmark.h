@@ -0,0 +1,35 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Helpers for the benchmark programs (built with BUILD_BENCHMARKS).
+namespace Benchmark {
+
+	// The shortest duration of run() (in milliseconds), of repeat runs
+	template<typename Run>
+	double bestOf(int repeat, Run run)
+	{
+		double best = 0;
+		for (int i = 0; i < repeat; i++) {
+			auto begin = std::chrono::steady_clock::now();
+			run();
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+			if (i == 0 || ms < best)
+				best = ms;
+		}
+		return best;
+	}
+
+	// The position (as stored in the database) and the data of a map block
+	typedef std::pair<int64_t, std::vector<unsigned char>> Block;
+
+	// Read (at most limit) blocks of the map.sqlite database of a world
+	// directory. Throws std::runtime_error if the database can not be read.
+	std::vector<Block> readBlocks(const std::string &world, size_t limit = SIZE_MAX);
+
+} // namespace Benchmark
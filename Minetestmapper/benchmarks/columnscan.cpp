@@ -0,0 +1,181 @@
+// Column scan benchmark: find the topmost node that is not air (or ignore),
+// and the topmost opaque node (not water, glass, leaves etc.) in every column
+// of the map blocks of a world, using:
+//   per node:	a loop that reads one node at a time (as renderMapBlock
+//		did before the column scan was used)
+//   scalar, ssse3, avx2:	the BlockColumnScan implementations that
+//		this computer supports
+// and report the number of blocks per second. The results of the
+// implementations are checked against those of the per node loop, for the
+// blocks of the world and for random blocks (which have content ids above
+// 255 as well).
+//
+// Usage: benchmark-columnscan <world directory> [<block count> [<repeat count>]]
+
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <random>
+
+#include "Benchmark.h"
+#include "BlockColumnScan.h"
+#include "MapBlock.h"
+#include "TileGenerator.h"
+
+namespace {
+
+// The content ids of the nodes of a block, and their classification
+struct ScanBlock {
+	std::vector<unsigned char> content;
+	BlockColumnScan::NodeMask mask;
+};
+
+// The top and the opaque node of every column
+struct ScanResult {
+	int8_t top[16][16];
+	int8_t opaque[16][16];
+
+	bool operator==(const ScanResult &other) const
+	{
+		return !memcmp(top, other.top, sizeof(top)) && !memcmp(opaque, other.opaque, sizeof(opaque));
+	}
+};
+
+bool maskBit(const uint8_t *bits, int content)
+{
+	return content >= BlockColumnScan::NodeMask::MaxIds || ((bits[content >> 3] >> (content & 7)) & 1);
+}
+
+void findTopNodesPerNode(const ScanBlock &block, ScanResult &result)
+{
+	for (int z = 0; z < 16; z++) {
+		for (int x = 0; x < 16; x++) {
+			result.top[z][x] = -1;
+			result.opaque[z][x] = -1;
+			for (int y = 15; y >= 0; y--) {
+				int pos = (z << 8) + (y << 4) + x;
+				int content = (block.content[pos << 1] << 8) | block.content[(pos << 1) + 1];
+				if (!maskBit(block.mask.visible, content))
+					continue;
+				if (result.top[z][x] < 0)
+					result.top[z][x] = static_cast<int8_t>(y);
+				if (content < BlockColumnScan::NodeMask::MaxIds && maskBit(block.mask.opaque, content)) {
+					result.opaque[z][x] = static_cast<int8_t>(y);
+					break;
+				}
+			}
+		}
+	}
+}
+
+bool isOpaque(const std::string &name)
+{
+	for (const char *translucent : { "water", "lava", "glass", "leaves", "ice" })
+		if (name.find(translucent) != std::string::npos)
+			return false;
+	return true;
+}
+
+// Random blocks: mostly air, with content ids up to 511
+std::vector<ScanBlock> randomBlocks(int count)
+{
+	std::mt19937 random(1);
+	std::vector<ScanBlock> blocks(count);
+	for (ScanBlock &block : blocks) {
+		block.mask.reset();
+		for (int id = 0; id < BlockColumnScan::NodeMask::MaxIds; id++)
+			block.mask.set(id, random() % 4 != 0, random() % 2 != 0);
+		block.content.resize(16 * 16 * 16 * 2);
+		for (size_t i = 0; i < block.content.size(); i += 2) {
+			unsigned content = random() % 2 ? 0 : random() % 512;
+			block.content[i] = static_cast<unsigned char>(content >> 8);
+			block.content[i + 1] = static_cast<unsigned char>(content);
+		}
+		block.mask.set(0, false, false);
+	}
+	return blocks;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		std::cerr << "Usage: " << argv[0] << " <world directory> [<block count> [<repeat count>]]" << std::endl;
+		return 1;
+	}
+	size_t limit = argc > 2 ? std::max(atoi(argv[2]), 1) : 5000;
+	int repeat = argc > 3 ? std::max(atoi(argv[3]), 1) : 5;
+	try {
+		// Only blocks of version 24 and later are scanned
+		std::vector<ScanBlock> blocks;
+		for (const Benchmark::Block &data : Benchmark::readBlocks(argv[1], limit)) {
+			MapBlock mapBlock;
+			try {
+				mapBlock.setData(data.second.data(), data.second.size());
+			}
+			catch (const TileGenerator::UnpackError &) {
+				continue;
+			}
+			catch (const ZlibDecompressor::DecompressError &) {
+				continue;
+			}
+			if (mapBlock.isEmpty() || mapBlock.getContentEncoding() != MapBlock::ContentWide)
+				continue;
+			ScanBlock block;
+			block.content.assign(mapBlock.getMapData(), mapBlock.getMapData() + 16 * 16 * 16 * 2);
+			block.mask.reset();
+			for (const MapBlock::NodeMapping &mapping : mapBlock.getMappings()) {
+				bool visible = mapping.nameId != NodeNameTable::Air && mapping.nameId != NodeNameTable::Ignore;
+				block.mask.set(mapping.nodeId, visible, isOpaque(NodeNameTable::instance().name(mapping.nameId)));
+			}
+			blocks.push_back(std::move(block));
+		}
+		if (blocks.empty()) {
+			std::cerr << "The world has no blocks of version 24 or later" << std::endl;
+			return 1;
+		}
+
+		std::vector<ScanResult> expected(blocks.size());
+		double perNode = Benchmark::bestOf(repeat, [&]() {
+			for (size_t i = 0; i < blocks.size(); i++)
+				findTopNodesPerNode(blocks[i], expected[i]);
+		});
+		std::cout << "Blocks: " << blocks.size() << std::endl;
+		std::cout << std::fixed << std::setprecision(0);
+		std::cout << std::left << std::setw(10) << "per node" << std::right << std::setw(12) << blocks.size() / perNode * 1000 << " blocks/s" << std::endl;
+
+		std::vector<ScanBlock> random = randomBlocks(100);
+		std::vector<ScanResult> randomExpected(random.size());
+		for (size_t i = 0; i < random.size(); i++)
+			findTopNodesPerNode(random[i], randomExpected[i]);
+
+		const std::array<uint16_t, 16> done{};
+		int failed = 0;
+		for (const BlockColumnScan::Implementation &implementation : BlockColumnScan::implementations()) {
+			std::vector<ScanResult> results(blocks.size());
+			double ms = Benchmark::bestOf(repeat, [&]() {
+				for (size_t i = 0; i < blocks.size(); i++)
+					implementation.function(blocks[i].content.data(), 0, 15, blocks[i].mask, done, results[i].top, results[i].opaque);
+			});
+			bool same = results == expected;
+			for (size_t i = 0; i < random.size(); i++) {
+				ScanResult result;
+				implementation.function(random[i].content.data(), 0, 15, random[i].mask, done, result.top, result.opaque);
+				same = same && result == randomExpected[i];
+			}
+			if (!same)
+				failed++;
+			std::cout << std::left << std::setw(10) << implementation.name << std::right << std::setw(12) << blocks.size() / ms * 1000 << " blocks/s"
+				<< "  (" << std::setprecision(1) << perNode / ms << "x)" << std::setprecision(0)
+				<< (same ? "" : "  RESULTS DIFFER") << std::endl;
+		}
+		return failed ? 2 : 0;
+	}
+	catch (const std::exception &e) {
+		std::cerr << "Exception: " << e.what() << std::endl;
+		return 1;
+	}
+}
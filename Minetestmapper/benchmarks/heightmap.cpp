@@ -0,0 +1,92 @@
+// Height map color benchmark: look up the colors of the heights of a
+// 1280x1280 map, going through the full height range (block layers -2048
+// ... 2047) again and again, using:
+//   compute:	TileGenerator::computeMapHeightColor(), which searches the
+//		height map colors (as rendering did before the table was used)
+//   table:	TileGenerator::mapHeightColor(), which looks the color up in
+//		the table of TileGenerator::computeHeightMapColorTable()
+// and report the time of each, and the time to compute the table. The
+// colors of both are checked against each other.
+//
+// Usage: benchmark-heightmap <height map colors file> [<repeat count>]
+// e.g. colors/heightmap-colors-rainbow.txt of the source tree.
+
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include "Benchmark.h"
+#include "TileGenerator.h"
+
+namespace {
+
+const int MinBlockY = -2048;
+const int MaxBlockY = 2047;
+const int Pixels = 1280 * 1280;
+
+// Look up the color of Pixels heights, cycling through the height range.
+// Returns a checksum of the colors.
+template<typename Lookup>
+uint32_t lookUpColors(Lookup lookup)
+{
+	uint32_t checksum = 0;
+	int height = MinBlockY * 16;
+	for (int i = 0; i < Pixels; i++) {
+		checksum = checksum * 31 + lookup(height).to_uint();
+		if (++height == (MaxBlockY + 1) * 16)
+			height = MinBlockY * 16;
+	}
+	return checksum;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		std::cerr << "Usage: " << argv[0] << " <height map colors file> [<repeat count>]" << std::endl;
+		return 1;
+	}
+	int repeat = argc > 2 ? std::max(atoi(argv[2]), 1) : 5;
+	try {
+		TileGenerator generator;
+		generator.setHeightMap(true);
+		{
+			// The parser reports the file it reads on std::cout
+			std::ostringstream log;
+			std::streambuf *out = std::cout.rdbuf(log.rdbuf());
+			generator.parseHeightMapColorsFile(argv[1]);
+			std::cout.rdbuf(out);
+		}
+
+		uint32_t computed = 0;
+		double computeMs = Benchmark::bestOf(repeat, [&]() {
+			computed = lookUpColors([&](int height) { return generator.computeMapHeightColor(height); });
+		});
+		double tableMs = Benchmark::bestOf(repeat, [&]() {
+			generator.computeHeightMapColorTable(MinBlockY, MaxBlockY);
+		});
+		uint32_t looked = 0;
+		double lookupMs = Benchmark::bestOf(repeat, [&]() {
+			looked = lookUpColors([&](int height) { return generator.mapHeightColor(height); });
+		});
+
+		std::cout << "Heights: " << Pixels << " (" << (MaxBlockY - MinBlockY + 1) * 16 << " different)" << std::endl;
+		std::cout << std::fixed << std::setprecision(1);
+		std::cout << std::left << std::setw(10) << "compute" << std::right << std::setw(10) << computeMs << " ms" << std::endl;
+		std::cout << std::left << std::setw(10) << "table" << std::right << std::setw(10) << lookupMs << " ms"
+			<< "  (" << computeMs / lookupMs << "x), computing the table: " << tableMs << " ms" << std::endl;
+		if (computed != looked) {
+			std::cout << "RESULTS DIFFER" << std::endl;
+			return 2;
+		}
+		return 0;
+	}
+	catch (const std::exception &e) {
+		std::cerr << "Exception: " << e.what() << std::endl;
+		return 1;
+	}
+}
@@ -0,0 +1,73 @@
+// Decompression benchmark: decode all map blocks of a world, and report the
+// number of blocks per second:
+//   reused:	using one decompressor for all blocks, like minetestmapper
+//   per block:	using a new decompressor for every block, so that the
+//		inflate state is initialized for every block
+//
+// Usage: benchmark-inflate <world directory> [<repeat count>]
+
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <iomanip>
+
+#include "Benchmark.h"
+#include "MapBlock.h"
+#include "TileGenerator.h"
+#include "ZlibDecompressor.h"
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		std::cerr << "Usage: " << argv[0] << " <world directory> [<repeat count>]" << std::endl;
+		return 1;
+	}
+	int repeat = argc > 2 ? std::max(atoi(argv[2]), 1) : 5;
+	try {
+		std::vector<Benchmark::Block> blocks = Benchmark::readBlocks(argv[1]);
+		if (blocks.empty()) {
+			std::cerr << "The world has no blocks" << std::endl;
+			return 1;
+		}
+		long long errors = 0;
+		MapBlock block;
+		auto decode = [&](const Benchmark::Block &data, ZlibDecompressor &decompressor) {
+			block.reset();
+			try {
+				block.setData(data.second.data(), data.second.size(), decompressor);
+			}
+			catch (const TileGenerator::UnpackError &) {
+				errors++;
+			}
+			catch (const ZlibDecompressor::DecompressError &) {
+				errors++;
+			}
+		};
+
+		ZlibDecompressor decompressor;
+		double reused = Benchmark::bestOf(repeat, [&]() {
+			for (const Benchmark::Block &data : blocks)
+				decode(data, decompressor);
+		});
+		double perBlock = Benchmark::bestOf(repeat, [&]() {
+			for (const Benchmark::Block &data : blocks) {
+				ZlibDecompressor blockDecompressor;
+				decode(data, blockDecompressor);
+			}
+		});
+
+		std::cout << "Inflate backend: " << ZlibDecompressor::backendName() << std::endl;
+		std::cout << "Blocks: " << blocks.size();
+		if (errors)
+			std::cout << " (" << errors / (2 * repeat) << " could not be decoded)";
+		std::cout << std::endl;
+		std::cout << std::fixed << std::setprecision(0);
+		std::cout << "reused:     " << std::setw(10) << blocks.size() / reused * 1000 << " blocks/s" << std::endl;
+		std::cout << "per block:  " << std::setw(10) << blocks.size() / perBlock * 1000 << " blocks/s" << std::endl;
+	}
+	catch (const std::exception &e) {
+		std::cerr << "Exception: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,85 @@
+// Render benchmark: map a world in every render mode that has its own
+// renderMapBlock specialization, and report the best time of each:
+//   color:	colors.txt colors
+//   drawalpha:	colors.txt colors, with --drawalpha
+//   blockcolor:	colors.txt colors, with a --blockcolor default color
+//   heightmap:	--heightmap, with heightmap-nodes.txt and heightmap-colors.txt
+// The colors directory is the one of the source tree (or one that has the
+// same files). Any further options (e.g. --geometry or --threads) are
+// added to every mode.
+//
+// Usage: benchmark-render <world directory> <colors directory> <output file> [<repeat count> [<option>...]]
+
+#include <cstdlib>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include "Benchmark.h"
+#include "Mapper.h"
+
+namespace {
+
+struct Mode {
+	const char *name;
+	std::vector<std::string> options;
+};
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+	if (argc < 4) {
+		std::cerr << "Usage: " << argv[0] << " <world directory> <colors directory> <output file> [<repeat count> [<option>...]]" << std::endl;
+		return 1;
+	}
+	std::string world = argv[1];
+	std::string colors = std::string(argv[2]) + PATH_SEPARATOR;
+	std::string output = argv[3];
+	int repeat = argc > 4 ? std::max(atoi(argv[4]), 1) : 5;
+	std::vector<std::string> extraOptions(argv + std::min(argc, 5), argv + argc);
+
+	const std::vector<Mode> modes = {
+		{ "color", { "--colors", colors + "colors.txt" } },
+		{ "drawalpha", { "--colors", colors + "colors.txt", "--drawalpha" } },
+		{ "blockcolor", { "--colors", colors + "colors.txt", "--blockcolor", "#ff00ff" } },
+		{ "heightmap", { "--heightmap", "--heightmap-nodes", colors + "heightmap-nodes.txt",
+			"--heightmap-colors", colors + "heightmap-colors.txt" } },
+	};
+
+	try {
+		std::cout << std::fixed << std::setprecision(0);
+		for (const Mode &mode : modes) {
+			std::vector<std::string> arguments = { "benchmark-render", "--input", world, "--output", output };
+			arguments.insert(arguments.end(), mode.options.begin(), mode.options.end());
+			arguments.insert(arguments.end(), extraOptions.begin(), extraOptions.end());
+			int status = 0;
+			std::ostringstream log;
+			double ms = Benchmark::bestOf(repeat, [&]() {
+				// Mapper reports its progress and warnings on std::cout and std::cerr
+				std::vector<char *> args;
+				for (std::string &argument : arguments)
+					args.push_back(&argument[0]);
+				args.push_back(nullptr);
+				log.str("");
+				std::streambuf *coutBuffer = std::cout.rdbuf(log.rdbuf());
+				std::streambuf *cerrBuffer = std::cerr.rdbuf(log.rdbuf());
+				Mapper mapper("", "benchmark-render");
+				status |= mapper.start(static_cast<int>(args.size() - 1), args.data());
+				std::cout.rdbuf(coutBuffer);
+				std::cerr.rdbuf(cerrBuffer);
+			});
+			if (status) {
+				std::cerr << "Mapping failed (" << mode.name << "):" << std::endl << log.str();
+				return 1;
+			}
+			std::cout << std::left << std::setw(12) << mode.name << std::right << std::setw(8) << ms << " ms" << std::endl;
+		}
+	}
+	catch (const std::exception &e) {
+		std::cerr << "Exception: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,127 @@
+// Pixel kernel benchmark: shade and downscale lines of random pixels, with
+// empty block columns in between, and report the number of pixels per second
+// and a checksum of the resulting pixels:
+//   shading:	PixelAttributes::renderShading(), without and with drawalpha
+//   1:n:	PixelAttributes::scaleLines() for the scale factors 1:2 ... 1:16
+// benchmark-shading uses the SSE2 kernels (if the compiler targets SSE2),
+// benchmark-shading-scalar is built with PIXELKERNELS_SCALAR and uses the
+// scalar kernels only. Both must report the same checksums.
+//
+// Usage: benchmark-shading [<width> [<repeat count>]]
+
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+
+#include "Benchmark.h"
+#include "PixelAttributes.h"
+
+namespace {
+
+const int Lines = 16;
+
+// Random pixels, of which about 1 in 8 block columns is empty, and 1 in 10
+// pixels has no height.
+void fillRandom(PixelAttributes &pixels, int width)
+{
+	std::mt19937 random(1);
+	for (int y = 0; y < Lines; y++) {
+		PixelAttribute *line = pixels.line(y);
+		for (int x = 0; x < width; x++) {
+			ColorEntry entry(random() & 255, random() & 255, random() & 255, (random() % 4) ? 255 : random() & 255, random() & 255, 0);
+			line[x] = PixelAttribute(entry, (random() % 10) ? double(random() % 8) : NAN);
+		}
+		for (int x = 0; x < width; x += 16) {
+			bool empty = random() % 8 == 0;
+			pixels.setNextEmpty(y, x, empty);
+			if (empty)
+				std::fill(line + x, line + std::min(x + 16, width), PixelAttribute());
+		}
+	}
+	pixels.setLastY(Lines - 1);
+}
+
+uint64_t checksum(PixelAttributes &pixels, int width, int lines)
+{
+	uint64_t sum = 14695981039346656037ull;
+	auto add = [&](unsigned value) {
+		sum = (sum ^ value) * 1099511628211ull;
+	};
+	for (int y = 0; y < lines; y++) {
+		const PixelAttribute *line = pixels.line(y);
+		for (int x = 0; x < width; x++) {
+			add(line[x].red());
+			add(line[x].green());
+			add(line[x].blue());
+			add(line[x].alpha());
+			add(line[x].thicken());
+			add(line[x].is_valid() ? line[x].height() : 0xffff);
+		}
+	}
+	return sum;
+}
+
+// The shortest duration of run() (in milliseconds), of repeat runs, each
+// after setup()
+template<typename Setup, typename Run>
+double bestOf(int repeat, Setup setup, Run run)
+{
+	double best = 0;
+	for (int i = 0; i < repeat; i++) {
+		setup();
+		double ms = Benchmark::bestOf(1, run);
+		if (i == 0 || ms < best)
+			best = ms;
+	}
+	return best;
+}
+
+void report(const char *name, double pixels, double ms, uint64_t sum)
+{
+	std::cout << std::left << std::setw(12) << name << std::right << std::fixed << std::setprecision(1)
+		<< std::setw(8) << pixels / ms / 1000 << " Mpixels/s  checksum " << std::hex << sum << std::dec << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+	int width = argc > 1 ? std::max(atoi(argv[1]), 16) / 16 * 16 : 80000;
+	int repeat = argc > 2 ? std::max(atoi(argv[2]), 1) : 20;
+
+#ifdef PIXELKERNELS_SCALAR
+	std::cout << "Kernels: scalar" << std::endl;
+#else
+	std::cout << "Kernels: default" << std::endl;
+#endif
+	PixelAttributes source;
+	source.setParameters(width, Lines, 0, 1, true);
+	fillRandom(source, width);
+
+	PixelAttributes shaded;
+	shaded.setParameters(width, Lines, 0, 1, true);
+	for (bool drawAlpha : { false, true }) {
+		double ms = bestOf(repeat, [&]() {
+			shaded.reset(0);
+			shaded.copyLines(source, 0, Lines);
+		}, [&]() {
+			shaded.renderShading(1, drawAlpha);
+		});
+		report(drawAlpha ? "shading (a)" : "shading", double(width) * Lines, ms, checksum(shaded, width, Lines));
+	}
+
+	for (int scale : { 2, 4, 8, 16 }) {
+		PixelAttributes scaled;
+		scaled.setParameters(width / scale, Lines / scale, 0, scale, false);
+		double ms = bestOf(repeat, [&]() {
+			scaled.reset(0);
+		}, [&]() {
+			source.scaleLines(scaled, 0, Lines, 0, width);
+		});
+		std::string name = "1:" + std::to_string(scale);
+		report(name.c_str(), double(width) * Lines, ms, checksum(scaled, width / scale, Lines / scale));
+	}
+	return 0;
+}
@@ -65,9 +65,8 @@ const DB::BlockPosList &DBLevelDB::getBlockPosList() {
 	return m_blockPosList;
 }
 
-const DB::Block DBLevelDB::getBlockOnPos(const BlockPos &pos)
+leveldb::Status DBLevelDB::getBlockData(const BlockPos &pos, std::string &datastr)
 {
-	std::string datastr;
 	leveldb::Status status;
 
 
@@ -106,8 +105,16 @@ const DB::Block DBLevelDB::getBlockOnPos(const BlockPos &pos)
 		status = m_db->Get(leveldb::ReadOptions(), pos.databasePosStr(), &datastr);
 	}
 
-	if(status.ok()) {
+	if (status.ok())
 		m_blocksReadCount++;
+	return status;
+}
+
+const DB::Block DBLevelDB::getBlockOnPos(const BlockPos &pos)
+{
+	std::string datastr;
+
+	if(getBlockData(pos, datastr).ok()) {
 		return Block(pos, reinterpret_cast<const unsigned char *>(datastr.c_str()), datastr.size());
 	}
 	else {
@@ -116,4 +123,14 @@ const DB::Block DBLevelDB::getBlockOnPos(const BlockPos &pos)
 
 }
 
+bool DBLevelDB::getBlockDataOnPos(const BlockPos &pos, std::vector<unsigned char> &data)
+{
+	std::string datastr;
+
+	if (!getBlockData(pos, datastr).ok())
+		return false;
+	data.assign(datastr.begin(), datastr.end());
+	return true;
+}
+
 #endif // USE_LEVELDB
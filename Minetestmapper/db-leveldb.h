@@ -13,6 +13,7 @@ public:
 	virtual int getBlocksReadCount(void);
 	virtual const BlockPosList &getBlockPosList();
 	virtual const Block getBlockOnPos(const BlockPos &pos);
+	virtual bool getBlockDataOnPos(const BlockPos &pos, std::vector<unsigned char> &data);
 	~DBLevelDB();
 private:
 	int m_blocksReadCount;
@@ -21,6 +22,8 @@ private:
 	BlockPosList m_blockPosList;
 	unsigned m_keyFormatI64Usage;
 	unsigned m_keyFormatAXYZUsage;
+
+	leveldb::Status getBlockData(const BlockPos &pos, std::string &datastr);
 };
 #endif // USE_LEVELDB
 
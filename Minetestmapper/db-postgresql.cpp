@@ -153,8 +153,15 @@ const DB::BlockPosList &DBPostgreSQL::processBlockPosListQueryResult(PGresult *r
 
 const DB::Block DBPostgreSQL::getBlockOnPos(const BlockPos &pos)
 {
-	Block block(pos, {});
-	
+	std::vector<unsigned char> data;
+	getBlockDataOnPos(pos, data);
+	return Block(pos, data);
+}
+
+bool DBPostgreSQL::getBlockDataOnPos(const BlockPos &pos, std::vector<unsigned char> &data)
+{
+	bool found = false;
+
 	m_blocksQueriedCount++;
 
 	for (int i = 0; i < 3; i++) {
@@ -167,12 +174,14 @@ const DB::Block DBPostgreSQL::getBlockOnPos(const BlockPos &pos)
 			+ (result ? PQresultErrorMessage(result) : "(result was NULL)"));
 
 	if (PQntuples(result) != 0) {
-		block = Block(pos, reinterpret_cast<unsigned char *>(PQgetvalue(result, 0, 0)), PQgetlength(result, 0, 0));
+		const unsigned char *value = reinterpret_cast<unsigned char *>(PQgetvalue(result, 0, 0));
+		data.assign(value, value + PQgetlength(result, 0, 0));
 		m_blocksReadCount++;
+		found = true;
 	}
 
 	PQclear(result);
-	return block;
+	return found;
 }
 
 #endif // USE_POSTGRESQL
@@ -19,6 +19,7 @@ public:
 	virtual const BlockPosList &getBlockPosList();
 	virtual const BlockPosList &getBlockPosList(BlockPos minPos, BlockPos maxPos);
 	virtual const Block getBlockOnPos(const BlockPos &pos);
+	virtual bool getBlockDataOnPos(const BlockPos &pos, std::vector<unsigned char> &data);
 	~DBPostgreSQL();
 private:
 	int m_blocksQueriedCount;
@@ -84,10 +84,15 @@ const DB::BlockPosList &DBRedis::getBlockPosList()
 
 
 const DB::Block DBRedis::getBlockOnPos(const BlockPos &pos)
+{
+	std::vector<unsigned char> data;
+	getBlockDataOnPos(pos, data);
+	return Block(pos, data);
+}
+
+bool DBRedis::getBlockDataOnPos(const BlockPos &pos, std::vector<unsigned char> &data)
 {
 	redisReply *reply;
-	std::string tmp;
-	Block block(pos, {});
 
 	m_blocksQueriedCount++;
 
@@ -96,11 +101,11 @@ const DB::Block DBRedis::getBlockOnPos(const BlockPos &pos)
 		throw std::runtime_error(std::string("redis command 'HGET %s %s' failed: ") + ctx->errstr);
 	if (reply->type == REDIS_REPLY_STRING && reply->len != 0) {
 		m_blocksReadCount++;
-		block = Block(pos, reinterpret_cast<const unsigned char *>(reply->str), reply->len);
+		data.assign(reply->str, reply->str + reply->len);
 	} else
 		throw std::runtime_error("Got wrong response to 'HGET %s %s' command");
 	freeReplyObject(reply);
 
-	return block;
+	return true;
 }
 #endif // USE_REDIS
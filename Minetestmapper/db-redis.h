@@ -15,6 +15,7 @@ public:
 	virtual int getBlocksReadCount(void);
 	virtual const BlockPosList &getBlockPosList();
 	virtual const Block getBlockOnPos(const BlockPos &pos);
+	virtual bool getBlockDataOnPos(const BlockPos &pos, std::vector<unsigned char> &data);
 	~DBRedis();
 private:
 	int m_blocksReadCount;
@@ -2,29 +2,96 @@
 
 #ifdef USE_SQLITE3
 
+#include <algorithm>
 #include <chrono>
+#include <cstdio>
+#include <filesystem>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
 #include <thread>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <fstream>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
 #define DATAVERSION_STATEMENT		"PRAGMA data_version"
 #define BLOCKPOSLIST_STATEMENT		"SELECT pos, rowid FROM blocks"
-#define BLOCKPOSLIST_LIMITED_STATEMENT	"SELECT pos, rowid FROM blocks ORDER BY pos LIMIT ? OFFSET ?"
+#define BLOCKPOSLIST_RANGE_STATEMENT	"SELECT pos, rowid FROM blocks WHERE pos > ? AND pos <= ? ORDER BY pos LIMIT ?"
+#define WORLDEXTENT_STATEMENT		"SELECT (SELECT MIN(pos) FROM blocks), (SELECT MAX(pos) FROM blocks), (SELECT MAX(rowid) FROM blocks)"
 #define BLOCK_STATEMENT_POS		"SELECT pos, data FROM blocks WHERE pos == ?"
 #define BLOCK_STATEMENT_ROWID		"SELECT pos, data FROM blocks WHERE rowid == ?"
+#define BLOCK_STATEMENT_RANGE		"SELECT pos, data FROM blocks WHERE pos BETWEEN ? AND ?"
 
 #define BLOCKLIST_QUERY_SIZE_MIN	2000
 #define BLOCKLIST_QUERY_SIZE_DEFAULT	250000
 
+// The cost of a range query (an index seek), as a number of rows scanned
+#define RANGE_QUERY_COST		16
+
+#define IOPROFILE_CACHE_SIZE		64		// Megabytes
+
+#define READAHEAD_SIZE_DEFAULT		64		// Megabytes
+#define READAHEAD_GAP_MAX		4		// Blocks that are not needed, but may be skipped by a range query
+
 #define sleepMs(x) std::this_thread::sleep_for(std::chrono::milliseconds(x))
 
 using namespace std;
 
+namespace {
+
+// Page faults (major, minor) and bytes read (by read() and similar calls,
+// and from storage) of the process, or -1 if unknown
+void ioCounters(long long counters[4])
+{
+	std::fill(counters, counters + 4, -1);
+#ifndef _WIN32
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+		counters[0] = usage.ru_majflt;
+		counters[1] = usage.ru_minflt;
+	}
+	std::ifstream io("/proc/self/io");
+	std::string name;
+	long long value;
+	while (io >> name >> value) {
+		if (name == "rchar:")
+			counters[2] = value;
+		else if (name == "read_bytes:")
+			counters[3] = value;
+	}
+#endif
+}
+
+// Escape the characters that have a special meaning in a URI
+std::string uriPath(const std::string &path)
+{
+	std::string uri;
+	for (char c : path) {
+		if (c == '%' || c == '?' || c == '#') {
+			char escaped[4];
+			snprintf(escaped, sizeof(escaped), "%%%02X", static_cast<unsigned char>(c));
+			uri += escaped;
+		}
+		else {
+			uri += c;
+		}
+	}
+	return uri;
+}
+
+} // namespace
+
 // If zero, a full block list is obtained using a single query.
 // If negative, the default value (BLOCKLIST_QUERY_SIZE_DEFAULT) will be used.
 int DBSQLite3::m_blockListQuerySize = 0;
+size_t DBSQLite3::m_readAheadSize = 0;
+DBSQLite3::IOProfile DBSQLite3::m_ioProfile = DBSQLite3::IOProfile::Default;
+bool DBSQLite3::m_ioReadAhead = false;
 bool DBSQLite3::m_firstDatabaseInitialized = false;
 bool DBSQLite3::warnDatabaseLockDelay = true;
 
@@ -45,6 +112,36 @@ void DBSQLite3::setLimitBlockListQuerySize(int count)
 	}
 }
 
+// If negative, the default size (READAHEAD_SIZE_DEFAULT) will be used.
+void DBSQLite3::setReadAheadSize(int megabytes)
+{
+	if (megabytes < 0)
+		megabytes = READAHEAD_SIZE_DEFAULT;
+	m_readAheadSize = size_t(megabytes) * 1024 * 1024;
+}
+
+bool DBSQLite3::setIOProfile(const std::string &profile)
+{
+	std::string name = profile;
+	m_ioReadAhead = false;
+	size_t comma = profile.find(',');
+	if (comma != std::string::npos) {
+		if (profile.substr(comma + 1) != "readahead")
+			return false;
+		m_ioReadAhead = true;
+		name = profile.substr(0, comma);
+	}
+	if (name == "default")
+		m_ioProfile = IOProfile::Default;
+	else if (name == "mmap")
+		m_ioProfile = IOProfile::Mmap;
+	else if (name == "snapshot")
+		m_ioProfile = IOProfile::Snapshot;
+	else
+		return false;
+	return true;
+}
+
 DBSQLite3::DBSQLite3(const std::string &mapdir) :
 	m_blocksQueriedCount(0),
 	m_blocksReadCount(0)
@@ -52,25 +149,28 @@ DBSQLite3::DBSQLite3(const std::string &mapdir) :
 
 	m_firstDatabaseInitialized = true;
 	std::string db_name = mapdir + "map.sqlite";
-	if (sqlite3_open_v2(db_name.c_str(), &m_db, SQLITE_OPEN_READONLY | SQLITE_OPEN_PRIVATECACHE, nullptr) != SQLITE_OK) {
-		throw runtime_error(std::string(sqlite3_errmsg(m_db)) + ", Database file: " + db_name);
-	}
-	if (SQLITE_OK != sqlite3_prepare_v2(m_db, DATAVERSION_STATEMENT, sizeof(DATAVERSION_STATEMENT) - 1, &m_dataVersionStatement, nullptr)) {
-		throw runtime_error(string("Failed to prepare SQL statement (dataVersionStatement): ") + sqlite3_errmsg(m_db));
-	}
-	if (m_blockListQuerySize == 0) {
-		if (SQLITE_OK != sqlite3_prepare_v2(m_db, BLOCKPOSLIST_STATEMENT, sizeof(BLOCKPOSLIST_STATEMENT) - 1, &m_blockPosListStatement, nullptr)) {
-			throw runtime_error(string("Failed to prepare SQL statement (blockPosListStatement): ") + sqlite3_errmsg(m_db));
+	m_dbName = db_name;
+	ioCounters(m_ioStartCounters);
+	m_uri = db_name;
+	m_openFlags = SQLITE_OPEN_READONLY | SQLITE_OPEN_PRIVATECACHE;
+	if (m_ioProfile == IOProfile::Snapshot) {
+		// An immutable database is read without locking, and without its
+		// write-ahead log, which would be ignored.
+		std::error_code ec;
+		if (std::filesystem::file_size(db_name + "-wal", ec) > 0 && !ec) {
+			std::cerr << "WARNING: the database has a write-ahead log (it may be in use): not opening it as immutable" << std::endl;
 		}
-	}
-	else {
-		if (SQLITE_OK != sqlite3_prepare_v2(m_db, BLOCKPOSLIST_LIMITED_STATEMENT,
-			sizeof(BLOCKPOSLIST_LIMITED_STATEMENT) - 1, &m_blockPosListStatement, nullptr)) {
-			throw runtime_error(string("Failed to prepare SQL statement (blockPosListStatement (limited)): ") + sqlite3_errmsg(m_db));
+		else {
+			m_uri = "file:" + uriPath(db_name) + "?immutable=1";
+			m_openFlags |= SQLITE_OPEN_URI;
 		}
 	}
-	if (SQLITE_OK != sqlite3_prepare_v2(m_db, BLOCK_STATEMENT_POS, sizeof(BLOCK_STATEMENT_POS) - 1, &m_blockOnPosStatement, nullptr)) {
-		throw runtime_error(string("Failed to prepare SQL statement (blockOnPosStatement): ") + +sqlite3_errmsg(m_db));
+	m_ioSettings = (m_openFlags & SQLITE_OPEN_URI) ? "immutable" : "";
+	m_connections.emplace_back(new Connection);
+	openConnection(*m_connections[0]);
+	m_db = m_connections[0]->db;
+	if (SQLITE_OK != sqlite3_prepare_v2(m_db, BLOCKPOSLIST_STATEMENT, sizeof(BLOCKPOSLIST_STATEMENT) - 1, &m_blockPosListStatement, nullptr)) {
+		throw runtime_error(string("Failed to prepare SQL statement (blockPosListStatement): ") + sqlite3_errmsg(m_db));
 	}
 	if (SQLITE_OK != sqlite3_prepare_v2(m_db, BLOCK_STATEMENT_ROWID, sizeof(BLOCK_STATEMENT_ROWID) - 1, &m_blockOnRowidStatement, nullptr)) {
 		throw runtime_error(string("Failed to prepare SQL statement (blockOnRowidStatement): ") + sqlite3_errmsg(m_db));
@@ -81,13 +181,93 @@ DBSQLite3::~DBSQLite3() {
 	if (m_blockPosListStatement) {
 		sqlite3_finalize(m_blockPosListStatement);
 	}
-	if (m_blockOnPosStatement) {
-		sqlite3_finalize(m_blockOnPosStatement);
-	}
 	if (m_blockOnRowidStatement) {
 		sqlite3_finalize(m_blockOnRowidStatement);
 	}
-	sqlite3_close(m_db);
+	m_connections.clear();
+}
+
+DBSQLite3::Connection::~Connection()
+{
+	for (sqlite3_stmt *statement : { dataVersionStatement, blockPosListRangeStatement, blockOnPosStatement, blockRangeStatement }) {
+		if (statement)
+			sqlite3_finalize(statement);
+	}
+	sqlite3_close(db);
+}
+
+void DBSQLite3::setConnections(int count)
+{
+	while (static_cast<int>(m_connections.size()) < count) {
+		m_connections.emplace_back(new Connection);
+		openConnection(*m_connections.back());
+	}
+}
+
+void DBSQLite3::openConnection(Connection &connection)
+{
+	sqlite3 *db;
+	int result = sqlite3_open_v2(m_uri.c_str(), &db, m_openFlags, nullptr);
+	connection.db = db;
+	if (result != SQLITE_OK) {
+		throw runtime_error(std::string(sqlite3_errmsg(db)) + ", Database file: " + m_dbName);
+	}
+	applyIOProfile(db, &connection == m_connections[0].get());
+	if (SQLITE_OK != sqlite3_prepare_v2(db, DATAVERSION_STATEMENT, sizeof(DATAVERSION_STATEMENT) - 1, &connection.dataVersionStatement, nullptr)) {
+		throw runtime_error(string("Failed to prepare SQL statement (dataVersionStatement): ") + sqlite3_errmsg(db));
+	}
+	if (SQLITE_OK != sqlite3_prepare_v2(db, BLOCKPOSLIST_RANGE_STATEMENT,
+		sizeof(BLOCKPOSLIST_RANGE_STATEMENT) - 1, &connection.blockPosListRangeStatement, nullptr)) {
+		throw runtime_error(string("Failed to prepare SQL statement (blockPosListRangeStatement): ") + sqlite3_errmsg(db));
+	}
+	if (SQLITE_OK != sqlite3_prepare_v2(db, BLOCK_STATEMENT_POS, sizeof(BLOCK_STATEMENT_POS) - 1, &connection.blockOnPosStatement, nullptr)) {
+		throw runtime_error(string("Failed to prepare SQL statement (blockOnPosStatement): ") + sqlite3_errmsg(db));
+	}
+	if (SQLITE_OK != sqlite3_prepare_v2(db, BLOCK_STATEMENT_RANGE, sizeof(BLOCK_STATEMENT_RANGE) - 1, &connection.blockRangeStatement, nullptr)) {
+		throw runtime_error(string("Failed to prepare SQL statement (blockRangeStatement): ") + sqlite3_errmsg(db));
+	}
+}
+
+// The settings are described (for the statistics), and the file is read
+// ahead, for the first connection only.
+void DBSQLite3::applyIOProfile(sqlite3 *db, bool describe)
+{
+	auto addSetting = [&](const std::string &setting) {
+		if (describe)
+			m_ioSettings += (m_ioSettings.empty() ? "" : ", ") + setting;
+	};
+	if (m_ioProfile != IOProfile::Default) {
+		// Map the entire file (SQLite limits the size of the mapping)
+		std::error_code ec;
+		uintmax_t size = std::filesystem::file_size(m_dbName, ec);
+		std::ostringstream pragmas;
+		pragmas << "PRAGMA mmap_size = " << (ec ? 0 : size) << ";"
+			<< "PRAGMA cache_size = " << -IOPROFILE_CACHE_SIZE * 1024 << ";"
+			<< "PRAGMA temp_store = MEMORY;";
+		if (sqlite3_exec(db, pragmas.str().c_str(), nullptr, nullptr, nullptr) != SQLITE_OK)
+			throw runtime_error(string("Failed to set the I/O profile: ") + sqlite3_errmsg(db));
+		sqlite3_stmt *statement;
+		if (describe && sqlite3_prepare_v2(db, "PRAGMA mmap_size", -1, &statement, nullptr) == SQLITE_OK) {
+			if (sqlite3_step(statement) == SQLITE_ROW)
+				addSetting("mmap: " + std::to_string(sqlite3_column_int64(statement, 0) / 1024 / 1024) + "MB");
+			sqlite3_finalize(statement);
+		}
+		addSetting("cache: " + std::to_string(IOPROFILE_CACHE_SIZE) + "MB");
+		addSetting("temp store: memory");
+	}
+	if (m_ioReadAhead && describe) {
+#if !defined(_WIN32) && defined(POSIX_FADV_WILLNEED)
+		// SQLite does not expose its file descriptor, and the access pattern
+		// advice is per descriptor. Ask the kernel to read the file into the
+		// page cache instead.
+		int fd = ::open(m_dbName.c_str(), O_RDONLY);
+		if (fd >= 0) {
+			if (posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED) == 0)
+				addSetting("read ahead");
+			::close(fd);
+		}
+#endif
+	}
 }
 
 int DBSQLite3::getBlocksReadCount()
@@ -100,13 +280,13 @@ int DBSQLite3::getBlocksQueriedCount()
 	return m_blocksQueriedCount;
 }
 
-int64_t DBSQLite3::getDataVersion()
+int64_t DBSQLite3::getDataVersion(Connection &connection)
 {
 	int64_t version = 0;
 	for (;;) {
-		int result = sqlite3_step(m_dataVersionStatement);
+		int result = sqlite3_step(connection.dataVersionStatement);
 		if (result == SQLITE_ROW) {
-			version = sqlite3_column_int64(m_dataVersionStatement, 0);
+			version = sqlite3_column_int64(connection.dataVersionStatement, 0);
 		}
 		else if (result == SQLITE_BUSY) { // Wait some time and try again
 			sleepMs(10);
@@ -115,7 +295,7 @@ int64_t DBSQLite3::getDataVersion()
 			break;
 		}
 	}
-	sqlite3_reset(m_blockPosListStatement);
+	sqlite3_reset(connection.dataVersionStatement);
 	return version;
 }
 
@@ -124,14 +304,48 @@ const DB::BlockPosList &DBSQLite3::getBlockPosList()
 	m_blockPosList.clear();
 
 	m_blockPosListQueryTime = 0;
-	int64_t dataVersionStart = getDataVersion();
+
+	if (m_connections.size() > 1) {
+		// Divide the positions of the world between the connections
+		int64_t first, last;
+		double blocks;
+		if (!getWorldExtent(first, last, blocks))
+			return m_blockPosList;
+		int64_t parts = std::min<int64_t>(m_connections.size(), last - first + 1);
+		// The largest rowid is (about) the number of blocks
+		std::vector<std::pair<int64_t, int64_t>> ranges;
+		for (int64_t i = 0; i < parts; i++) {
+			ranges.emplace_back(first + (last - first + 1) * i / parts, first + (last - first + 1) * (i + 1) / parts - 1);
+			if (i > 0)
+				m_connections[i]->blockPosList.reserve(static_cast<size_t>(blocks / parts));
+		}
+		m_blockPosList.reserve(static_cast<size_t>(blocks));
+		bool modified = queryBlockPosList(ranges);
+		if (m_blockPosListQueryTime >= 1000 && warnDatabaseLockDelay && modified) {
+			std::ostringstream oss;
+			oss << "WARNING: "
+				<< "Maximum block list query duration was "
+				<< m_blockPosListQueryTime / 1000 << "."
+				<< std::fixed << std::setw(3) << std::setfill('0')
+				<< m_blockPosListQueryTime % 1000 << " seconds"
+				<< " while another process modified the database. Consider "
+				<< (m_blockListQuerySize ? "decreasing" : "using") << " --sqlite3-limit-prescan-query-size";
+			std::cout << oss.str() << std::endl;
+		}
+		return m_blockPosList;
+	}
+
+	Connection &connection = *m_connections[0];
+	int64_t dataVersionStart = getDataVersion(connection);
 
 	if (!m_blockListQuerySize) {
 
-		getBlockPosListRows();
+		connection.blockPosListQueryTime = 0;
+		getBlockPosListRows(connection, m_blockPosListStatement, m_blockPosList);
 		sqlite3_reset(m_blockPosListStatement);
+		m_blockPosListQueryTime = connection.blockPosListQueryTime;
 
-		if (m_blockPosListQueryTime >= 1000 && warnDatabaseLockDelay && getDataVersion() != dataVersionStart) {
+		if (m_blockPosListQueryTime >= 1000 && warnDatabaseLockDelay && getDataVersion(connection) != dataVersionStart) {
 			std::ostringstream oss;
 			oss << "WARNING: "
 				<< "Block list query duration was "
@@ -145,46 +359,11 @@ const DB::BlockPosList &DBSQLite3::getBlockPosList()
 		return m_blockPosList;
 	}
 
-	// As queries overlap, remember which id's have been seen to avoid duplicates
-	m_blockIdSet.clear();
-
-	int querySize = 0;
+	connection.blockPosListQueryTime = 0;
+	getBlockPosListRange(connection, INT64_MIN, INT64_MAX, m_blockPosList);
+	m_blockPosListQueryTime = connection.blockPosListQueryTime;
 
-	// Select some more blocks than requested, to make sure that newly inserted
-	// blocks don't cause other blocks to be skipped.
-	// The enforced minimum of 1000 is probably too small to avoid skipped blocks
-	// if heavy world generation is going on, but then, a query size of 10000 is
-	// also pretty small.
-	if (m_blockListQuerySize <= 10000) {
-		querySize = m_blockListQuerySize + 1000;
-	}
-	else if (m_blockListQuerySize <= 100000) {
-		querySize = static_cast<int>(m_blockListQuerySize * 1.1f);            // 1000 .. 10000
-	}
-	else if (m_blockListQuerySize <= 1000000) {
-		querySize = static_cast<int>(m_blockListQuerySize * 1.011f) + 9000;   // 10100 .. 20000
-	}
-	else if (m_blockListQuerySize <= 10000000) {
-		querySize = static_cast<int>(m_blockListQuerySize * 1.0022f) + 18000; // 20200 .. 40000
-	}
-	else {	// More than 10M blocks per query. Most worlds are smaller than this...
-		querySize = static_cast<int>(m_blockListQuerySize * 1.001f) + 30000;  // 40000 .. (130K blocks extra for 100M blocks, etc.)
-	}
-
-	int rows = 1;
-	for (int offset = 0; rows > 0; offset += m_blockListQuerySize) {
-		sqlite3_bind_int(m_blockPosListStatement, 1, querySize);
-		sqlite3_bind_int(m_blockPosListStatement, 2, offset);
-		rows = getBlockPosListRows();
-		sqlite3_reset(m_blockPosListStatement);
-		if (rows > 0) {
-			sleepMs(10);		// Be nice to a concurrent user
-		}
-	}
-
-	m_blockIdSet.clear();
-
-	if (m_blockPosListQueryTime >= 1000 && warnDatabaseLockDelay && getDataVersion() != dataVersionStart) {
+	if (m_blockPosListQueryTime >= 1000 && warnDatabaseLockDelay && getDataVersion(connection) != dataVersionStart) {
 		std::ostringstream oss;
 		oss << "WARNING: "
 			<< "Maximum block list query duration was "
@@ -198,21 +377,171 @@ const DB::BlockPosList &DBSQLite3::getBlockPosList()
 	return m_blockPosList;
 }
 
-int DBSQLite3::getBlockPosListRows()
+const DB::BlockPosList &DBSQLite3::getBlockPosList(BlockPos minPos, BlockPos maxPos)
+{
+	std::vector<std::pair<int64_t, int64_t>> ranges;
+	if (!getBlockPosListRanges(minPos, maxPos, ranges))
+		return getBlockPosList();
+
+	m_blockPosList.clear();
+	m_blockPosListQueryTime = 0;
+	queryBlockPosList(ranges);
+	return m_blockPosList;
+}
+
+// The positions of the first and last blocks, and the (approximate) number
+// of blocks. Returns false if the database is empty.
+bool DBSQLite3::getWorldExtent(int64_t &first, int64_t &last, double &blocks)
+{
+	sqlite3_stmt *statement;
+	if (SQLITE_OK != sqlite3_prepare_v2(m_db, WORLDEXTENT_STATEMENT, sizeof(WORLDEXTENT_STATEMENT) - 1, &statement, nullptr))
+		throw runtime_error(string("Failed to prepare SQL statement (worldExtentStatement): ") + sqlite3_errmsg(m_db));
+	int result;
+	while ((result = sqlite3_step(statement)) == SQLITE_BUSY)
+		sleepMs(10);
+	bool empty = result != SQLITE_ROW || sqlite3_column_type(statement, 0) == SQLITE_NULL;
+	if (!empty) {
+		first = sqlite3_column_int64(statement, 0);
+		last = sqlite3_column_int64(statement, 1);
+		blocks = static_cast<double>(sqlite3_column_int64(statement, 2));
+	}
+	sqlite3_finalize(statement);
+	return !empty;
+}
+
+// The I64 block position is z * 2^24 + y * 2^12 + x. The blocks of the area
+// are read using a range query for every y layer of every z slab (x range),
+// a range query for every z slab (y and x range, including the blocks with
+// other x coordinates between the layers), or a full scan, whichever reads
+// the fewest rows. Returns false for a full scan.
+bool DBSQLite3::getBlockPosListRanges(const BlockPos &minPos, const BlockPos &maxPos, std::vector<std::pair<int64_t, int64_t>> &ranges)
+{
+	int64_t firstPos, lastPos;
+	double worldBlocks;
+	if (!getWorldExtent(firstPos, lastPos, worldBlocks))
+		return false;
+	BlockPos first(firstPos);
+	BlockPos last(lastPos);
+
+	// Positions are ordered by z first, so the z range of the world is known
+	int zMin = std::max(minPos.z(), first.z());
+	int zMax = std::min(maxPos.z(), last.z());
+	if (zMin > zMax)
+		return true;
+	double slabs = zMax - zMin + 1;
+	double layers = slabs * (maxPos.y() - minPos.y() + 1);
+	double slabBlocks = worldBlocks * slabs / (last.z() - first.z() + 1);
+	double areaBlocks = std::min(slabBlocks, layers * (maxPos.x() - minPos.x() + 1));
+	double slabCost = slabs * RANGE_QUERY_COST + slabBlocks;
+	double layerCost = layers * RANGE_QUERY_COST + areaBlocks;
+	if (worldBlocks <= std::min(slabCost, layerCost))
+		return false;
+
+	auto addRange = [&](int64_t from, int64_t to) {
+		if (!ranges.empty() && ranges.back().second + 1 == from)
+			ranges.back().second = to;
+		else
+			ranges.emplace_back(from, to);
+	};
+	for (int64_t z = zMin; z <= zMax; z++) {
+		if (slabCost < layerCost) {
+			addRange(z * 0x1000000 + minPos.y() * 0x1000 + minPos.x(), z * 0x1000000 + maxPos.y() * 0x1000 + maxPos.x());
+			continue;
+		}
+		for (int64_t y = minPos.y(); y <= maxPos.y(); y++)
+			addRange(z * 0x1000000 + y * 0x1000 + minPos.x(), z * 0x1000000 + y * 0x1000 + maxPos.x());
+	}
+	return true;
+}
+
+// Query the blocks of the ranges (first, last; inclusive), dividing them
+// between the connections, each of which reads a contiguous part of the
+// index. The lists of the other connections are appended to that of the
+// first one, so the blocks are sorted. Returns true if the database was modified meanwhile.
+bool DBSQLite3::queryBlockPosList(const std::vector<std::pair<int64_t, int64_t>> &ranges)
+{
+	size_t parts = std::min(m_connections.size(), ranges.size());
+	if (parts == 0)
+		return false;
+	std::vector<std::exception_ptr> errors(parts);
+	std::vector<char> modified(parts);
+	auto queryPart = [&](size_t part) {
+		Connection &connection = *m_connections[part];
+		BlockPosList &list = part == 0 ? m_blockPosList : connection.blockPosList;
+		try {
+			int64_t dataVersionStart = getDataVersion(connection);
+			connection.blockPosListQueryTime = 0;
+			for (size_t i = ranges.size() * part / parts; i < ranges.size() * (part + 1) / parts; i++)
+				getBlockPosListRange(connection, ranges[i].first - 1, ranges[i].second, list);
+			modified[part] = getDataVersion(connection) != dataVersionStart;
+		}
+		catch (...) {
+			errors[part] = std::current_exception();
+		}
+	};
+	if (parts == 1) {
+		queryPart(0);
+	}
+	else {
+		std::vector<std::thread> threads;
+		for (size_t part = 0; part < parts; part++)
+			threads.emplace_back(queryPart, part);
+		for (std::thread &thread : threads)
+			thread.join();
+	}
+
+	bool anyModified = false;
+	size_t size = m_blockPosList.size();
+	for (size_t part = 1; part < parts; part++)
+		size += m_connections[part]->blockPosList.size();
+	m_blockPosList.reserve(size);
+	for (size_t part = 0; part < parts; part++) {
+		if (errors[part])
+			std::rethrow_exception(errors[part]);
+		Connection &connection = *m_connections[part];
+		if (part > 0) {
+			m_blockPosList.insert(m_blockPosList.end(), connection.blockPosList.begin(), connection.blockPosList.end());
+			BlockPosList().swap(connection.blockPosList);
+		}
+		m_blockPosListQueryTime = std::max(m_blockPosListQueryTime, connection.blockPosListQueryTime);
+		anyModified = anyModified || modified[part];
+	}
+	return anyModified;
+}
+
+// Keyset pagination: every query continues after the last block of the
+// previous query, using the index. Blocks that are inserted meanwhile do
+// not cause other blocks to be skipped or listed twice.
+void DBSQLite3::getBlockPosListRange(Connection &connection, int64_t after, int64_t last, BlockPosList &list)
+{
+	sqlite3_stmt *statement = connection.blockPosListRangeStatement;
+	connection.blockPosListLast = after;
+	for (;;) {
+		sqlite3_bind_int64(statement, 1, connection.blockPosListLast);
+		sqlite3_bind_int64(statement, 2, last);
+		sqlite3_bind_int(statement, 3, m_blockListQuerySize ? m_blockListQuerySize : -1);
+		int rows = getBlockPosListRows(connection, statement, list);
+		sqlite3_reset(statement);
+		if (!m_blockListQuerySize || rows < m_blockListQuerySize)
+			break;
+		sleepMs(10);		// Be nice to a concurrent user
+	}
+}
+
+int DBSQLite3::getBlockPosListRows(Connection &connection, sqlite3_stmt *statement, BlockPosList &list)
 {
 	int rows = 0;
 
 	auto time0 = std::chrono::steady_clock::now();
 
 	while (true) {
-		int result = sqlite3_step(m_blockPosListStatement);
+		int result = sqlite3_step(statement);
 		if (result == SQLITE_ROW) {
 			rows++;
-			sqlite3_int64 blocknum = sqlite3_column_int64(m_blockPosListStatement, 0);
-			sqlite3_int64 rowid = sqlite3_column_int64(m_blockPosListStatement, 1);
-			if (!m_blockListQuerySize || m_blockIdSet.insert(blocknum).second) {
-				m_blockPosList.push_back(BlockPos(blocknum, rowid));
-			}
+			sqlite3_int64 blocknum = sqlite3_column_int64(statement, 0);
+			sqlite3_int64 rowid = sqlite3_column_int64(statement, 1);
+			list.push_back(BlockPos(blocknum, rowid));
+			connection.blockPosListLast = blocknum;
 		}
 		else if (result == SQLITE_BUSY) { // Wait some time and try again
 			sleepMs(10);
@@ -224,19 +553,17 @@ int DBSQLite3::getBlockPosListRows()
 
 	auto time1 = std::chrono::steady_clock::now();
 	uint64_t diff = std::chrono::duration_cast<std::chrono::nanoseconds>(time1 - time0).count();
-	if (diff > m_blockPosListQueryTime) {
-		m_blockPosListQueryTime = diff;
+	if (diff > connection.blockPosListQueryTime) {
+		connection.blockPosListQueryTime = diff;
 	}
 
 	return rows;
 }
 
 
-const DB::Block DBSQLite3::getBlockOnPos(const BlockPos &pos)
+// The connection must be locked by the caller
+sqlite3_stmt *DBSQLite3::stepBlockOnPos(Connection &connection, const BlockPos &pos)
 {
-	static thread_local MapBlock block;
-	block.reset();
-	block.setPos(pos);
 	int result = 0;
 
 	m_blocksQueriedCount++;
@@ -250,18 +577,15 @@ const DB::Block DBSQLite3::getBlockOnPos(const BlockPos &pos)
 		sqlite3_bind_int64(m_blockOnRowidStatement, 1, pos.databasePosId());
 	}
 	else {
-		statement = m_blockOnPosStatement;
-		sqlite3_bind_int64(m_blockOnPosStatement, 1, pos.databasePosI64());
+		statement = connection.blockOnPosStatement;
+		sqlite3_bind_int64(statement, 1, pos.databasePosI64());
 	}
 
+	m_queryCount++;
+	auto time0 = std::chrono::steady_clock::now();
 	while (true) {
 		result = sqlite3_step(statement);
 		if (result == SQLITE_ROW) {
-			//const auto *data = static_cast<const unsigned char *>(sqlite3_column_blob(statement, 1));
-			int size = sqlite3_column_bytes(statement, 1);
-			//block = MapBlock(pos, sqlite3_column_blob(statement, 1), size);
-			block.setData(sqlite3_column_blob(statement, 1), size);
-			//block.second.assign(&data[0], &data[size]);
 			m_blocksReadCount++;
 			break;
 		}
@@ -272,9 +596,256 @@ const DB::Block DBSQLite3::getBlockOnPos(const BlockPos &pos)
 			break;
 		}
 	}
+	m_queryTime += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - time0).count();
+	if (result == SQLITE_ROW)
+		return statement;
 	sqlite3_reset(statement);
 
+	return nullptr;
+}
+
+const DB::Block DBSQLite3::getBlockOnPos(const BlockPos &pos)
+{
+	static thread_local MapBlock block;
+	block.reset();
+	block.setPos(pos);
+
+	static thread_local std::vector<unsigned char> data;
+	if (takeCachedBlock(pos, data)) {
+		block.setData(data.data(), data.size());
+		return block;
+	}
+
+	Connection &connection = this->connection(pos.z());
+	std::lock_guard<std::mutex> lock(connection.mutex);
+	sqlite3_stmt *statement = stepBlockOnPos(connection, pos);
+	if (statement) {
+		int size = sqlite3_column_bytes(statement, 1);
+		try {
+			block.setData(sqlite3_column_blob(statement, 1), size);
+		}
+		catch (...) {
+			// Don't leave the statement active if the block is corrupt.
+			sqlite3_reset(statement);
+			throw;
+		}
+		sqlite3_reset(statement);
+	}
+
 	return block;
 }
 
+bool DBSQLite3::getBlockDataOnPos(const BlockPos &pos, std::vector<unsigned char> &data)
+{
+	if (takeCachedBlock(pos, data))
+		return true;
+
+	Connection &connection = this->connection(pos.z());
+	std::lock_guard<std::mutex> lock(connection.mutex);
+	sqlite3_stmt *statement = stepBlockOnPos(connection, pos);
+	if (!statement)
+		return false;
+
+	const auto *blob = static_cast<const unsigned char *>(sqlite3_column_blob(statement, 1));
+	int size = sqlite3_column_bytes(statement, 1);
+	data.assign(blob, blob + size);
+	sqlite3_reset(statement);
+
+	return true;
+}
+
+void DBSQLite3::setReadAhead(const std::list<BlockPos> &positions)
+{
+	startReadAhead(positions, m_readAheadSize);
+}
+
+void DBSQLite3::setReadAheadAll(const std::list<BlockPos> &positions)
+{
+	startReadAhead(positions, m_readAheadSize ? m_readAheadSize : size_t(READAHEAD_SIZE_DEFAULT) * 1024 * 1024);
+}
+
+void DBSQLite3::startReadAhead(const std::list<BlockPos> &positions, size_t cacheSize)
+{
+	std::lock_guard<std::mutex> lock(m_readAheadMutex);
+	m_readAheadRows.clear();
+	m_readAheadRowsRead.clear();
+	m_blockCache.clear();
+	m_blockCacheBytes = 0;
+	m_cacheSize = cacheSize;
+	if (!cacheSize)
+		return;
+	for (const BlockPos &pos : positions)
+		m_readAheadRows[pos.z()].push_back(pos.databasePosI64());
+	for (auto &row : m_readAheadRows)
+		std::sort(row.second.begin(), row.second.end());
+}
+
+// Obtain the data of a block from the cache, reading its row first if that
+// was not done yet. Blocks that are not cached (e.g. because the cache was
+// full) are queried individually by the caller.
+bool DBSQLite3::takeCachedBlock(const BlockPos &pos, std::vector<unsigned char> &data)
+{
+	if (!m_cacheSize)
+		return false;
+	std::unique_lock<std::mutex> lock(m_readAheadMutex);
+	if (m_readAheadRows.empty() && m_blockCache.empty())
+		return false;
+	auto row = m_readAheadRows.find(pos.z());
+	if (row != m_readAheadRows.end()) {
+		std::vector<int64_t> blocks = std::move(row->second);
+		m_readAheadRows.erase(row);
+		// Other threads may use the cache while the row is read
+		lock.unlock();
+		readAheadRow(pos.z(), std::move(blocks));
+		lock.lock();
+	}
+	auto block = m_blockCache.find(pos.databasePosI64());
+	if (block == m_blockCache.end())
+		return false;
+	m_blocksQueriedCount++;
+	m_blocksReadCount++;
+	m_blocksReadAheadUsed++;
+	m_blockCacheBytes -= block->second.size();
+	data.swap(block->second);
+	m_blockCache.erase(block);
+	return true;
+}
+
+// The I64 block position is z * 2^24 + y * 2^12 + x, so the blocks of a row
+// with the same y are a contiguous range of positions. Blocks that are close
+// together are read using a single range query.
+void DBSQLite3::readAheadRow(int z, std::vector<int64_t> &&blocks)
+{
+	// Rows are used in order (or almost, when rendering strips in parallel):
+	// make room by dropping the blocks of the rows that were read first.
+	size_t room;
+	{
+		std::lock_guard<std::mutex> lock(m_readAheadMutex);
+		size_t cacheSize = m_cacheSize;
+		while (!m_readAheadRowsRead.empty() && m_blockCacheBytes > cacheSize / 2) {
+			uncacheRow(m_readAheadRowsRead.front().second);
+			m_readAheadRowsRead.pop_front();
+		}
+		room = m_blockCacheBytes < cacheSize ? cacheSize - m_blockCacheBytes : 0;
+	}
+	BlockCache cache;
+	size_t bytes = 0;
+	{
+		Connection &connection = this->connection(z);
+		std::lock_guard<std::mutex> lock(connection.mutex);
+		for (size_t first = 0; first < blocks.size() && bytes < room; ) {
+			size_t last = first;
+			while (last + 1 < blocks.size() && blocks[last + 1] - blocks[last] <= READAHEAD_GAP_MAX)
+				last++;
+			sqlite3_bind_int64(connection.blockRangeStatement, 1, blocks[first]);
+			sqlite3_bind_int64(connection.blockRangeStatement, 2, blocks[last]);
+			cacheBlocks(connection.blockRangeStatement, blocks, cache, bytes);
+			sqlite3_reset(connection.blockRangeStatement);
+			first = last + 1;
+		}
+	}
+	// Other threads may have cached rows while this one was read: only keep
+	// the blocks that still fit. The others are queried when they are used.
+	std::lock_guard<std::mutex> lock(m_readAheadMutex);
+	size_t cacheSize = m_cacheSize;
+	for (auto &block : cache) {
+		if (m_blockCacheBytes + block.second.size() > cacheSize)
+			continue;
+		std::vector<unsigned char> &data = m_blockCache[block.first];
+		m_blockCacheBytes -= data.size();
+		data.swap(block.second);
+		m_blockCacheBytes += data.size();
+	}
+	m_readAheadRowsRead.emplace_back(z, std::move(blocks));
+}
+
+// Store the blocks returned by the statement (only those that are needed)
+void DBSQLite3::cacheBlocks(sqlite3_stmt *SQLstatement, const std::vector<int64_t> &blocks, BlockCache &cache, size_t &bytes)
+{
+	m_queryCount++;
+	auto time0 = std::chrono::steady_clock::now();
+	while (true) {
+		int result = sqlite3_step(SQLstatement);
+		if (result == SQLITE_ROW) {
+			int64_t pos = sqlite3_column_int64(SQLstatement, 0);
+			if (!std::binary_search(blocks.begin(), blocks.end(), pos))
+				continue;
+			const auto *blob = static_cast<const unsigned char *>(sqlite3_column_blob(SQLstatement, 1));
+			int size = sqlite3_column_bytes(SQLstatement, 1);
+			std::vector<unsigned char> &data = cache[pos];
+			bytes -= data.size();
+			data.assign(blob, blob + size);
+			bytes += data.size();
+			m_blocksReadAhead++;
+		}
+		else if (result == SQLITE_BUSY) { // Wait some time and try again
+			sleepMs(10);
+		}
+		else {
+			break;
+		}
+	}
+	m_queryTime += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - time0).count();
+}
+
+// The read ahead mutex must be locked by the caller
+void DBSQLite3::uncacheRow(const std::vector<int64_t> &blocks)
+{
+	for (int64_t pos : blocks) {
+		auto block = m_blockCache.find(pos);
+		if (block != m_blockCache.end()) {
+			m_blockCacheBytes -= block->second.size();
+			m_blockCache.erase(block);
+		}
+	}
+}
+
+void DBSQLite3::printStatistics(std::ostream &out)
+{
+	out << "Database:  connections: " << m_connections.size() << ";  queries: " << m_queryCount;
+	if (m_blocksQueriedCount)
+		out << std::fixed << std::setprecision(3) << " (" << 1.0 * m_queryCount / m_blocksQueriedCount << " per block)";
+	out << ";  query time: " << m_queryTime / 1000000 << "ms";
+	if (m_blocksReadAhead)
+		out << ";  blocks read ahead: " << m_blocksReadAhead << " (used: " << m_blocksReadAheadUsed << ")";
+	out << std::endl;
+	long long counters[4];
+	ioCounters(counters);
+	out << "Database I/O:  profile: ";
+	switch (m_ioProfile) {
+	case IOProfile::Default: out << "default"; break;
+	case IOProfile::Mmap: out << "mmap"; break;
+	case IOProfile::Snapshot: out << "snapshot"; break;
+	}
+	if (!m_ioSettings.empty())
+		out << " (" << m_ioSettings << ")";
+	if (counters[0] >= 0)
+		out << ";  page faults: " << counters[0] - m_ioStartCounters[0] << " major, " << counters[1] - m_ioStartCounters[1] << " minor";
+	if (counters[2] >= 0)
+		out << ";  read: " << (counters[2] - m_ioStartCounters[2]) / 1024 << "KB";
+	if (counters[3] >= 0)
+		out << " (from storage: " << (counters[3] - m_ioStartCounters[3]) / 1024 << "KB)";
+	out << std::endl;
+}
+
+// The sizes and modification times of the database file and its write-ahead
+// log. Minetest does not record when blocks change.
+std::string DBSQLite3::getChangeSignature()
+{
+	ostringstream signature;
+	for (const string &name : { m_dbName, m_dbName + "-wal" }) {
+		std::error_code ec;
+		auto size = std::filesystem::file_size(name, ec);
+		if (ec) {
+			signature << "-;";
+			continue;
+		}
+		auto time = std::filesystem::last_write_time(name, ec);
+		if (ec)
+			return string();
+		signature << size << "@" << time.time_since_epoch().count() << ";";
+	}
+	return signature.str();
+}
+
 #endif // USE_SQLITE3
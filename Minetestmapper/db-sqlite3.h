@@ -4,49 +4,109 @@
 #ifdef USE_SQLITE3
 
 #include "db.h"
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <sqlite3.h>
 #include <string>
 #include <unordered_map>
-#include <unordered_set>
 
 
 class DBSQLite3 : public DB {
 	typedef std::unordered_map<int64_t, std::vector<unsigned char>>  BlockCache;
-	typedef std::unordered_set<int64_t>  BlockIdSet;
 
 public:
 	DBSQLite3(const std::string &mapdir);
 	virtual int getBlocksQueriedCount(void);
 	virtual int getBlocksReadCount(void);
 	virtual const BlockPosList &getBlockPosList();
+	virtual const BlockPosList &getBlockPosList(BlockPos minPos, BlockPos maxPos);
 	virtual const Block getBlockOnPos(const BlockPos &pos);
+	virtual bool getBlockDataOnPos(const BlockPos &pos, std::vector<unsigned char> &data);
+	virtual std::string getChangeSignature();
+	virtual void setReadAhead(const std::list<BlockPos> &positions);
+	virtual void setReadAheadAll(const std::list<BlockPos> &positions);
+	virtual void printStatistics(std::ostream &out);
+	virtual bool concurrentReads() { return m_connections.size() > 1; }
 	~DBSQLite3();
 
+	// Use count read-only connections (one for every thread that reads
+	// blocks). The blocks are divided between the connections by z
+	// coordinate, and the block list is queried using all of them.
+	void setConnections(int count);
+
 	static void setLimitBlockListQuerySize(int count = -1);
+	// Read the blocks of a row (same z) using range queries, when the first
+	// block of the row is needed, keeping at most (approximately) megabytes
+	// of block data in memory. 0 disables reading ahead.
+	static void setReadAheadSize(int megabytes = -1);
+	// Set the I/O profile: default, mmap or snapshot, optionally followed by
+	// ',readahead'. Returns false if the profile is not valid.
+	static bool setIOProfile(const std::string &profile);
 	static bool warnDatabaseLockDelay;
 private:
 	static int m_blockListQuerySize;
+	static size_t m_readAheadSize;
+	enum class IOProfile { Default, Mmap, Snapshot };
+	static IOProfile m_ioProfile;
+	static bool m_ioReadAhead;
 	static bool m_firstDatabaseInitialized;
 
-	int m_blocksQueriedCount;
-	int m_blocksReadCount;
-	sqlite3 *m_db = nullptr;
-	sqlite3_stmt *m_dataVersionStatement = nullptr;
+	// A connection to the database, with its own statements. It is used
+	// by one thread at a time.
+	struct Connection {
+		sqlite3 *db = nullptr;
+		sqlite3_stmt *dataVersionStatement = nullptr;
+		sqlite3_stmt *blockPosListRangeStatement = nullptr;
+		sqlite3_stmt *blockOnPosStatement = nullptr;
+		sqlite3_stmt *blockRangeStatement = nullptr;
+		std::mutex mutex;			// Held while the block statements are used
+		BlockPosList blockPosList;		// Blocks listed by this connection
+		int64_t blockPosListLast;		// The last block of the previous block list query (of a range)
+		uint64_t blockPosListQueryTime;		// Duration of the longest block list query
+		~Connection();
+	};
+
+	std::atomic<int> m_blocksQueriedCount;
+	std::atomic<int> m_blocksReadCount;
+	std::string m_dbName;
+	std::string m_uri;
+	int m_openFlags;
+	std::vector<std::unique_ptr<Connection>> m_connections;
+	sqlite3 *m_db = nullptr;		// The first connection
 	sqlite3_stmt *m_blockPosListStatement = nullptr;
-	sqlite3_stmt *m_blockOnPosStatement = nullptr;
 	sqlite3_stmt *m_blockOnRowidStatement = nullptr;
-	std::ostringstream  m_getBlockSetStatementBlocks;
-	BlockCache  m_blockCache;
+	std::atomic<size_t> m_cacheSize{ 0 };	// Read ahead size of the current positions (0: no read ahead)
+	std::mutex m_readAheadMutex;		// For the members below, up to m_readAheadRowsRead
+	BlockCache  m_blockCache;		// Blocks read ahead, until they are used
+	size_t m_blockCacheBytes = 0;
+	std::unordered_map<int, std::vector<int64_t>> m_readAheadRows;	// The blocks of the rows (z) that were not read yet
+	std::deque<std::pair<int, std::vector<int64_t>>> m_readAheadRowsRead;	// The blocks of the rows that are cached, oldest first
+	std::string m_ioSettings;		// Description of the I/O profile, as used
+	long long m_ioStartCounters[4];		// See ioCounters()
+	std::atomic<long long> m_queryCount{ 0 };
+	std::atomic<uint64_t> m_queryTime{ 0 };
+	std::atomic<long long> m_blocksReadAhead{ 0 };
+	std::atomic<long long> m_blocksReadAheadUsed{ 0 };
 	BlockPosList m_blockPosList;
-	BlockIdSet m_blockIdSet;		// temporary storage. Only used if m_blockListQuerySize > 0
-
 	uint64_t m_blockPosListQueryTime;
 
-	int64_t getDataVersion();
-	void prepareBlockOnPosStatement();
-	int getBlockPosListRows();
-	Block getBlockOnPosRaw(const BlockPos &pos);
-	void cacheBlocks(sqlite3_stmt *SQLstatement);
+	void openConnection(Connection &connection);
+	void applyIOProfile(sqlite3 *db, bool describe);
+	Connection &connection(int z) { int n = static_cast<int>(m_connections.size()); return *m_connections[((z % n) + n) % n]; }
+	int64_t getDataVersion(Connection &connection);
+	bool getWorldExtent(int64_t &first, int64_t &last, double &blocks);
+	bool getBlockPosListRanges(const BlockPos &minPos, const BlockPos &maxPos, std::vector<std::pair<int64_t, int64_t>> &ranges);
+	bool queryBlockPosList(const std::vector<std::pair<int64_t, int64_t>> &ranges);
+	void getBlockPosListRange(Connection &connection, int64_t after, int64_t last, BlockPosList &list);
+	int getBlockPosListRows(Connection &connection, sqlite3_stmt *statement, BlockPosList &list);
+	sqlite3_stmt *stepBlockOnPos(Connection &connection, const BlockPos &pos);
+	void startReadAhead(const std::list<BlockPos> &positions, size_t cacheSize);
+	bool takeCachedBlock(const BlockPos &pos, std::vector<unsigned char> &data);
+	void readAheadRow(int z, std::vector<int64_t> &&blocks);
+	void cacheBlocks(sqlite3_stmt *SQLstatement, const std::vector<int64_t> &blocks, BlockCache &cache, size_t &bytes);
+	void uncacheRow(const std::vector<int64_t> &blocks);
 };
 
 #endif // USE_SQLITE3
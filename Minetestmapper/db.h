@@ -2,6 +2,8 @@
 #define _DB_H
 
 #include <cstdint>
+#include <iosfwd>
+#include <list>
 #include <vector>
 #include <string>
 #include <utility>
@@ -21,6 +23,23 @@ public:
 	virtual int getBlocksQueriedCount(void)=0;
 	virtual int getBlocksReadCount(void)=0;
 	virtual const Block getBlockOnPos(const BlockPos &pos)=0;
+	// Read the serialized data of a block, without decoding it.
+	// Returns false if the block does not exist.
+	virtual bool getBlockDataOnPos(const BlockPos &pos, std::vector<unsigned char> &data)=0;
+	// A string that changes whenever the contents of the database change
+	// (e.g. the sizes and times of the database files). Empty if unknown.
+	virtual std::string getChangeSignature() { return std::string(); }
+	// The positions of the blocks that will be requested, in order. A
+	// database may use them to read blocks ahead.
+	virtual void setReadAhead(const std::list<BlockPos> &) {}
+	// Like setReadAhead(), for blocks that will all be used (e.g. to hash
+	// them), so that reading them ahead is worthwhile even if it was not
+	// enabled.
+	virtual void setReadAheadAll(const std::list<BlockPos> &positions) { setReadAhead(positions); }
+	// Print database statistics (for --verbose), if there are any
+	virtual void printStatistics(std::ostream &) {}
+	// Whether blocks may be read by multiple threads concurrently
+	virtual bool concurrentReads() { return false; }
 };
 
 #endif // _DB_H
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <cstdint>
 #include <cstring>
+#include <string>
 
 inline std::string strlower(const std::string &s)
 {
@@ -10,3 +12,38 @@ inline std::string strlower(const std::string &s)
 		sl[i] = tolower(sl[i]);
 	return sl;
 }
+
+// Fast 64-bit hashes, to detect changes (they are not cryptographic).
+inline uint64_t hashMix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+inline uint64_t hashCombine(uint64_t h, uint64_t value)
+{
+	return hashMix(h ^ (hashMix(value) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2)));
+}
+
+inline uint64_t hashBytes(const void *data, size_t size, uint64_t seed = 0)
+{
+	const unsigned char *p = static_cast<const unsigned char *>(data);
+	uint64_t h = seed ^ (size * 0x9e3779b97f4a7c15ULL);
+	for (; size >= 8; p += 8, size -= 8) {
+		uint64_t word;
+		memcpy(&word, p, 8);
+		h = (h ^ hashMix(word)) * 0x9e3779b97f4a7c15ULL;
+	}
+	uint64_t word = 0;
+	memcpy(&word, p, size);
+	return hashMix(h ^ hashMix(word ^ size));
+}
+
+inline uint64_t hashString(const std::string &s, uint64_t seed = 0)
+{
+	return hashBytes(s.data(), s.size(), seed);
+}
@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+"""Check that --stream-output writes the same images as the in-memory paint
+engine: map a world in a number of configurations with and without
+--stream-output, and compare the pixels.
+
+Usage: compare-stream-output.py <minetestmapper> <world directory> [<option>...]
+
+The options are added to every configuration."""
+
+import os
+import sys
+import tempfile
+
+from maptest import COLORS_DIR, compare_images, fail, run_mapper
+
+COLORS = os.path.join(COLORS_DIR, 'colors.txt')
+
+CONFIGURATIONS = [
+	['--colors', COLORS],
+	['--colors', COLORS, '--drawscale', '--draworigin', '--drawplayers'],
+	['--colors', COLORS, '--drawscale=left', '--sidescale-interval', '20,5'],
+	['--colors', COLORS, '--tiles', '50+2', '--blockcolor', '#ff00ff'],
+	['--colors', COLORS, '--tiles', '64', '--scalefactor', '1:4'],
+	['--colors', COLORS, '--scalefactor', '1:2', '--noshading'],
+	['--colors', os.path.join(COLORS_DIR, 'colors-average-alpha.txt'), '--drawalpha=average'],
+	['--heightmap', '--heightmap-nodes', os.path.join(COLORS_DIR, 'heightmap-nodes.txt'),
+		'--heightmap-colors', os.path.join(COLORS_DIR, 'heightmap-colors.txt'), '--drawheightscale'],
+	['--colors', COLORS, '--drawline', '-40,-40:40,40 red', '--drawcircle', '0,0:30x20 #00ff00',
+		'--drawrectangle', '-20,-20:20,20 blue', '--drawtext', '0,0 white Text', '--drawmaparrow', '5,5:60,20 yellow'],
+	# Points in the first band, in later bands, and outside the image
+	['--colors', COLORS, '--drawmappoint', '1,1 red', '--drawmappoint', '10,3 #00ff00', '--drawmappoint', '7,15 blue',
+		'--drawmappoint', '20,16 red', '--drawmappoint', '30,40 white', '--drawmappoint', '-5,2 red',
+		'--drawmappoint', '3,-5 red', '--drawmappoint', '100000,5 red', '--drawmappoint', '5,100000 red'],
+	['--colors', COLORS, '--tiles', '32', '--drawpoint', '0,0 red', '--drawmappoint', '2,2 white',
+		'--drawmappoint', '12,33 white', '--drawmappoint', '-1,-1 white'],
+]
+
+
+def main():
+	if len(sys.argv) < 3:
+		fail(__doc__.strip())
+	mapper, world = sys.argv[1:3]
+	options = sys.argv[3:]
+	failed = 0
+	with tempfile.TemporaryDirectory() as directory:
+		for number, configuration in enumerate(CONFIGURATIONS, 1):
+			expected = os.path.join(directory, 'memory%d.png' % number)
+			actual = os.path.join(directory, 'stream%d.png' % number)
+			run_mapper(mapper, world, expected, configuration + options)
+			run_mapper(mapper, world, actual, configuration + options + ['--stream-output'])
+			difference = compare_images(expected, actual)
+			print('%s %2d: %s' % ('FAIL' if difference else 'ok  ', number, ' '.join(configuration)))
+			if difference:
+				print('         %s' % difference)
+				failed += 1
+	if failed:
+		fail('%d of %d configurations differ' % (failed, len(CONFIGURATIONS)))
+
+
+if __name__ == '__main__':
+	main()
@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+"""Check the rendering of minetestmapper against reference images: map a small
+generated world (see testworld.py) in 20 configurations (color modes,
+transparency, height maps, scale factors, tiles and figures), and compare the
+images with those in golden/. Every channel of every pixel may differ by at
+most 1 from the reference, which allows for the rounding of the fixed point
+pixel values and of the downscaling sums.
+
+Usage: golden-image-test.py [--update] <minetestmapper> [<option>...]
+
+The options are added to every configuration. With --update, the reference
+images are replaced by the images of this minetestmapper (check them!)."""
+
+import os
+import shutil
+import sys
+import tempfile
+
+from maptest import COLORS_DIR, UTIL_DIR, compare_images, fail, run_mapper
+from testworld import make_world
+
+GOLDEN_DIR = os.path.join(UTIL_DIR, 'golden')
+TOLERANCE = 1
+
+COLORS = os.path.join(COLORS_DIR, 'colors.txt')
+AVERAGE_ALPHA = os.path.join(COLORS_DIR, 'colors-average-alpha.txt')
+CUMULATIVE_ALPHA = os.path.join(COLORS_DIR, 'colors-cumulative-alpha.txt')
+HEIGHTMAP_NODES = os.path.join(COLORS_DIR, 'heightmap-nodes.txt')
+HEIGHTMAP_COLORS = os.path.join(COLORS_DIR, 'heightmap-colors.txt')
+HEIGHTMAP_RAINBOW = os.path.join(COLORS_DIR, 'heightmap-colors-rainbow.txt')
+
+CONFIGURATIONS = [
+	('colors', ['--colors', COLORS]),
+	('noshading', ['--colors', COLORS, '--noshading']),
+	('blockcolor', ['--colors', COLORS, '--blockcolor', '#ff00ff', '--bgcolor', '#203040']),
+	('min-max-y', ['--colors', COLORS, '--min-y', '-5', '--max-y', '4']),
+	('alpha-average', ['--colors', AVERAGE_ALPHA, '--drawalpha=average']),
+	('alpha-cumulative', ['--colors', CUMULATIVE_ALPHA, '--drawalpha=cumulative']),
+	('alpha-cumulative-darken', ['--colors', CUMULATIVE_ALPHA, '--drawalpha=cumulative-darken']),
+	('alpha-none', ['--colors', AVERAGE_ALPHA, '--drawalpha=none']),
+	('scale-1-2', ['--colors', COLORS, '--scalefactor', '1:2']),
+	('scale-1-4', ['--colors', COLORS, '--scalefactor', '1:4']),
+	('scale-1-8', ['--colors', COLORS, '--scalefactor', '1:8', '--noshading']),
+	('scale-1-16', ['--colors', COLORS, '--scalefactor', '1:16']),
+	('scale-1-2-alpha', ['--colors', AVERAGE_ALPHA, '--drawalpha=average', '--scalefactor', '1:2']),
+	('scale-1-4-alpha', ['--colors', CUMULATIVE_ALPHA, '--drawalpha=cumulative-darken', '--scalefactor', '1:4']),
+	('heightmap', ['--heightmap', '--heightmap-nodes', HEIGHTMAP_NODES, '--heightmap-colors', HEIGHTMAP_COLORS]),
+	('heightmap-rainbow', ['--heightmap', '--heightmap-nodes', HEIGHTMAP_NODES, '--heightmap-colors', HEIGHTMAP_RAINBOW,
+		'--heightmap-yscale', '2', '--height-level-0', '-4']),
+	('heightmap-red-scale-1-2', ['--heightmap=red', '--heightmap-nodes', HEIGHTMAP_NODES, '--scalefactor', '1:2']),
+	('tiles', ['--colors', COLORS, '--tiles', '32+1', '--tilebordercolor', '#000000']),
+	('figures', ['--colors', COLORS, '--drawscale', '--draworigin', '--drawplayers',
+		'--drawcircle', '0,0:40x30 red', '--drawtext', '-60,40 white Text']),
+	('geometry', ['--colors', AVERAGE_ALPHA, '--drawalpha=average', '--geometry', '-50,-40:70x60', '--noshading']),
+]
+
+
+def main():
+	arguments = sys.argv[1:]
+	update = '--update' in arguments[:1]
+	if update:
+		arguments = arguments[1:]
+	if not arguments:
+		fail(__doc__.strip())
+	mapper = arguments[0]
+	options = arguments[1:]
+	failed = 0
+	with tempfile.TemporaryDirectory() as directory:
+		world = os.path.join(directory, 'world')
+		make_world(world)
+		for number, (name, configuration) in enumerate(CONFIGURATIONS, 1):
+			image = '%02d-%s.png' % (number, name)
+			expected = os.path.join(GOLDEN_DIR, image)
+			actual = os.path.join(directory, image)
+			run_mapper(mapper, world, actual, configuration + options)
+			if update:
+				os.makedirs(GOLDEN_DIR, exist_ok=True)
+				shutil.copyfile(actual, expected)
+				print('updated %s' % image)
+				continue
+			difference = compare_images(expected, actual, TOLERANCE)
+			print('%s %s' % ('FAIL' if difference else 'ok  ', image))
+			if difference:
+				print('     %s' % difference)
+				failed += 1
+	if failed:
+		fail('%d of %d images differ' % (failed, len(CONFIGURATIONS)))
+
+
+if __name__ == '__main__':
+	main()
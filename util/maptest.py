@@ -0,0 +1,107 @@
+"""Helpers for the map test scripts: run minetestmapper, and read and compare
+the PNG images that it writes."""
+
+import os
+import struct
+import subprocess
+import sys
+import zlib
+
+UTIL_DIR = os.path.dirname(os.path.abspath(__file__))
+COLORS_DIR = os.path.join(os.path.dirname(UTIL_DIR), 'colors')
+
+
+def run_mapper(mapper, world, output, options):
+	"""Map world to output using the given options. Raises RuntimeError if
+	minetestmapper fails."""
+	command = [mapper, '--input', world, '--output', output] + list(options)
+	result = subprocess.run(command, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, universal_newlines=True)
+	if result.returncode != 0:
+		raise RuntimeError('%s failed (exit status %d):\n%s' % (' '.join(command), result.returncode, result.stdout))
+
+
+def read_png(path):
+	"""The width, height and RGB pixel rows (bytes) of a PNG file. Only the
+	formats written by minetestmapper (8-bit RGB or RGBA, not interlaced) are
+	supported; alpha is dropped."""
+	with open(path, 'rb') as f:
+		data = f.read()
+	if data[:8] != b'\x89PNG\r\n\x1a\n':
+		raise ValueError('%s: not a PNG file' % path)
+	pos = 8
+	idat = []
+	header = None
+	while pos < len(data):
+		length, = struct.unpack('>I', data[pos:pos + 4])
+		chunk = data[pos + 4:pos + 8]
+		body = data[pos + 8:pos + 8 + length]
+		if chunk == b'IHDR':
+			header = struct.unpack('>IIBBBBB', body)
+		elif chunk == b'IDAT':
+			idat.append(body)
+		elif chunk == b'IEND':
+			break
+		pos += 12 + length
+	if not header:
+		raise ValueError('%s: no PNG header' % path)
+	width, height, depth, color_type, _, _, interlace = header
+	if depth != 8 or color_type not in (2, 6) or interlace:
+		raise ValueError('%s: unsupported PNG format (depth %d, color type %d, interlace %d)' % (path, depth, color_type, interlace))
+	bpp = 3 if color_type == 2 else 4
+	stride = width * bpp
+	raw = zlib.decompress(b''.join(idat))
+	rows = []
+	previous = bytearray(stride)
+	for y in range(height):
+		offset = y * (stride + 1)
+		kind = raw[offset]
+		line = bytearray(raw[offset + 1:offset + 1 + stride])
+		for i in range(stride):
+			a = line[i - bpp] if i >= bpp else 0
+			b = previous[i]
+			c = previous[i - bpp] if i >= bpp else 0
+			if kind == 1:
+				line[i] = (line[i] + a) & 255
+			elif kind == 2:
+				line[i] = (line[i] + b) & 255
+			elif kind == 3:
+				line[i] = (line[i] + (a + b) // 2) & 255
+			elif kind == 4:
+				p = a + b - c
+				pa, pb, pc = abs(p - a), abs(p - b), abs(p - c)
+				line[i] = (line[i] + (a if pa <= pb and pa <= pc else b if pb <= pc else c)) & 255
+		previous = line
+		if bpp == 4:
+			del line[3::4]
+		rows.append(bytes(line))
+	return width, height, rows
+
+
+def compare_images(expected, actual, tolerance=0):
+	"""None if the images have the same size, and their channels differ by at
+	most tolerance; a description of the difference otherwise."""
+	expected_width, expected_height, expected_rows = read_png(expected)
+	actual_width, actual_height, actual_rows = read_png(actual)
+	if (expected_width, expected_height) != (actual_width, actual_height):
+		return 'size %dx%d instead of %dx%d' % (actual_width, actual_height, expected_width, expected_height)
+	maximum = 0
+	count = 0
+	first = None
+	for y in range(expected_height):
+		if expected_rows[y] == actual_rows[y]:
+			continue
+		for i, (e, a) in enumerate(zip(expected_rows[y], actual_rows[y])):
+			difference = abs(e - a)
+			if difference > tolerance:
+				count += 1
+				if first is None:
+					first = (i // 3, y)
+			maximum = max(maximum, difference)
+	if count:
+		return '%d channels differ by more than %d (at most %d), the first at pixel %d,%d' % (count, tolerance, maximum, first[0], first[1])
+	return None
+
+
+def fail(message):
+	print(message, file=sys.stderr)
+	sys.exit(1)
@@ -0,0 +1,82 @@
+"""A small generated world for the map test scripts: hills of stone, sand
+and grass, lakes of water, and a few glass and unknown nodes, with two
+players. The world is the same every time it is generated."""
+
+import math
+import os
+import random
+import sqlite3
+import struct
+import zlib
+
+RADIUS = 5	# In blocks, around the origin
+
+
+def _height(x, z):
+	return int(8 * math.sin(x / 23.0) + 6 * math.cos(z / 17.0) + 3 * math.sin((x + z) / 7.0))
+
+
+def _node(x, y, z, rnd):
+	h = _height(x, z)
+	if y < h - 3:
+		return 'default:stone'
+	if y < h:
+		return 'default:sand' if h < 1 else 'default:stone'
+	if y == h:
+		return 'default:dirt_with_grass' if h >= 1 else 'default:sand'
+	if y <= 0:
+		return 'default:water_source'
+	value = rnd.random()
+	if value < 0.001:
+		return 'mymod:unknown'
+	if value < 0.0015:
+		return 'default:glass'
+	return 'air'
+
+
+def _block(bx, by, bz, rnd):
+	"""The serialized data of a map block (version 28)."""
+	ids = {}
+	content = [0] * 4096
+	for z in range(16):
+		for y in range(16):
+			for x in range(16):
+				name = _node(bx * 16 + x, by * 16 + y, bz * 16 + z, rnd)
+				content[x + y * 16 + z * 256] = ids.setdefault(name, len(ids))
+	nodes = b''.join(struct.pack('>H', value) for value in content) + bytes(4096) + bytes(4096)
+	data = bytes([28, 0]) + struct.pack('>H', 0xffff) + bytes([2, 2])
+	data += zlib.compress(nodes)
+	data += zlib.compress(b'\x00')			# Metadata
+	data += bytes([0]) + struct.pack('>H', 0)	# Static objects
+	data += struct.pack('>I', 0)			# Timestamp
+	data += bytes([0]) + struct.pack('>H', len(ids))
+	for name, value in ids.items():
+		data += struct.pack('>H', value) + struct.pack('>H', len(name)) + name.encode()
+	data += bytes([10]) + struct.pack('>H', 0)	# Node timers
+	return data
+
+
+def make_world(directory):
+	"""Generate the world in directory (which must not contain a world)."""
+	os.makedirs(os.path.join(directory, 'players'))
+	with open(os.path.join(directory, 'world.mt'), 'w') as f:
+		f.write('backend = sqlite3\n')
+	for name, position in (('alice', (100, 20, -300)), ('bob', (-250, 50, 400))):
+		with open(os.path.join(directory, 'players', name), 'w') as f:
+			f.write('name = %s\nposition = (%d,%d,%d)\n' % ((name,) + position))
+	rnd = random.Random(1)
+	blocks = []
+	for bz in range(-RADIUS, RADIUS):
+		for bx in range(-RADIUS, RADIUS):
+			if bx * bx + bz * bz > RADIUS * RADIUS:
+				continue
+			for by in range(-2, 2):
+				# Leave a few holes
+				if rnd.random() < 0.03:
+					continue
+				blocks.append((bz * 16777216 + by * 4096 + bx, _block(bx, by, bz, rnd)))
+	database = sqlite3.connect(os.path.join(directory, 'map.sqlite'))
+	database.execute('CREATE TABLE blocks (pos INT PRIMARY KEY, data BLOB)')
+	database.executemany('INSERT INTO blocks VALUES (?, ?)', blocks)
+	database.commit()
+	database.close()